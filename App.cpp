@@ -1,6 +1,11 @@
 #include "modules/Starter.hpp"
 #include "modules/AppCommon.hpp"
 #include "modules/TextMaker.hpp"
+#include "modules/LightGrid.hpp"
+#include "modules/LightBVH.hpp"
+#include "modules/ShadowAtlas.hpp"
+#include "modules/ResourceCache.hpp"
+#include "modules/SceneLoader.hpp"
 #include "modules/Scene.hpp"
 
 #define HIDE_TEXT false
@@ -10,7 +15,7 @@ class App : public BaseProject {
 protected:
 
     /* Descriptor set layouts. */
-    DescriptorSetLayout ObjectDSL, SourceDSL, LightDSL, ArtDSL, UserInterfaceDSL;
+    DescriptorSetLayout ObjectDSL, TextureDSL, SourceDSL, LightDSL, GBufferDSL, ArtDSL, UserInterfaceDSL;
 
 
     /* Vertex descriptors. */
@@ -18,7 +23,7 @@ protected:
 
 
     /* Pipelines. */
-    Pipeline ToonP, PhongP, SourceP, MenuP, SkyboxP;
+    Pipeline ToonP, PhongP, SourceP, MenuP, SkyboxP, DeferredP, DepthP;
 
 
     /* Texts. */
@@ -32,6 +37,7 @@ protected:
     std::unordered_map<SceneId, Scene *> scenes;
     std::unordered_map<SceneId, std::vector<VertexDescriptorRef>> SceneVDRs;
     std::unordered_map<SceneId, std::vector<PipelineRef>> ScenePRs;
+    ResourceCache resources;
 
 
     // Application config.
@@ -39,6 +45,7 @@ protected:
 
     bool changingScene = false;
     bool updateText = false;
+    bool depthPrePass = false;
 
     void setWindowParameters() override {
         windowWidth = 1200;
@@ -60,21 +67,35 @@ protected:
         for (const auto &sceneId: sceneIds) {
             scenes[sceneId] = nullptr;
         }
+        resources.init(this);
 
 
         ObjectDSL.init(this, {
             {0, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,          VK_SHADER_STAGE_VERTEX_BIT,     sizeof(ObjectUniform),  1},
-            {1, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,  VK_SHADER_STAGE_FRAGMENT_BIT,   0,                      1},
             {2, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,          VK_SHADER_STAGE_FRAGMENT_BIT,   sizeof(ArgsUniform),    1}
         });
+        // Level textures all use the default sampler state: it is baked into the layout
+        TextureDSL.init(this, {
+            {0, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,  VK_SHADER_STAGE_FRAGMENT_BIT,   0,                      MAX_SCENE_TEXTURES,
+                getSampler(Texture::samplerInfo())}
+        }, true);
         SourceDSL.init(this, {
             {0, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,          VK_SHADER_STAGE_ALL_GRAPHICS,   sizeof(SourceUniform),  1},
             {1, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,  VK_SHADER_STAGE_FRAGMENT_BIT,   0,                      1},
             {2, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,          VK_SHADER_STAGE_FRAGMENT_BIT,   sizeof(BooleanUniform), 1}
         });
         LightDSL.init(this, {
-            {0, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,          VK_SHADER_STAGE_FRAGMENT_BIT,   sizeof(LightUniform),   1}
-		});
+            {0, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,          VK_SHADER_STAGE_FRAGMENT_BIT,   sizeof(LightUniform),   1},
+            {1, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,          VK_SHADER_STAGE_FRAGMENT_BIT,   sizeof(LightData) * MAX_SCENE_LIGHTS, 1},
+            {2, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,          VK_SHADER_STAGE_FRAGMENT_BIT,   sizeof(ClusterGrid),    1},
+            {3, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,          VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT, sizeof(ShadowUniform), 1},
+            {4, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,  VK_SHADER_STAGE_FRAGMENT_BIT,   0,                      1}
+		}, true);
+        GBufferDSL.init(this, {
+            {0, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,  VK_SHADER_STAGE_FRAGMENT_BIT,   0,                      1},
+            {1, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,  VK_SHADER_STAGE_FRAGMENT_BIT,   1,                      1},
+            {2, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,  VK_SHADER_STAGE_FRAGMENT_BIT,   2,                      1}
+        }, true);
         ArtDSL.init(this, {
             {0, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,  VK_SHADER_STAGE_FRAGMENT_BIT,   0,  1},
         });
@@ -88,9 +109,9 @@ protected:
         ObjectVD.init(this, {
                 {0, sizeof(ObjectVertex), VK_VERTEX_INPUT_RATE_VERTEX}
             }, {
-                {0, 0, VK_FORMAT_R32G32B32_SFLOAT,  offsetof(ObjectVertex, pos),    sizeof(glm::vec3),  POSITION},
-                {0, 1, VK_FORMAT_R32G32B32_SFLOAT,  offsetof(ObjectVertex, norm),   sizeof(glm::vec3),  NORMAL},
-                {0, 2, VK_FORMAT_R32G32_SFLOAT,     offsetof(ObjectVertex, UV),     sizeof(glm::vec2),  UV}
+                {0, 0, VK_FORMAT_R16G16B16A16_SNORM, offsetof(ObjectVertex, pos),   sizeof(ObjectVertex::pos),  POSITION},
+                {0, 1, VK_FORMAT_R16G16_SNORM,       offsetof(ObjectVertex, norm),  sizeof(ObjectVertex::norm), NORMAL},
+                {0, 2, VK_FORMAT_R16G16_SFLOAT,      offsetof(ObjectVertex, UV),    sizeof(ObjectVertex::UV),   UV}
             }
         );
         SourceVD.init(this, {
@@ -108,8 +129,37 @@ protected:
             }
         );
 
-        ToonP.init(this, &ObjectVD, "shaders/Shader.vert.spv", "shaders/Toon.frag.spv", {&LightDSL, &ObjectDSL});
-        PhongP.init(this, &ObjectVD, "shaders/Shader.vert.spv", "shaders/Phong.frag.spv", {&LightDSL, &ObjectDSL});
+        // Deferred path: Phong and Toon only fill the G-buffer, the lighting is done by DeferredP
+        // The texture of an instance is picked from the scene texture table by InstancePushConstant
+        ToonP.init(this, &ObjectVD, "shaders/Shader.vert.spv",
+                   deferred ? "shaders/GBufferToon.frag.spv" : "shaders/Toon.frag.spv",
+                   {&LightDSL, &ObjectDSL, &TextureDSL});
+        ToonP.setGBuffer(deferred);
+        ToonP.setPushConstants(VK_SHADER_STAGE_FRAGMENT_BIT, sizeof(InstancePushConstant));
+        PhongP.init(this, &ObjectVD, "shaders/Shader.vert.spv",
+                    deferred ? "shaders/GBufferPhong.frag.spv" : "shaders/Phong.frag.spv",
+                    {&LightDSL, &ObjectDSL, &TextureDSL});
+        PhongP.setGBuffer(deferred);
+        PhongP.setPushConstants(VK_SHADER_STAGE_FRAGMENT_BIT, sizeof(InstancePushConstant));
+        // Depth pre-pass: Phong and Toon only shade the fragments whose depth was laid down by DepthP
+        if (depthPrePass && deferred) {
+            std::cout << "The depth pre-pass is not used by the deferred renderer\n";
+            depthPrePass = false;
+        }
+        if (depthPrePass) {
+            DepthP.init(this, &ObjectVD, "shaders/Shader.vert.spv", "shaders/Depth.frag.spv",
+                        {&LightDSL, &ObjectDSL, &TextureDSL});
+            DepthP.setWriteMask(false, true);
+            ToonP.setAdvancedFeatures(VK_COMPARE_OP_EQUAL, VK_POLYGON_MODE_FILL, VK_CULL_MODE_BACK_BIT, false);
+            ToonP.setWriteMask(true, false);
+            PhongP.setAdvancedFeatures(VK_COMPARE_OP_EQUAL, VK_POLYGON_MODE_FILL, VK_CULL_MODE_BACK_BIT, false);
+            PhongP.setWriteMask(true, false);
+        }
+        if (deferred) {
+            DeferredP.init(this, &BackgroundVD, "shaders/Deferred.vert.spv", "shaders/Deferred.frag.spv",
+                           {&LightDSL, &GBufferDSL});
+            DeferredP.setAdvancedFeatures(VK_COMPARE_OP_LESS, VK_POLYGON_MODE_FILL, VK_CULL_MODE_NONE, false);
+        }
         SourceP.init(this, &SourceVD, "shaders/Emission.vert.spv", "shaders/Emission.frag.spv", {&SourceDSL});
         SkyboxP.init(this, &BackgroundVD, "shaders/Skybox.vert.spv", "shaders/Skybox.frag.spv", {&ArtDSL});
         SkyboxP.setAdvancedFeatures(VK_COMPARE_OP_LESS_OR_EQUAL, VK_POLYGON_MODE_FILL, VK_CULL_MODE_NONE, true);
@@ -134,12 +184,16 @@ protected:
         std::vector<VertexDescriptorRef> MenuVDRs = { MenuVDR, BackgroundVDR };
 
         // Define pipeline references per scene.
-        PipelineRef ToonPR{}, PhongPR{}, SourcePR{}, MenuPR{}, BackgroundPR{};
-        ToonPR.init("toon", &ToonP);
-        PhongPR.init("phong", &PhongP);
+        PipelineRef ToonPR{}, PhongPR{}, SourcePR{}, MenuPR{}, BackgroundPR{}, DeferredPR{};
+        ToonPR.init("toon", &ToonP, depthPrePass ? &DepthP : nullptr);
+        PhongPR.init("phong", &PhongP, depthPrePass ? &DepthP : nullptr);
         SourcePR.init("emission", &SourceP);
         BackgroundPR.init("skybox", &SkyboxP);
         std::vector<PipelineRef> LevelScenePRs = {ToonPR, PhongPR, SourcePR, BackgroundPR };
+        if (deferred) {
+            DeferredPR.init("deferred", &DeferredP);
+            LevelScenePRs.push_back(DeferredPR);
+        }
 
         MenuPR.init("menu", &MenuP);
         std::vector<PipelineRef> MenuPRs = { MenuPR, BackgroundPR };
@@ -167,6 +221,10 @@ protected:
         txt.pipelinesAndDescriptorSetsInit();
         MenuP.create();
         SkyboxP.create();
+        if (deferred)
+            DeferredP.create();
+        if (depthPrePass)
+            DepthP.create();
         scenes[currSceneId]->pipelinesAndDescriptorSetsInit();
     }
 
@@ -177,6 +235,10 @@ protected:
         txt.pipelinesAndDescriptorSetsCleanup();
         MenuP.cleanup();
         SkyboxP.cleanup();
+        if (deferred)
+            DeferredP.cleanup();
+        if (depthPrePass)
+            DepthP.cleanup();
         scenes[currSceneId]->pipelinesAndDescriptorSetsCleanup();
     }
 
@@ -187,10 +249,13 @@ protected:
                 free(scenes[sceneId]);
             }
         }
+        resources.cleanup();
 
         ObjectDSL.cleanup();
+        TextureDSL.cleanup();
         SourceDSL.cleanup();
         LightDSL.cleanup();
+        GBufferDSL.cleanup();
         ArtDSL.cleanup();
         UserInterfaceDSL.cleanup();
 
@@ -199,16 +264,35 @@ protected:
         SourceP.destroy();
         MenuP.destroy();
         SkyboxP.destroy();
+        if (deferred)
+            DeferredP.destroy();
+        if (depthPrePass)
+            DepthP.destroy();
 
         txt.localCleanup();
     }
 
+    void populateFrameCommandBuffer(VkCommandBuffer commandBuffer, int currentImage) override {
+        scenes[currSceneId]->populateFrameCommandBuffer(commandBuffer, currentImage);
+    }
+
+    void populateGBufferCommandBuffer(VkCommandBuffer commandBuffer, int currentImage) override {
+        scenes[currSceneId]->populateCommandBuffer(commandBuffer, currentImage, true);
+    }
+
     void populateCommandBuffer(VkCommandBuffer commandBuffer, int currentImage) override {
         txt.populateCommandBuffer(commandBuffer, currentImage);
         scenes[currSceneId]->populateCommandBuffer(commandBuffer, currentImage);
     }
 
     void updateUniformBuffer(uint32_t currentImage) override {
+        // F9 cycles the anti-aliasing tiers
+        static bool aaKeyDown = false;
+        bool aaKey = glfwGetKey(window, GLFW_KEY_F9) == GLFW_PRESS;
+        if (aaKey && !aaKeyDown)
+            cycleAntiAliasing();
+        aaKeyDown = aaKey;
+
         float deltaT;
         auto m = glm::vec3(0.0f), r = glm::vec3(0.0f);
         bool fire;
@@ -233,6 +317,7 @@ protected:
             framebufferResized = true;
         }
         scenes[_newSceneId] = getNewSceneById(_newSceneId);
+        scenes[_newSceneId]->setResourceCache(&resources);
         scenes[_newSceneId]->init(this, SceneVDRs.find(_newSceneId)->second, ScenePRs.find(_newSceneId)->second,
                                   sceneFiles.find(_newSceneId)->second);
         newSceneId = _newSceneId;
@@ -275,6 +360,12 @@ protected:
         framebufferResized = true;
     }
 
+public:
+    // Must be chosen before run()
+    void setDepthPrePass(bool _depthPrePass) {
+        depthPrePass = _depthPrePass;
+    }
+
 protected:
     void recreateSwapChain() override {
         int width = 0, height = 0;
@@ -297,6 +388,7 @@ protected:
             scenes[currSceneId] = nullptr;
             currSceneId = newSceneId;
             changingScene = false;
+            resources.trim();
         }
 
         if (updateText) {
@@ -307,10 +399,13 @@ protected:
 
         createSwapChain();
         createImageViews();
+        applyAntiAliasing();
         createRenderPass();
         createColorResources();
         createDepthResources();
         createFramebuffers();
+        createGBufferResources();
+        createPostResources();
         createDescriptorPool();
 
         pipelinesAndDescriptorSetsInit();
@@ -321,9 +416,39 @@ protected:
 };
 
 
-int main() {
+int main(int argc, char *argv[]) {
     App app;
 
+    // --deferred: G-buffer + full-screen lighting instead of forward Phong/Toon, to compare the two renderers
+    // --aa=off|msaa2|msaa4|msaa8|fxaa: initial anti-aliasing tier (F9 cycles them while running)
+    // --depth-prepass: depth-only pass before the forward Phong/Toon shading
+    // --mipmaps=blit|compute: mip chain generator, the load time of every texture is printed to compare them
+    // --no-texture-streaming: whole mip chains at load time instead of streaming the large textures
+    // --lights=N: N extra point lights around the spawn, to time the lighting with many lights
+    // --flat-lights: every fragment loops over all the lights in view instead of the ones of its cluster
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--deferred")
+            app.setDeferred(true);
+        if (arg == "--depth-prepass")
+            app.setDepthPrePass(true);
+        if (arg == "--no-texture-streaming")
+            app.setTextureStreaming(false);
+        if (arg == "--flat-lights")
+            app.setClusteredLighting(false);
+        if (arg.rfind("--lights=", 0) == 0)
+            app.setStressLights(std::stoi(arg.substr(9)));
+        for (int aa = 0; aa < AA_COUNT; aa++) {
+            if (arg == std::string("--aa=") + antiAliasingNames[aa])
+                app.setAntiAliasing((AntiAliasing) aa);
+        }
+        for (int mg = 0; mg < MIPMAP_COUNT; mg++) {
+            if (arg == std::string("--mipmaps=") + mipmapGeneratorNames[mg])
+                app.setMipmapGenerator((MipmapGenerator) mg);
+        }
+    }
+    std::cout << "Renderer: " << (app.isDeferred() ? "deferred" : "forward") << "\n";
+
     try {
         app.run();
     }
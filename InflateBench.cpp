@@ -0,0 +1,159 @@
+#include <iostream>
+#include <fstream>
+#include <filesystem>
+#include <chrono>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <exception>
+#include <memory>
+#include <algorithm>
+
+#include "plusaes.hpp"
+
+#define SINFL_IMPLEMENTATION
+
+#include "sinfl.h"
+
+#define SINFL_REF_IMPLEMENTATION
+
+#include "sinfl_ref.h"
+
+std::vector<char> readFile(const std::string &filename) {
+    std::ifstream file(filename, std::ios::ate | std::ios::binary);
+    if (!file.is_open()) {
+        throw std::runtime_error("failed to open file: " + filename);
+    }
+    size_t fileSize = (size_t) file.tellg();
+    std::vector<char> buffer(fileSize);
+    file.seekg(0);
+    file.read(buffer.data(), (std::streamsize) fileSize);
+    return buffer;
+}
+
+#include "modules/MGCG.hpp"
+
+// Inflates the deflate streams of .mgcg files many times with sinfl and with the reference copy of the decoder it
+// replaced (headers/sinfl_ref.h), checking that both produce the same payload.
+// Usage: inflate-bench [--runs=N] [file.mgcg...]
+// Without files every model in models/dungeon/ is used; the default is 1000 runs.
+
+#define BENCH_RUNS 1000
+// The reference decoder reads whole words past the end of its input
+#define BENCH_INPUT_SLACK 16
+
+struct Stream {
+    std::vector<unsigned char> data; // followed by BENCH_INPUT_SLACK zeros
+    size_t size;
+    size_t inflatedSize;
+};
+
+// The deflate streams of a file: the whole payload for v1, one per chunk for v2
+std::vector<Stream> loadStreams(const std::string &path) {
+    auto file = readFile(path);
+    const auto *bytes = (const unsigned char *) file.data();
+    std::vector<Stream> streams;
+    auto addStream = [&](const unsigned char *data, size_t size, size_t inflatedSize) {
+        Stream stream{std::vector<unsigned char>(data, data + size), size, inflatedSize};
+        stream.data.resize(size + BENCH_INPUT_SLACK, 0);
+        streams.push_back(std::move(stream));
+    };
+
+    if (isMGCGv2(bytes, file.size())) {
+        uint32_t chunkCount;
+        memcpy(&chunkCount, bytes + 12, 4);
+        for (uint32_t c = 0; c < chunkCount; c++) {
+            MGCGChunk chunk;
+            memcpy(&chunk, bytes + MGCG_HEADER_SIZE + c * sizeof(MGCGChunk), sizeof(MGCGChunk));
+            std::vector<unsigned char> decrypted(chunk.size);
+            mgcgDecryptBlocks(bytes + chunk.offset, chunk.size / 16, decrypted.data(), chunk.iv);
+            addStream(decrypted.data(), decrypted.size(), chunk.inflatedSize);
+        }
+    } else {
+        std::vector<unsigned char> decrypted(file.size());
+        mgcgDecrypt(bytes, file.size(), decrypted.data());
+        int payloadSize = 0;
+        if (sscanf(reinterpret_cast<const char *>(decrypted.data()), "%d", &payloadSize) != 1 || payloadSize <= 0) {
+            throw std::runtime_error(path + ": invalid MGCG header");
+        }
+        addStream(&decrypted[MGCG_HEADER_SIZE], decrypted.size() - MGCG_HEADER_SIZE, payloadSize);
+    }
+    return streams;
+}
+
+template<typename F>
+double inflateSeconds(const std::vector<Stream> &streams, int runs, std::vector<unsigned char> &out, F inflate) {
+    auto start = std::chrono::high_resolution_clock::now();
+    for (int r = 0; r < runs; r++) {
+        for (const auto &stream: streams) {
+            inflate(out.data(), (int) stream.inflatedSize, stream.data.data(), (int) stream.size);
+        }
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+    return std::chrono::duration<double>(end - start).count();
+}
+
+int main(int argc, char **argv) {
+    int runs = BENCH_RUNS;
+    std::vector<std::string> files;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg.rfind("--runs=", 0) == 0) {
+            runs = std::max(1, std::atoi(arg.c_str() + 7));
+        } else {
+            files.push_back(arg);
+        }
+    }
+    if (files.empty()) {
+        for (const auto &entry: std::filesystem::directory_iterator("models/dungeon")) {
+            if (entry.path().extension() == ".mgcg")
+                files.push_back(entry.path().string());
+        }
+        std::sort(files.begin(), files.end());
+    }
+
+    try {
+        int failures = 0;
+        size_t totalInflated = 0;
+        double totalReference = 0, totalOptimized = 0;
+        for (const auto &path: files) {
+            auto streams = loadStreams(path);
+            size_t inflated = 0, maxInflated = 0;
+            for (const auto &stream: streams) {
+                inflated += stream.inflatedSize;
+                maxInflated = std::max(maxInflated, stream.inflatedSize);
+            }
+
+            std::vector<unsigned char> expected(maxInflated), out(maxInflated);
+            for (const auto &stream: streams) {
+                int n = sinflate_ref(expected.data(), (int) stream.inflatedSize, stream.data.data(), (int) stream.size);
+                int m = sinflate(out.data(), (int) stream.inflatedSize, stream.data.data(), (int) stream.size);
+                if (n != (int) stream.inflatedSize || m != n || memcmp(out.data(), expected.data(), n) != 0) {
+                    std::cout << path << ": inflated payloads differ\n";
+                    failures++;
+                }
+            }
+
+            double reference = inflateSeconds(streams, runs, out, sinflate_ref);
+            double optimized = inflateSeconds(streams, runs, out, sinflate);
+            double megabytes = (double) inflated * runs / (1024.0 * 1024.0);
+            std::cout << path << " (" << inflated << " bytes): reference " << megabytes / reference << " MB/s, sinfl "
+                      << megabytes / optimized << " MB/s\n";
+            totalInflated += inflated;
+            totalReference += reference;
+            totalOptimized += optimized;
+        }
+
+        double megabytes = (double) totalInflated * runs / (1024.0 * 1024.0);
+        std::cout << files.size() << " files x " << runs << " runs: reference " << megabytes / totalReference
+                  << " MB/s, sinfl " << megabytes / totalOptimized << " MB/s (" << totalReference / totalOptimized
+                  << "x), " << failures << " mismatches\n";
+        return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    } catch (const std::exception &e) {
+        std::cerr << e.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+}
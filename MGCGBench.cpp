@@ -0,0 +1,118 @@
+#include <iostream>
+#include <fstream>
+#include <chrono>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <exception>
+#include <memory>
+#include <algorithm>
+
+#include "plusaes.hpp"
+
+#define SINFL_IMPLEMENTATION
+
+#include "sinfl.h"
+
+std::vector<char> readFile(const std::string &filename) {
+    std::ifstream file(filename, std::ios::ate | std::ios::binary);
+    if (!file.is_open()) {
+        throw std::runtime_error("failed to open file: " + filename);
+    }
+    size_t fileSize = (size_t) file.tellg();
+    std::vector<char> buffer(fileSize);
+    file.seekg(0);
+    file.read(buffer.data(), (std::streamsize) fileSize);
+    return buffer;
+}
+
+#include "modules/MGCG.hpp"
+
+// Throughput of the MGCG decoding stages on random data, and check that every path decodes the given .mgcg files
+// to the same bytes as plusaes. v2 files are also decoded with 1 to hardware_concurrency threads.
+// Usage: mgcg-bench [file.mgcg...]
+
+#define BENCH_SIZE (16 * 1024 * 1024)
+
+template<typename F>
+double bestSeconds(int runs, F f) {
+    double best = 1e30;
+    for (int r = 0; r < runs; r++) {
+        auto start = std::chrono::high_resolution_clock::now();
+        f();
+        auto end = std::chrono::high_resolution_clock::now();
+        best = std::min(best, std::chrono::duration<double>(end - start).count());
+    }
+    return best;
+}
+
+int main(int argc, char **argv) {
+    std::vector<unsigned char> data(BENCH_SIZE);
+    std::mt19937 rng(42);
+    for (auto &b: data)
+        b = (unsigned char) rng();
+    std::vector<unsigned char> reference(BENCH_SIZE), out(BENCH_SIZE);
+
+    std::cout << "AES-128-CBC decryption, " << BENCH_SIZE / (1024 * 1024) << " MiB\n";
+    mgcgDecrypt(data.data(), data.size(), reference.data(), MGCG_CIPHER_PORTABLE);
+    for (int c = 0; c < MGCG_CIPHER_COUNT; c++) {
+        auto cipher = (MGCGCipher) c;
+        if (!mgcgCipherSupported(cipher)) {
+            std::cout << "  " << mgcgCipherNames[c] << ": not supported\n";
+            continue;
+        }
+        double seconds = bestSeconds(cipher == MGCG_CIPHER_PORTABLE ? 2 : 10, [&] {
+            mgcgDecrypt(data.data(), data.size(), out.data(), cipher);
+        });
+        std::cout << "  " << mgcgCipherNames[c] << ": " << (BENCH_SIZE / (1024.0 * 1024.0)) / seconds << " MB/s"
+                  << (out == reference ? "" : " MISMATCH") << "\n";
+    }
+
+    int failures = 0;
+    for (int i = 1; i < argc; i++) {
+        auto file = readFile(argv[i]);
+        if (isMGCGv2((const unsigned char *) file.data(), file.size())) {
+            auto expected = decodeMGCG(file);
+            for (unsigned threads = 1; threads <= std::max(1u, std::thread::hardware_concurrency()); threads *= 2) {
+                std::vector<unsigned char> payload;
+                double seconds = bestSeconds(10, [&] {
+                    payload = decodeMGCGv2((const unsigned char *) file.data(), file.size(), threads);
+                });
+                std::cout << argv[i] << ": " << threads << " threads "
+                          << (expected.size() / (1024.0 * 1024.0)) / seconds << " MB/s" << (payload == expected ? "" : " MISMATCH") << "\n";
+                failures += payload != expected;
+            }
+            if (decodeMGCGFile(argv[i]) != expected) {
+                std::cout << argv[i] << ": file decoding differs\n";
+                failures++;
+            }
+            continue;
+        }
+        // Reference: the call the loader used to make
+        const std::vector<unsigned char> key = mgcgKey();
+        unsigned long padded_size = 0;
+        std::vector<unsigned char> expected(file.size()), decrypted(file.size());
+        plusaes::decrypt_cbc((const unsigned char *) file.data(), file.size(), &key[0], key.size(), &mgcgIV,
+                             expected.data(), expected.size(), &padded_size);
+        for (int c = 0; c < MGCG_CIPHER_COUNT; c++) {
+            if (!mgcgCipherSupported((MGCGCipher) c))
+                continue;
+            mgcgDecrypt((const unsigned char *) file.data(), file.size(), decrypted.data(), (MGCGCipher) c);
+            if (decrypted != expected) {
+                std::cout << argv[i] << ": " << mgcgCipherNames[c] << " differs from plusaes\n";
+                failures++;
+            }
+        }
+        if (decodeMGCGFile(argv[i]) != decodeMGCG(file)) {
+            std::cout << argv[i] << ": streamed decoding differs\n";
+            failures++;
+        }
+    }
+    if (argc > 1)
+        std::cout << argc - 1 << " files checked, " << failures << " mismatches\n";
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
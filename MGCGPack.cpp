@@ -0,0 +1,245 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <cstring>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <exception>
+#include <memory>
+#include <random>
+#include <algorithm>
+
+#include "plusaes.hpp"
+
+#define SINFL_IMPLEMENTATION
+
+#include "sinfl.h"
+
+#define SDEFL_IMPLEMENTATION
+
+#include "sdefl.h"
+
+#define STB_IMAGE_IMPLEMENTATION
+
+#include "stb_image.h"
+
+#define TINYGLTF_IMPLEMENTATION
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#define TINYGLTF_NO_INCLUDE_STB_IMAGE
+
+#include "tiny_gltf.h"
+
+std::vector<char> readFile(const std::string &filename) {
+    std::ifstream file(filename, std::ios::ate | std::ios::binary);
+    if (!file.is_open()) {
+        throw std::runtime_error("failed to open file: " + filename);
+    }
+    size_t fileSize = (size_t) file.tellg();
+    std::vector<char> buffer(fileSize);
+    file.seekg(0);
+    file.read(buffer.data(), (std::streamsize) fileSize);
+    return buffer;
+}
+
+#include "modules/MGCG.hpp"
+
+// Converts glTF models (.gltf, .glb or .mgcg with a JSON payload) to .mgcg files with a binary .glb payload.
+// Usage: mgcg-pack [-o output.mgcg] [--format=1|2] [--level=N] [--threads=N] [--chunk-size=KiB] input...
+// Without -o every input is written next to itself with the .mgcg extension, replacing it if it is a .mgcg.
+// Payloads larger than a chunk are split and every chunk is compressed on its own thread. In a v2 file (the default)
+// every chunk is a deflate stream of its own; in a v1 file the chunks end with a sync flush so they still concatenate
+// into a single deflate stream, and none references data in another one.
+
+bool endsWith(const std::string &s, const std::string &suffix) {
+    return s.size() >= suffix.size() && s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+tinygltf::Model loadModel(const std::string &file) {
+    tinygltf::Model model;
+    tinygltf::TinyGLTF loader;
+    std::string warn, err;
+    bool ok;
+    if (endsWith(file, ".mgcg")) {
+        auto payload = decodeMGCGFile(file);
+        ok = isGLB(payload.data(), payload.size())
+             ? loader.LoadBinaryFromMemory(&model, &err, &warn, payload.data(), payload.size(), "/")
+             : loader.LoadASCIIFromString(&model, &err, &warn, reinterpret_cast<const char *>(payload.data()),
+                                          payload.size(), "/");
+    } else if (endsWith(file, ".glb")) {
+        ok = loader.LoadBinaryFromFile(&model, &err, &warn, file);
+    } else {
+        ok = loader.LoadASCIIFromFile(&model, &err, &warn, file);
+    }
+    if (!ok) {
+        throw std::runtime_error(file + ": " + warn + err);
+    }
+    return model;
+}
+
+// The GLB binary chunk holds a single buffer: merge them all, keeping the buffer views 4-byte aligned
+void mergeBuffers(tinygltf::Model &model) {
+    if (model.buffers.empty()) {
+        return;
+    }
+    std::vector<size_t> base(model.buffers.size());
+    tinygltf::Buffer merged;
+    for (size_t b = 0; b < model.buffers.size(); b++) {
+        merged.data.resize((merged.data.size() + 3) & ~size_t(3), 0);
+        base[b] = merged.data.size();
+        merged.data.insert(merged.data.end(), model.buffers[b].data.begin(), model.buffers[b].data.end());
+    }
+    for (auto &view: model.bufferViews) {
+        view.byteOffset += base[view.buffer];
+        view.buffer = 0;
+    }
+    model.buffers = {merged};
+}
+
+struct PackOptions {
+    int format = MGCG_V2_VERSION;
+    int level = SDEFL_LVL_MAX;
+    unsigned threads = std::max(1u, std::thread::hardware_concurrency());
+    size_t chunkSize = 1 << 20;
+};
+
+// With `streams` every chunk is a complete deflate stream, otherwise all but the last end with a sync flush
+std::vector<std::vector<unsigned char>> compressChunks(const std::vector<unsigned char> &payload,
+                                                       const PackOptions &options, bool streams) {
+    size_t count = std::max<size_t>(1, (payload.size() + options.chunkSize - 1) / options.chunkSize);
+    std::vector<std::vector<unsigned char>> chunks(count);
+    mgcgParallelFor(count, [&](size_t c) {
+        auto *deflater = new sdefl{};
+        size_t begin = c * options.chunkSize;
+        int size = (int) (std::min(payload.size(), begin + options.chunkSize) - begin);
+        chunks[c].resize(sdefl_bound(size) + 5);
+        chunks[c].resize(sdeflate_chunk(deflater, chunks[c].data(), payload.data() + begin, size, options.level,
+                                        streams || c == count - 1));
+        delete deflater;
+    }, options.threads);
+    return chunks;
+}
+
+void encrypt(std::vector<unsigned char> &plain, const unsigned char (&iv)[16]) {
+    const std::vector<unsigned char> key = mgcgKey();
+    std::vector<unsigned char> encrypted(plain.size());
+    if (plusaes::encrypt_cbc(plain.data(), plain.size(), &key[0], key.size(), &iv, encrypted.data(),
+                             encrypted.size(), false) != plusaes::kErrorOk) {
+        throw std::runtime_error("Encryption failed");
+    }
+    plain = std::move(encrypted);
+}
+
+std::vector<unsigned char> encodeMGCGv1(const std::vector<unsigned char> &payload, const PackOptions &options) {
+    std::vector<unsigned char> plain(MGCG_HEADER_SIZE, 0);
+    snprintf((char *) plain.data(), MGCG_HEADER_SIZE, "%d", (int) payload.size());
+    for (const auto &chunk: compressChunks(payload, options, false)) {
+        plain.insert(plain.end(), chunk.begin(), chunk.end());
+    }
+    // The final zero keeps the last block from being read as PKCS#7 padding
+    plain.resize((plain.size() + 1 + 15) & ~15, 0);
+    encrypt(plain, mgcgIV);
+    return plain;
+}
+
+std::vector<unsigned char> encodeMGCGv2(const std::vector<unsigned char> &payload, const PackOptions &options) {
+    auto chunks = compressChunks(payload, options, true);
+    std::vector<MGCGChunk> table(chunks.size());
+    std::random_device random;
+    for (auto &chunk: table) {
+        for (auto &b: chunk.iv)
+            b = (unsigned char) random();
+    }
+    mgcgParallelFor(chunks.size(), [&](size_t c) {
+        chunks[c].resize((chunks[c].size() + 15) & ~15, 0);
+        encrypt(chunks[c], table[c].iv);
+    }, options.threads);
+
+    size_t offset = MGCG_HEADER_SIZE + table.size() * sizeof(MGCGChunk);
+    for (size_t c = 0; c < chunks.size(); c++) {
+        table[c].offset = (uint32_t) offset;
+        table[c].size = (uint32_t) chunks[c].size();
+        size_t begin = c * options.chunkSize;
+        table[c].inflatedOffset = (uint32_t) begin;
+        table[c].inflatedSize = (uint32_t) (std::min(payload.size(), begin + options.chunkSize) - begin);
+        offset += chunks[c].size();
+    }
+
+    std::vector<unsigned char> file(offset);
+    uint32_t header[3] = {MGCG_V2_VERSION, (uint32_t) payload.size(), (uint32_t) table.size()};
+    memcpy(file.data(), MGCG_V2_MAGIC, 4);
+    memcpy(&file[4], header, sizeof(header));
+    memcpy(&file[MGCG_HEADER_SIZE], table.data(), table.size() * sizeof(MGCGChunk));
+    for (size_t c = 0; c < chunks.size(); c++) {
+        memcpy(&file[table[c].offset], chunks[c].data(), chunks[c].size());
+    }
+    return file;
+}
+
+int main(int argc, char **argv) {
+    std::string output;
+    std::vector<std::string> inputs;
+    PackOptions options;
+    bool valid = true;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "-o" && i + 1 < argc) {
+            output = argv[++i];
+        } else if (arg.rfind("--format=", 0) == 0) {
+            options.format = std::atoi(arg.c_str() + 9);
+            valid &= options.format == 1 || options.format == MGCG_V2_VERSION;
+        } else if (arg.rfind("--level=", 0) == 0) {
+            options.level = std::atoi(arg.c_str() + 8);
+            valid &= options.level >= SDEFL_LVL_MIN && options.level <= SDEFL_LVL_MAX;
+        } else if (arg.rfind("--threads=", 0) == 0) {
+            options.threads = std::atoi(arg.c_str() + 10);
+            valid &= options.threads > 0;
+        } else if (arg.rfind("--chunk-size=", 0) == 0) {
+            options.chunkSize = (size_t) std::atoi(arg.c_str() + 13) << 10;
+            valid &= options.chunkSize > 0;
+        } else {
+            inputs.emplace_back(arg);
+        }
+    }
+    if (!valid || inputs.empty() || (!output.empty() && inputs.size() > 1)) {
+        std::cerr << "Usage: " << argv[0] << " [-o output.mgcg] [--format=1|2] [--level=" << SDEFL_LVL_MIN << ".."
+                  << SDEFL_LVL_MAX << "] [--threads=N] [--chunk-size=KiB] input...\n";
+        return 1;
+    }
+
+    try {
+        for (const auto &input: inputs) {
+            size_t inputSize = readFile(input).size();
+            tinygltf::Model model = loadModel(input);
+            mergeBuffers(model);
+
+            std::stringstream glb;
+            tinygltf::TinyGLTF writer;
+            writer.WriteGltfSceneToStream(&model, glb, false, true);
+            std::string glbString = glb.str();
+            std::vector<unsigned char> payload(glbString.begin(), glbString.end());
+
+            // Check the payload decodes before replacing anything
+            auto encoded = options.format == 1 ? encodeMGCGv1(payload, options) : encodeMGCGv2(payload, options);
+            if (decodeMGCG(std::vector<char>(encoded.begin(), encoded.end())) != payload) {
+                throw std::runtime_error(input + ": round trip failed");
+            }
+
+            std::string out = output.empty() ? input.substr(0, input.find_last_of('.')) + ".mgcg" : output;
+            std::ofstream file(out, std::ios::binary);
+            file.write(reinterpret_cast<const char *>(encoded.data()), (std::streamsize) encoded.size());
+            if (!file) {
+                throw std::runtime_error("failed to write file: " + out);
+            }
+            std::cout << input << " (" << inputSize << " bytes) -> " << out << " (v" << options.format << ", "
+                      << encoded.size() << " bytes, glb payload " << payload.size() << " bytes)\n";
+        }
+    } catch (const std::exception &e) {
+        std::cerr << e.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,234 @@
+#include <iostream>
+#include <fstream>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <map>
+#include <unordered_map>
+#include <random>
+#include <cstring>
+#include <filesystem>
+
+#ifdef _WIN32
+#define NOMINMAX
+#define WIN32_LEAN_AND_MEAN
+
+#include <windows.h>
+
+#else
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#endif
+
+#include "json.hpp"
+#include "glm/glm.hpp"
+
+#include "modules/AppCommon.hpp"
+#include "modules/SceneLoader.hpp"
+
+// Scene loading time of the SAX loader against the JSON document the level scenes used to be read into, and of the
+// compiled scene scene-gen writes, on a synthetic level and on the given scene files.
+// Usage: scene-bench [--instances=N] [scene.json...]
+
+#define BENCH_INSTANCES 100000
+#define BENCH_RUNS 5
+
+// A level shaped like scenes/level-01.json: the player, the level geometry and a light every 64 instances
+std::string syntheticLevel(int instances) {
+    const char *models[] = {"ground", "road", "wall-line", "wall-angle", "trapdoor"};
+    const char *labels[] = {"GROUND", "GROUND", "WALL", "WALL", "TRAPDOOR"};
+    std::mt19937 rng(42);
+    std::uniform_real_distribution<float> unit(-1.0f, 1.0f);
+
+    nlohmann::ordered_json level;
+    for (const char *model: models) {
+        level["models"].push_back({{"id", model}, {"model", std::string("models/dungeon/") + model + ".mgcg"},
+                                   {"format", "MGCG"}, {"VD", "object"}, {"P", "phong"}});
+    }
+    level["models"].push_back({{"id", "player"}, {"model", "models/dungeon/cast_Mesh.6268.mgcg"}, {"format", "MGCG"},
+                               {"VD", "object"}, {"P", "toon"}});
+    level["models"].push_back({{"id", "light"}, {"model", "models/dungeon/light.002_Mesh.6811.mgcg"},
+                               {"format", "MGCG"}, {"VD", "source"}, {"P", "emission"}});
+    level["textures"].push_back({{"id", "tex"}, {"texture", "textures/dungeon/Textures_Dungeon.png"},
+                                 {"format", "C"}});
+
+    nlohmann::ordered_json toon, phong, emission;
+    toon["pipeline"] = "toon";
+    phong["pipeline"] = "phong";
+    emission["pipeline"] = "emission";
+    for (int i = 0; i < instances; i++) {
+        nlohmann::ordered_json e;
+        int x = i % 512, z = i / 512;
+        std::vector<float> transform = {1, 0, 0, 3.0f * x + 0.1f * unit(rng), 0, 1, 0, 0.1f * unit(rng),
+                                        0, 0, 1, 3.0f * z + 0.1f * unit(rng), 0, 0, 0, 1};
+        e["id"] = "obj-" + std::to_string(i);
+        e["model"] = i == 0 ? "player" : i % 64 == 0 ? "light" : models[i % 5];
+        e["label"] = i == 0 ? "SPAWN" : i % 64 == 0 ? "TORCH" : labels[i % 5];
+        e["coordinates"] = {x, z};
+        e["orientation"] = (i % 4) * 90;
+        e["texture"] = {"tex"};
+        e["transform"] = transform;
+        if (i % 64 == 0 && i != 0) {
+            e["type"] = "POINT";
+            e["color"] = {1.0f, 0.6f + 0.1f * unit(rng), 0.2f};
+            e["power"] = 2.5f + unit(rng);
+            e["where"] = {3.0f * x, 1.5f, 3.0f * z};
+            emission["elements"].push_back(e);
+        } else if (i == 0) {
+            toon["elements"].push_back(e);
+        } else {
+            phong["elements"].push_back(e);
+        }
+    }
+    level["instances"] = {toon, phong, emission};
+    return level.dump(4);
+}
+
+// What LevelScene::init used to do: parse the whole document, then index it
+SceneDescription parseSceneDOM(const std::string &text) {
+    const std::map<std::string, SceneObjectType> str2enum(sceneObjectLabels.begin(), sceneObjectLabels.end());
+    SceneDescription scene;
+    nlohmann::json js = nlohmann::json::parse(text);
+
+    nlohmann::json ms = js["models"];
+    for (size_t k = 0; k < ms.size(); k++) {
+        scene.models.push_back({ms[k]["id"], ms[k]["model"], ms[k]["format"], ms[k]["VD"]});
+    }
+    nlohmann::json ts = js["textures"];
+    for (size_t k = 0; k < ts.size(); k++) {
+        scene.textures.push_back({ts[k]["id"], ts[k]["texture"], ts[k]["format"]});
+    }
+    nlohmann::json pis = js["instances"];
+    for (size_t k = 0; k < pis.size(); k++) {
+        ScenePipelineDesc pipeline;
+        pipeline.pipeline = pis[k]["pipeline"];
+        nlohmann::json is = pis[k]["elements"];
+        for (size_t j = 0; j < is.size(); j++) {
+            SceneInstanceDesc instance;
+            instance.id = is[j]["id"];
+            instance.model = is[j]["model"];
+            auto label = str2enum.find(is[j]["label"]);
+            instance.type = label == str2enum.end() ? SceneObjectType::SO_OTHER : label->second;
+            if (instance.type == SceneObjectType::SO_TORCH || instance.type == SceneObjectType::SO_LAMP ||
+                instance.type == SceneObjectType::SO_BONFIRE) {
+                instance.lType = is[j]["type"];
+                instance.lColor = glm::vec3(is[j]["color"][0], is[j]["color"][1], is[j]["color"][2]);
+                instance.lPower = is[j]["power"];
+                instance.lPosition = glm::vec3(is[j]["where"][0], is[j]["where"][1], is[j]["where"][2]);
+            }
+            instance.coordinates = {is[j]["coordinates"][0], is[j]["coordinates"][1]};
+            for (size_t h = 0; h < is[j]["texture"].size(); h++) {
+                instance.textures.push_back(is[j]["texture"][h]);
+            }
+            nlohmann::json TMjson = is[j]["transform"];
+            float TMj[16];
+            for (int h = 0; h < 16; h++) { TMj[h] = TMjson[h]; }
+            instance.Wm = glm::mat4(TMj[0], TMj[4], TMj[8], TMj[12], TMj[1], TMj[5], TMj[9], TMj[13], TMj[2],
+                                    TMj[6], TMj[10], TMj[14], TMj[3], TMj[7], TMj[11], TMj[15]);
+            pipeline.elements.push_back(instance);
+        }
+        scene.pipelines.push_back(pipeline);
+    }
+    return scene;
+}
+
+bool sameScene(const SceneDescription &a, const SceneDescription &b) {
+    if (a.models.size() != b.models.size() || a.textures.size() != b.textures.size() ||
+        a.pipelines.size() != b.pipelines.size())
+        return false;
+    for (size_t k = 0; k < a.models.size(); k++) {
+        const auto &x = a.models[k], &y = b.models[k];
+        if (x.id != y.id || x.model != y.model || x.format != y.format || x.VD != y.VD)
+            return false;
+    }
+    for (size_t k = 0; k < a.textures.size(); k++) {
+        const auto &x = a.textures[k], &y = b.textures[k];
+        if (x.id != y.id || x.texture != y.texture || x.format != y.format)
+            return false;
+    }
+    for (size_t k = 0; k < a.pipelines.size(); k++) {
+        if (a.pipelines[k].pipeline != b.pipelines[k].pipeline ||
+            a.pipelines[k].elements.size() != b.pipelines[k].elements.size())
+            return false;
+        for (size_t j = 0; j < a.pipelines[k].elements.size(); j++) {
+            const auto &x = a.pipelines[k].elements[j], &y = b.pipelines[k].elements[j];
+            bool light = x.type == SceneObjectType::SO_TORCH || x.type == SceneObjectType::SO_LAMP ||
+                         x.type == SceneObjectType::SO_BONFIRE;
+            if (x.id != y.id || x.model != y.model || x.textures != y.textures || x.type != y.type ||
+                x.Wm != y.Wm || x.coordinates != y.coordinates)
+                return false;
+            if (light && (x.lType != y.lType || x.lColor != y.lColor || x.lPower != y.lPower ||
+                          x.lPosition != y.lPosition))
+                return false;
+        }
+    }
+    return true;
+}
+
+template<typename F>
+double bestSeconds(int runs, F f) {
+    double best = 1e30;
+    for (int r = 0; r < runs; r++) {
+        auto start = std::chrono::high_resolution_clock::now();
+        f();
+        auto end = std::chrono::high_resolution_clock::now();
+        best = std::min(best, std::chrono::duration<double>(end - start).count());
+    }
+    return best;
+}
+
+bool bench(const std::string &name, const std::string &text) {
+    size_t instances = 0;
+    SceneDescription dom, sax, binary;
+    double domSeconds = bestSeconds(BENCH_RUNS, [&] { dom = parseSceneDOM(text); });
+    double saxSeconds = bestSeconds(BENCH_RUNS, [&] { sax = parseSceneJSON(text); });
+    for (const auto &pipeline: sax.pipelines)
+        instances += pipeline.elements.size();
+
+    std::string compiled = (std::filesystem::temp_directory_path() / "scene-bench.scene").string();
+    saveSceneBinary(sax, compiled);
+    size_t compiledSize = std::filesystem::file_size(compiled);
+    double binarySeconds = bestSeconds(BENCH_RUNS, [&] { binary = loadSceneBinary(compiled); });
+    std::filesystem::remove(compiled);
+
+    double megabytes = text.size() / (1024.0 * 1024.0);
+    bool same = sameScene(dom, sax) && sameScene(sax, binary);
+    std::cout << name << " (" << text.size() << " bytes, " << instances << " instances): document "
+              << domSeconds * 1000.0 << " ms (" << megabytes / domSeconds << " MB/s), SAX " << saxSeconds * 1000.0
+              << " ms (" << megabytes / saxSeconds << " MB/s), " << domSeconds / saxSeconds << "x; compiled ("
+              << compiledSize << " bytes) " << binarySeconds * 1000.0 << " ms, " << saxSeconds / binarySeconds
+              << "x over SAX" << (same ? "" : ", MISMATCH") << "\n";
+    return same;
+}
+
+int main(int argc, char **argv) {
+    int instances = BENCH_INSTANCES;
+    std::vector<std::string> files;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg.rfind("--instances=", 0) == 0) {
+            instances = std::max(1, std::atoi(arg.c_str() + 12));
+        } else {
+            files.push_back(arg);
+        }
+    }
+
+    try {
+        bool ok = bench("synthetic", syntheticLevel(instances));
+        for (const auto &file: files) {
+            std::ifstream f(file, std::ios::binary);
+            if (!f.is_open()) {
+                throw std::runtime_error("failed to open file: " + file);
+            }
+            ok &= bench(file, std::string((std::istreambuf_iterator<char>(f)), std::istreambuf_iterator<char>()));
+        }
+        return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+    } catch (const std::exception &e) {
+        std::cerr << e.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+}
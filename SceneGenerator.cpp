@@ -2,6 +2,8 @@
 #include <cmath>
 using namespace std;
 #include "modules/Starter.hpp"
+#include "modules/AppCommon.hpp"
+#include "modules/SceneLoader.hpp"
 using json = nlohmann::json;
 using ordered_json = nlohmann::ordered_json;
 
@@ -245,7 +247,33 @@ void applyConfig(vector<vector<string>> LEVEL, vector<vector<string>> LIGHT, vec
     fout.close();
 }
 
-int main() {
+// Compiles a JSON scene to the .scene file next to it, which LevelScene::init maps instead of parsing the JSON
+void compileScene(const string &file) {
+    string compiled = std::filesystem::path(file).replace_extension(".scene").string();
+    saveSceneBinary(loadSceneJSON(file), compiled);
+    std::cout << file << " -> " << compiled << " (" << std::filesystem::file_size(compiled) << " bytes)" << endl;
+}
+
+// Usage: scene-gen [--binary] | scene-gen --compile scene.json...
+// --binary also writes the compiled scene next to the generated one, --compile only compiles the given scenes.
+int main(int argc, char **argv) {
+    bool binary = argc == 2 && string(argv[1]) == "--binary";
+    bool compile = argc > 2 && string(argv[1]) == "--compile";
+    if (argc > 1 && !binary && !compile) {
+        std::cerr << "Usage: " << argv[0] << " [--binary] | " << argv[0] << " --compile scene.json..." << endl;
+        return 1;
+    }
+    if (compile) {
+        try {
+            for (int i = 2; i < argc; i++)
+                compileScene(argv[i]);
+        } catch (const std::exception &e) {
+            std::cerr << e.what() << endl;
+            return 1;
+        }
+        return 0;
+    }
+
     tuple<uint16_t, uint16_t> O;
     vector<vector<string>> LEVEL = loadMap(FILE_PATH + "ROOM-00.txt", &O), LIGHT = loadMap(FILE_PATH + "LIGHT-00.txt", nullptr), ADDON = loadMap(FILE_PATH + "ADDON-00.txt", nullptr);
 
@@ -267,5 +295,13 @@ int main() {
         ADDON = loadMap(FILE_PATH + "ADDON-" + k + ".txt", nullptr);
         applyConfig(LEVEL, LIGHT, ADDON, n, data, O, false);
     }
+    if (binary) {
+        try {
+            compileScene(RETURN_PATH);
+        } catch (const std::exception &e) {
+            std::cerr << e.what() << endl;
+            return 1;
+        }
+    }
     return 0;
 }
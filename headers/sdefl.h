@@ -167,6 +167,12 @@ struct sdefl {
 extern int sdefl_bound(int in_len);
 extern int sdeflate(struct sdefl *s, void *o, const void *i, int n, int lvl);
 extern int zsdeflate(struct sdefl *s, void *o, const void *i, int n, int lvl);
+/* Compresses one chunk of a larger stream with no references outside of it.
+ * Unless `last` is set the chunk ends with an empty stored block (sync flush)
+ * instead of a final block, so that chunks compressed independently (e.g. on
+ * several threads) concatenate into a single valid deflate stream and every
+ * chunk starts on a byte boundary. */
+extern int sdeflate_chunk(struct sdefl *s, void *o, const void *i, int n, int lvl, int last);
 
 #ifdef __cplusplus
 }
@@ -580,7 +586,7 @@ sdefl_fnd(struct sdefl_match *m, const struct sdefl *s,
 }
 static int
 sdefl_compr(struct sdefl *s, unsigned char *out, const unsigned char *in,
-            int in_len, int lvl) {
+            int in_len, int lvl, int last) {
   unsigned char *q = out;
   static const unsigned char pref[] = {8,10,14,24,30,48,65,96,130};
   int max_chain = (lvl < 8) ? (1 << (lvl + 1)): (1 << 13);
@@ -636,17 +642,29 @@ sdefl_compr(struct sdefl *s, unsigned char *out, const unsigned char *in,
       sdefl_seq(s, i - litlen, litlen);
       litlen = 0;
     }
-    sdefl_flush(&q, s, blk_end == in_len, in);
+    sdefl_flush(&q, s, last && blk_end == in_len, in);
   } while (i < in_len);
+  if (!last) {
+    sdefl_put(&q, s, 0x00, 3); /* stored block */
+  }
   if (s->bitcnt) {
     sdefl_put(&q, s, 0x00, 8 - s->bitcnt);
   }
+  if (!last) {
+    sdefl_put(&q, s, 0x0000, 16); /* len */
+    sdefl_put(&q, s, 0xFFFF, 16); /* ~len */
+  }
   return (int)(q - out);
 }
 extern int
 sdeflate(struct sdefl *s, void *out, const void *in, int n, int lvl) {
   s->bits = s->bitcnt = 0;
-  return sdefl_compr(s, (unsigned char*)out, (const unsigned char*)in, n, lvl);
+  return sdefl_compr(s, (unsigned char*)out, (const unsigned char*)in, n, lvl, 1);
+}
+extern int
+sdeflate_chunk(struct sdefl *s, void *out, const void *in, int n, int lvl, int last) {
+  s->bits = s->bitcnt = 0;
+  return sdefl_compr(s, (unsigned char*)out, (const unsigned char*)in, n, lvl, last);
 }
 static unsigned
 sdefl_adler32(unsigned adler32, const unsigned char *in, int in_len) {
@@ -688,7 +706,7 @@ zsdeflate(struct sdefl *s, void *out, const void *in, int n, int lvl) {
   s->bits = s->bitcnt = 0;
   sdefl_put(&q, s, 0x78, 8); /* deflate, 32k window */
   sdefl_put(&q, s, 0x01, 8); /* fast compression */
-  q += sdefl_compr(s, q, (const unsigned char*)in, n, lvl);
+  q += sdefl_compr(s, q, (const unsigned char*)in, n, lvl, 1);
 
   /* append adler checksum */
   a = sdefl_adler32(SDEFL_ADLER_INIT, (const unsigned char*)in, n);
@@ -122,14 +122,32 @@ extern "C" {
 
 struct sinfl {
   const unsigned char *bitptr;
+  const unsigned char *bitend;
   unsigned long long bitbuf;
   int bitcnt;
+};
+/* Incremental inflate into an output buffer holding the whole inflated data,
+ * which is also the window of the back-references. Every call decodes as far
+ * as its input safely allows and returns the number of bytes consumed (or -1
+ * on a corrupt stream): the rest has to be passed again in front of the next
+ * input. With `final` set the input is all there is. */
+struct sinfl_stream {
+  struct sinfl s;
+  unsigned char *out;
+  unsigned char *out_begin;
+  unsigned char *out_end;
+  int state;
+  int last;
+  int stored; /* bytes left of a stored block */
 
   unsigned lits[SINFL_LIT_TBL_SIZE];
   unsigned dsts[SINFL_OFF_TBL_SIZE];
 };
 extern int sinflate(void *out, int cap, const void *in, int size);
 extern int zsinflate(void *out, int cap, const void *in, int size);
+extern void sinflate_stream_init(struct sinfl_stream *z, void *out, int cap);
+extern int sinflate_stream(struct sinfl_stream *z, const void *in, int size, int final);
+extern int sinflate_stream_done(const struct sinfl_stream *z);
 
 #ifdef __cplusplus
 }
@@ -199,7 +217,7 @@ sinfl_write64(unsigned char *dst, unsigned long long w) {
 static unsigned char*
 sinfl_write128(unsigned char *dst, sinfl_char16 w) {
   sinfl_char16_str(dst, w);
-  return dst + 8;
+  return dst + 16;
 }
 static void
 sinfl_copy128(unsigned char **dst, unsigned char **src) {
@@ -210,9 +228,18 @@ sinfl_copy128(unsigned char **dst, unsigned char **src) {
 #endif
 static void
 sinfl_refill(struct sinfl *s) {
-  s->bitbuf |= sinfl_read64(s->bitptr) << s->bitcnt;
-  s->bitptr += (63 - s->bitcnt) >> 3;
-  s->bitcnt |= 56; /* bitcount in range [56,63] */
+  if (sinfl_likely(s->bitend - s->bitptr >= 8)) {
+    s->bitbuf |= sinfl_read64(s->bitptr) << s->bitcnt;
+    s->bitptr += (63 - s->bitcnt) >> 3;
+    s->bitcnt |= 56; /* bitcount in range [56,63] */
+  } else {
+    /* end of input: load byte by byte, reading zeros past the end */
+    while (s->bitcnt < 56) {
+      unsigned long long b = s->bitptr < s->bitend ? *s->bitptr : 0;
+      s->bitbuf |= b << s->bitcnt;
+      s->bitptr++, s->bitcnt += 8;
+    }
+  }
 }
 static int
 sinfl_peek(struct sinfl *s, int cnt) {
@@ -350,6 +377,35 @@ sinfl_build(unsigned *tbl, unsigned char *lens, int tbl_bits, int maxlen,
     sinfl_build_subtbl(&gen, tbl, tbl_bits, cnt);
   }
 }
+static void
+sinfl_build_pairs(unsigned *tbl, int tbl_bits) {
+  /* merge two literals whose codes fit together in the root table into a
+   * single entry: (lit0 << 16) | (lit1 << 8) | 0x20 | total length. The
+   * second code is looked up at i >> len < i, which is not merged yet. */
+  int i;
+  for (i = (1 << tbl_bits) - 1; i >= 0; --i) {
+    unsigned a = tbl[i], b;
+    int len = (int)(a & 0x0f);
+    if (a >= (256u << 16) || (a & 0x10) || !len || len >= tbl_bits)
+      continue;
+    b = tbl[i >> len];
+    if (b >= (256u << 16) || (b & 0x30) || !(b & 0x0f) ||
+        (int)(b & 0x0f) > tbl_bits - len)
+      continue;
+    tbl[i] = (a & 0xffff0000u) | ((b >> 16) << 8) | 0x20 | (unsigned)(len + (int)(b & 0x0f));
+  }
+}
+static int
+sinfl_is_lit(unsigned key) {
+  /* one or two literals: sub-table entries point past the root table */
+  return key < (256u << 16);
+}
+static unsigned char*
+sinfl_write_lits(unsigned char *out, unsigned key) {
+  out[0] = (unsigned char)(key >> 16);
+  if (key & 0x20) out[1] = (unsigned char)(key >> 8);
+  return out + 1 + ((key >> 5) & 1);
+}
 static int
 sinfl_decode(struct sinfl *s, const unsigned *tbl, int bit_len) {
   int idx = sinfl_peek(s, bit_len);
@@ -364,8 +420,16 @@ sinfl_decode(struct sinfl *s, const unsigned *tbl, int bit_len) {
   sinfl_eat(s, key & 0x0f);
   return (key >> 16) & 0x0fff;
 }
+/* input a block header may need: a dynamic header is at most 569 bytes, plus
+ * the 8 a refill reads ahead */
+#define SINFL_HDR_MARGIN 1024
+/* input a block loop iteration may need: two refills */
+#define SINFL_BLK_MARGIN 16
+
+enum sinfl_states {sinfl_hdr,sinfl_stored,sinfl_copy,sinfl_fixed,sinfl_dyn,sinfl_blk,sinfl_end,sinfl_err};
+
 static int
-sinfl_decompress(unsigned char *out, int cap, const unsigned char *in, int size) {
+sinfl_decompress(struct sinfl_stream *z, const unsigned char *in, int size, int final) {
   static const unsigned char order[] = {16,17,18,0,8,7,9,6,10,5,11,4,12,3,13,2,14,1,15};
   static const short dbase[30+2] = {1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,
       257,385,513,769,1025,1537,2049,3073,4097,6145,8193,12289,16385,24577};
@@ -376,44 +440,63 @@ sinfl_decompress(unsigned char *out, int cap, const unsigned char *in, int size)
   static const unsigned char lbits[29+2] = {0,0,0,0,0,0,0,0,1,1,1,1,2,2,2,2,3,3,3,3,4,
       4,4,4,5,5,5,5,0,0,0};
 
-  const unsigned char *oe = out + cap;
-  const unsigned char *e = in + size, *o = out;
-  enum sinfl_states {hdr,stored,fixed,dyn,blk};
-  enum sinfl_states state = hdr;
-  struct sinfl s = {0};
-  int last = 0;
+  const unsigned char *oe = z->out_end;
+  const unsigned char *e = in + size, *o = z->out_begin;
+  unsigned char *out = z->out;
+  unsigned *lits = z->lits, *dsts = z->dsts;
+  enum sinfl_states state = (enum sinfl_states)z->state;
+  struct sinfl s = z->s;
+  int last = z->last, stored = z->stored;
 
   s.bitptr = in;
+  s.bitend = e;
   while (1) {
     switch (state) {
-    case hdr: {
-      /* block header */
+    case sinfl_hdr: {
+      /* block header: suspends here rather than in the stored and table
+       * states, which always follow it within the margin */
       int type = 0;
+      if (!final && e - s.bitptr < SINFL_HDR_MARGIN)
+        goto suspend;
       sinfl_refill(&s);
       last = sinfl__get(&s,1);
       type = sinfl__get(&s,2);
 
-      switch (type) {default: return (int)(out-o);
-      case 0x00: state = stored; break;
-      case 0x01: state = fixed; break;
-      case 0x02: state = dyn; break;}
+      switch (type) {default: goto err;
+      case 0x00: state = sinfl_stored; break;
+      case 0x01: state = sinfl_fixed; break;
+      case 0x02: state = sinfl_dyn; break;}
     } break;
-    case stored: {
+    case sinfl_stored: {
       /* uncompressed block */
       int len, nlen;
       sinfl_refill(&s);
       sinfl__get(&s,s.bitcnt & 7);
       len = sinfl__get(&s,16);
       nlen = sinfl__get(&s,16);
-      in -= 2; s.bitcnt = 0;
+      s.bitptr -= s.bitcnt / 8;
+      s.bitbuf = 0, s.bitcnt = 0;
 
-      if (len > (e-in) || !len)
-        return (int)(out-o);
-      memcpy(out, in, (size_t)len);
-      in += len, out += len;
-      state = hdr;
+      if (len != (~nlen & 0xffff) || len > (oe-out))
+        goto err;
+      stored = len;
+      state = sinfl_copy;
     } break;
-    case fixed: {
+    case sinfl_copy: {
+      /* a header read past the end of the input leaves bitptr after it */
+      int avail = s.bitptr < e ? (int)(e - s.bitptr) : 0;
+      int len = stored < avail ? stored : avail;
+      if (len) memcpy(out, s.bitptr, (size_t)len);
+      s.bitptr += len, out += len;
+      stored -= len;
+      if (stored) {
+        if (final) goto err;
+        goto suspend;
+      }
+      if (last) goto end;
+      state = sinfl_hdr;
+    } break;
+    case sinfl_fixed: {
       /* fixed huffman codes */
       int n; unsigned char lens[288+32];
       for (n = 0; n <= 143; n++) lens[n] = 8;
@@ -423,11 +506,12 @@ sinfl_decompress(unsigned char *out, int cap, const unsigned char *in, int size)
       for (n = 0; n < 32; n++) lens[288+n] = 5;
 
       /* build lit/dist tables */
-      sinfl_build(s.lits, lens, 10, 15, 288);
-      sinfl_build(s.dsts, lens + 288, 8, 15, 32);
-      state = blk;
+      sinfl_build(lits, lens, 10, 15, 288);
+      sinfl_build_pairs(lits, 10);
+      sinfl_build(dsts, lens + 288, 8, 15, 32);
+      state = sinfl_blk;
     } break;
-    case dyn: {
+    case sinfl_dyn: {
       /* dynamic huffman codes */
       int n, i;
       unsigned hlens[SINFL_PRE_TBL_SIZE];
@@ -445,51 +529,82 @@ sinfl_decompress(unsigned char *out, int cap, const unsigned char *in, int size)
       for (n = 0; n < nlit + ndist;) {
         sinfl_refill(&s);
         int sym = sinfl_decode(&s, hlens, 7);
-        switch (sym) {default: lens[n++] = (unsigned char)sym; break;
-        case 16: for (i=3+sinfl_get(&s,2);i;i--,n++) lens[n]=lens[n-1]; break;
-        case 17: for (i=3+sinfl_get(&s,3);i;i--,n++) lens[n]=0; break;
-        case 18: for (i=11+sinfl_get(&s,7);i;i--,n++) lens[n]=0; break;}
+        unsigned char len = 0;
+        switch (sym) {default: lens[n++] = (unsigned char)sym; continue;
+        case 16: i = 3+sinfl_get(&s,2); len = n ? lens[n-1] : 0; break;
+        case 17: i = 3+sinfl_get(&s,3); break;
+        case 18: i = 11+sinfl_get(&s,7); break;}
+        if ((sym == 16 && !n) || i > nlit + ndist - n)
+          goto err;
+        memset(lens + n, len, (size_t)i);
+        n += i;
       }
       /* build lit/dist tables */
-      sinfl_build(s.lits, lens, 10, 15, nlit);
-      sinfl_build(s.dsts, lens + nlit, 8, 15, ndist);
-      state = blk;}
+      sinfl_build(lits, lens, 10, 15, nlit);
+      sinfl_build_pairs(lits, 10);
+      sinfl_build(dsts, lens + nlit, 8, 15, ndist);
+      state = sinfl_blk;}
     } break;
-    case blk: {
-      /* decompress block */
+    case sinfl_blk: {
+      /* decompress block: a refill holds enough bits for three root table
+       * literal entries, or for a whole match (15 + 5 + 15 + 13 bits) */
       while (1) {
+        unsigned key;
+        int sym;
+        if (sinfl_unlikely(e - s.bitptr < SINFL_BLK_MARGIN) && !final)
+          goto suspend;
         sinfl_refill(&s);
-        int sym = sinfl_decode(&s, s.lits, 10);
-        if (sym < 256) {
-          /* literal */
-          if (sinfl_unlikely(out >= oe)) {
-            return (int)(out-o);
+        key = lits[sinfl_peek(&s, 10)];
+        if (sinfl_likely(sinfl_is_lit(key) && oe - out >= 6)) {
+          out = sinfl_write_lits(out, key);
+          sinfl_eat(&s, key & 0x0f);
+          key = lits[sinfl_peek(&s, 10)];
+          if (sinfl_likely(sinfl_is_lit(key))) {
+            out = sinfl_write_lits(out, key);
+            sinfl_eat(&s, key & 0x0f);
+            key = lits[sinfl_peek(&s, 10)];
+            if (sinfl_likely(sinfl_is_lit(key))) {
+              out = sinfl_write_lits(out, key);
+              sinfl_eat(&s, key & 0x0f);
+              continue;
+            }
           }
-          *out++ = (unsigned char)sym;
-          sym = sinfl_decode(&s, s.lits, 10);
-          if (sym < 256) {
-            *out++ = (unsigned char)sym;
-            continue;
+          /* the lower bits, and so key, stay valid */
+          sinfl_refill(&s);
+        }
+        if (sinfl_unlikely(key & 0x10)) {
+          /* sub-table lookup */
+          sinfl_eat(&s, 10);
+          key = lits[((key >> 16) & 0xffff) + (unsigned)sinfl_peek(&s, key & 0x0f)];
+        }
+        sinfl_eat(&s, key & 0x0f);
+        sym = (key >> 16) & 0x0fff;
+        if (sym < 256) {
+          /* literals near the end of the output */
+          if (sinfl_unlikely(oe - out < 1 + (int)((key >> 5) & 1))) {
+            goto err;
           }
+          out = sinfl_write_lits(out, key);
+          continue;
         }
         if (sinfl_unlikely(sym == 256)) {
           /* end of block */
-          if (last) return (int)(out-o);
-          state = hdr;
+          if (last) goto end;
+          state = sinfl_hdr;
           break;
         }
         /* match */
         if (sym >= 286) {
           /* length codes 286 and 287 must not appear in compressed data */
-          return (int)(out-o);
+          goto err;
         }
         sym -= 257;
         {int len = sinfl__get(&s, lbits[sym]) + lbase[sym];
-        int dsym = sinfl_decode(&s, s.dsts, 8);
+        int dsym = sinfl_decode(&s, dsts, 8);
         int offs = sinfl__get(&s, dbits[dsym]) + dbase[dsym];
         unsigned char *dst = out, *src = out - offs;
-        if (sinfl_unlikely(offs > (int)(out-o))) {
-          return (int)(out-o);
+        if (sinfl_unlikely(!offs || offs > (int)(out-o) || len > (int)(oe-out))) {
+          goto err;
         }
         out = out + len;
 
@@ -515,11 +630,11 @@ sinfl_decompress(unsigned char *out, int cap, const unsigned char *in, int size)
             do dst = sinfl_write128(dst, w);
             while (dst < out);
           } else {
-            /* byte copy match */
-            *dst++ = *src++;
-            *dst++ = *src++;
-            do *dst++ = *src++;
-            while (dst < out);
+            /* short period: every word copy extends the match by offs */
+            do {unsigned long long w = sinfl_read64(src);
+              sinfl_write64(dst, w);
+              dst += offs, src += offs;
+            } while (dst < out);
           }
         }
 #else
@@ -540,11 +655,11 @@ sinfl_decompress(unsigned char *out, int cap, const unsigned char *in, int size)
             do dst = sinfl_write64(dst, w);
             while (dst < out);
           } else {
-            /* byte copy match */
-            *dst++ = *src++;
-            *dst++ = *src++;
-            do *dst++ = *src++;
-            while (dst < out);
+            /* short period: every word copy extends the match by offs */
+            do {unsigned long long w = sinfl_read64(src);
+              sinfl_write64(dst, w);
+              dst += offs, src += offs;
+            } while (dst < out);
           }
         }
 #endif
@@ -555,13 +670,47 @@ sinfl_decompress(unsigned char *out, int cap, const unsigned char *in, int size)
           while (dst < out);
         }}
       }
-    } break;}
+    } break;
+    default: return state == sinfl_end ? 0 : -1;}
   }
-  return (int)(out-o);
+suspend:
+  /* hand back the whole bytes still in the bit buffer */
+  s.bitptr -= s.bitcnt >> 3;
+  s.bitbuf &= (1ull << (s.bitcnt & 7)) - 1;
+  s.bitcnt &= 7;
+  z->s = s, z->out = out;
+  z->state = state, z->last = last, z->stored = stored;
+  return (int)(s.bitptr - in);
+end:
+  z->out = out, z->state = sinfl_end;
+  s.bitptr -= s.bitcnt >> 3;
+  return s.bitptr < e ? (int)(s.bitptr - in) : size;
+err:
+  z->out = out, z->state = sinfl_err;
+  return -1;
+}
+extern void
+sinflate_stream_init(struct sinfl_stream *z, void *out, int cap) {
+  memset(&z->s, 0, sizeof(z->s));
+  z->out = z->out_begin = (unsigned char*)out;
+  z->out_end = z->out + cap;
+  z->state = sinfl_hdr;
+  z->last = z->stored = 0;
+}
+extern int
+sinflate_stream(struct sinfl_stream *z, const void *in, int size, int final) {
+  return sinfl_decompress(z, (const unsigned char*)in, size, final);
+}
+extern int
+sinflate_stream_done(const struct sinfl_stream *z) {
+  return z->state == sinfl_end;
 }
 extern int
 sinflate(void *out, int cap, const void *in, int size) {
-  return sinfl_decompress((unsigned char*)out, cap, (const unsigned char*)in, size);
+  struct sinfl_stream z;
+  sinflate_stream_init(&z, out, cap);
+  sinfl_decompress(&z, (const unsigned char*)in, size, 1);
+  return (int)(z.out - z.out_begin);
 }
 static unsigned
 sinfl_adler32(unsigned adler32, const unsigned char *in, int in_len) {
@@ -595,7 +744,7 @@ zsinflate(void *out, int cap, const void *mem, int size) {
   const unsigned char *in = (const unsigned char*)mem;
   if (size >= 6) {
     const unsigned char *eob = in + size - 4;
-    int n = sinfl_decompress((unsigned char*)out, cap, in + 2u, size);
+    int n = sinflate(out, cap, in + 2u, size - 2);
     unsigned a = sinfl_adler32(1u, (unsigned char*)out, n);
     unsigned h = eob[0] << 24 | eob[1] << 16 | eob[2] << 8 | eob[3] << 0;
     return a == h ? n : -1;
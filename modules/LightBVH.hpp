@@ -0,0 +1,115 @@
+/* LIGHT SELECTION */
+// Static bounding volume hierarchy over the spheres of influence of the light sources of a level.
+// Built once when the level is loaded, it returns the lights whose sphere reaches the view volume without
+// visiting the whole map every frame.
+class LightBVH {
+    struct Item {
+        glm::vec3 center;
+        float radius;
+        uint32_t id;
+    };
+
+    struct Node {
+        glm::vec3 min;
+        uint32_t first; // First item (leaf) or right child (inner node).
+        glm::vec3 max;
+        uint32_t count; // Number of items, 0 for inner nodes.
+    };
+
+    static const uint32_t leafSize = 4;
+
+    std::vector<Item> items;
+    std::vector<Node> nodes;
+
+    uint32_t buildNode(uint32_t first, uint32_t count) {
+        uint32_t n = nodes.size();
+        nodes.push_back({});
+
+        glm::vec3 bmin(std::numeric_limits<float>::max()), bmax(-std::numeric_limits<float>::max());
+        glm::vec3 cmin = bmin, cmax = bmax;
+        for (uint32_t i = first; i < first + count; i++) {
+            bmin = glm::min(bmin, items[i].center - items[i].radius);
+            bmax = glm::max(bmax, items[i].center + items[i].radius);
+            cmin = glm::min(cmin, items[i].center);
+            cmax = glm::max(cmax, items[i].center);
+        }
+        nodes[n].min = bmin;
+        nodes[n].max = bmax;
+
+        if (count <= leafSize) {
+            nodes[n].first = first;
+            nodes[n].count = count;
+            return n;
+        }
+
+        // Median split along the axis with the largest spread of the centers.
+        glm::vec3 spread = cmax - cmin;
+        int axis = spread.x > spread.y ? (spread.x > spread.z ? 0 : 2) : (spread.y > spread.z ? 1 : 2);
+        uint32_t half = count / 2;
+        std::nth_element(items.begin() + first, items.begin() + first + half, items.begin() + first + count,
+                         [axis](const Item &a, const Item &b) { return a.center[axis] < b.center[axis]; });
+
+        buildNode(first, half);
+        uint32_t right = buildNode(first + half, count - half);
+        nodes[n].first = right;
+        nodes[n].count = 0;
+        return n;
+    }
+
+public:
+    void clear() {
+        items.clear();
+        nodes.clear();
+    }
+
+    void add(glm::vec3 center, float radius, uint32_t id) {
+        items.push_back({center, radius, id});
+    }
+
+    void build() {
+        nodes.clear();
+        if (!items.empty()) {
+            nodes.reserve(2 * items.size() / leafSize + 1);
+            buildNode(0, items.size());
+        }
+    }
+
+    // Appends the ids of the lights whose sphere overlaps the (affine, orthographic) view volume of ViewPrj.
+    void query(const glm::mat4 &ViewPrj, std::vector<uint32_t> &out) const {
+        if (nodes.empty())
+            return;
+
+        // An AABB is mapped by the affine ViewPrj into a box whose NDC extent is |M| times the half size.
+        glm::mat3 absM = glm::mat3(glm::abs(glm::vec3(ViewPrj[0])), glm::abs(glm::vec3(ViewPrj[1])),
+                                   glm::abs(glm::vec3(ViewPrj[2])));
+        glm::vec3 axisScale = glm::vec3(glm::length(glm::vec3(ViewPrj[0][0], ViewPrj[1][0], ViewPrj[2][0])),
+                                        glm::length(glm::vec3(ViewPrj[0][1], ViewPrj[1][1], ViewPrj[2][1])),
+                                        glm::length(glm::vec3(ViewPrj[0][2], ViewPrj[1][2], ViewPrj[2][2])));
+        auto outside = [](glm::vec3 c, glm::vec3 e) {
+            return c.x + e.x < -1.0f || c.x - e.x > 1.0f || c.y + e.y < -1.0f || c.y - e.y > 1.0f ||
+                   c.z + e.z < 0.0f || c.z - e.z > 1.0f;
+        };
+
+        uint32_t stack[64];
+        int top = 0;
+        stack[top++] = 0;
+        while (top > 0) {
+            const Node &node = nodes[stack[--top]];
+            glm::vec3 c = glm::vec3(ViewPrj * glm::vec4((node.min + node.max) * 0.5f, 1.0f));
+            glm::vec3 e = absM * ((node.max - node.min) * 0.5f);
+            if (outside(c, e))
+                continue;
+
+            if (node.count > 0) {
+                for (uint32_t i = node.first; i < node.first + node.count; i++) {
+                    glm::vec3 ic = glm::vec3(ViewPrj * glm::vec4(items[i].center, 1.0f));
+                    if (!outside(ic, axisScale * items[i].radius))
+                        out.push_back(items[i].id);
+                }
+            } else {
+                stack[top++] = &node - &nodes[0] + 1;
+                stack[top++] = node.first;
+            }
+        }
+    }
+};
@@ -0,0 +1,226 @@
+/* CLUSTERED LIGHTING */
+// The screen is split in CLUSTER_X * CLUSTER_Y tiles and the depth range covered by the lights in CLUSTER_Z slices.
+// Every frame the lights are binned into the clusters they can reach, so that a fragment only loops over the
+// lights of its own cluster. Keep the constants in sync with Phong.frag and Toon.frag.
+#define CLUSTER_X 16
+#define CLUSTER_Y 12
+#define CLUSTER_Z 8
+#define CLUSTER_COUNT (CLUSTER_X * CLUSTER_Y * CLUSTER_Z)
+
+// Capacity of the light and index storage buffers (not a per-fragment limit).
+#define MAX_SCENE_LIGHTS 1024
+#define MAX_CLUSTER_INDICES (128 * 1024)
+
+// Intensity below which a point or spot light is considered out of range.
+#define LIGHT_CUTOFF 0.002f
+
+// The bits of TYPE above the light type hold the first shadow atlas tile of the light plus one (0 := no shadow).
+#define LIGHT_SHADOW_SHIFT 8
+
+
+/* Storage buffers (std430). */
+enum LightType : uint32_t {
+    LIGHT_DIRECT = 0,
+    LIGHT_POINT = 1,
+    LIGHT_SPOT = 2
+};
+
+// Packed light record: colour as four halves (rgb + decay distance), direction octahedral-encoded in two snorm16.
+struct LightData {
+    alignas(16) glm::vec3 lightPos;
+    alignas(4) uint32_t TYPE;
+    alignas(4) uint32_t lightDir;
+    alignas(4) float lightPow;
+    alignas(8) glm::uvec2 lightCol;
+};
+static_assert(sizeof(LightData) == 32, "LightData must match the std430 Light struct of the shaders");
+
+struct ClusterGrid {
+    alignas(8) glm::uvec2 clusters[CLUSTER_COUNT]; // x := offset in indices, y := number of lights.
+    alignas(4) uint32_t indices[MAX_CLUSTER_INDICES];
+};
+
+
+class LightGrid {
+    struct LocalLight {
+        LightData data;
+        float radius;
+    };
+
+    struct ClusterRange {
+        int x0, x1, y0, y1, z0, z1;
+        float d0, d1;
+    };
+
+    std::vector<LightData> globalLights;
+    std::vector<LocalLight> localLights;
+    std::vector<ClusterRange> ranges;
+    std::vector<uint32_t> visible;
+    bool overflowReported = false;
+
+public:
+    LightData lights[MAX_SCENE_LIGHTS];
+    ClusterGrid grid;
+
+    uint32_t lightCount = 0;
+    uint32_t globalCount = 0;
+    uint32_t indexCount = 0;
+
+    // x, y := clusters per pixel, z, w := scale and bias from fragment depth to slice.
+    glm::vec4 clusterScale = glm::vec4(0.0f);
+
+    // When false every light lands in the first cluster and clusterScale maps every fragment to it, so each fragment
+    // loops over all the visible lights as before the grid. Only kept to measure what the clusters save.
+    bool clustered = true;
+
+    static float lightRadius(glm::vec4 lightCol, float lightPow) {
+        return lightCol.a * glm::sqrt(glm::max(lightPow, 0.0f) / LIGHT_CUTOFF);
+    }
+
+    static uint32_t packDirection(glm::vec3 dir) {
+        float l1 = glm::abs(dir.x) + glm::abs(dir.y) + glm::abs(dir.z);
+        if (l1 == 0.0f)
+            return 0;
+        dir /= l1;
+        glm::vec2 e = glm::vec2(dir.x, dir.y);
+        if (dir.z < 0.0f) {
+            e = (1.0f - glm::abs(glm::vec2(dir.y, dir.x))) *
+                glm::vec2(dir.x >= 0.0f ? 1.0f : -1.0f, dir.y >= 0.0f ? 1.0f : -1.0f);
+        }
+        return glm::packSnorm2x16(e);
+    }
+
+    static LightData packLight(LightType type, glm::vec3 lightPos, glm::vec3 lightDir, glm::vec4 lightCol,
+                               float lightPow, int shadowTile = -1) {
+        LightData light{};
+        light.lightPos = lightPos;
+        light.TYPE = type | (uint32_t) (shadowTile + 1) << LIGHT_SHADOW_SHIFT;
+        light.lightDir = packDirection(lightDir);
+        light.lightPow = lightPow;
+        light.lightCol = glm::uvec2(glm::packHalf2x16(glm::vec2(lightCol.r, lightCol.g)),
+                                    glm::packHalf2x16(glm::vec2(lightCol.b, lightCol.a)));
+        return light;
+    }
+
+    void clear() {
+        globalLights.clear();
+        localLights.clear();
+    }
+
+    // Direct lights reach every fragment, the others are binned by their radius of influence.
+    void addLight(LightType type, glm::vec3 lightPos, glm::vec3 lightDir, glm::vec4 lightCol, float lightPow,
+                  int shadowTile = -1) {
+        LightData light = packLight(type, lightPos, lightDir, lightCol, lightPow, shadowTile);
+        if (type == LIGHT_DIRECT)
+            globalLights.push_back(light);
+        else
+            localLights.push_back({light, lightRadius(lightCol, lightPow)});
+    }
+
+    void build(const glm::mat4 &ViewPrj, VkExtent2D extent) {
+        lightCount = 0;
+        indexCount = 0;
+        memset(grid.clusters, 0, sizeof(grid.clusters));
+
+        for (auto &light: globalLights) {
+            if (lightCount == MAX_SCENE_LIGHTS)
+                break;
+            lights[lightCount++] = light;
+        }
+        globalCount = lightCount;
+
+        // A sphere of radius r is mapped by the (affine) orthographic ViewPrj into an ellipsoid whose extent
+        // along each NDC axis is r times the length of the corresponding row of the linear part.
+        glm::vec3 axisScale = glm::vec3(glm::length(glm::vec3(ViewPrj[0][0], ViewPrj[1][0], ViewPrj[2][0])),
+                                        glm::length(glm::vec3(ViewPrj[0][1], ViewPrj[1][1], ViewPrj[2][1])),
+                                        glm::length(glm::vec3(ViewPrj[0][2], ViewPrj[1][2], ViewPrj[2][2])));
+
+        ranges.clear();
+        visible.clear();
+        float zMin = 1.0f, zMax = 0.0f;
+        for (uint32_t i = 0; i < localLights.size(); i++) {
+            glm::vec4 c = ViewPrj * glm::vec4(localLights[i].data.lightPos, 1.0f);
+            glm::vec3 e = axisScale * localLights[i].radius;
+            if (c.x + e.x < -1.0f || c.x - e.x > 1.0f || c.y + e.y < -1.0f || c.y - e.y > 1.0f ||
+                c.z + e.z < 0.0f || c.z - e.z > 1.0f)
+                continue;
+            if (lightCount + visible.size() == MAX_SCENE_LIGHTS)
+                break;
+
+            ClusterRange r{};
+            r.x0 = glm::clamp((int) ((c.x - e.x) * 0.5f * CLUSTER_X + 0.5f * CLUSTER_X), 0, CLUSTER_X - 1);
+            r.x1 = glm::clamp((int) ((c.x + e.x) * 0.5f * CLUSTER_X + 0.5f * CLUSTER_X), 0, CLUSTER_X - 1);
+            r.y0 = glm::clamp((int) ((c.y - e.y) * 0.5f * CLUSTER_Y + 0.5f * CLUSTER_Y), 0, CLUSTER_Y - 1);
+            r.y1 = glm::clamp((int) ((c.y + e.y) * 0.5f * CLUSTER_Y + 0.5f * CLUSTER_Y), 0, CLUSTER_Y - 1);
+            r.d0 = glm::max(c.z - e.z, 0.0f);
+            r.d1 = glm::min(c.z + e.z, 1.0f);
+            zMin = glm::min(zMin, r.d0);
+            zMax = glm::max(zMax, r.d1);
+            ranges.push_back(r);
+            visible.push_back(i);
+        }
+
+        // Slices only span the depth interval reached by some light: fragments outside of it are clamped to the
+        // first or last slice, which can only add lights to their loop, never remove a relevant one.
+        float sliceScale = clustered && zMax > zMin ? CLUSTER_Z / (zMax - zMin) : 0.0f;
+        float sliceBias = -zMin * sliceScale;
+        clusterScale = clustered ? glm::vec4((float) CLUSTER_X / (float) extent.width,
+                                             (float) CLUSTER_Y / (float) extent.height, sliceScale, sliceBias)
+                                 : glm::vec4(0.0f);
+
+        for (auto &r: ranges) {
+            if (!clustered)
+                r.x0 = r.x1 = r.y0 = r.y1 = 0;
+            r.z0 = glm::clamp((int) (r.d0 * sliceScale + sliceBias), 0, CLUSTER_Z - 1);
+            r.z1 = glm::clamp((int) (r.d1 * sliceScale + sliceBias), 0, CLUSTER_Z - 1);
+            for (int z = r.z0; z <= r.z1; z++)
+                for (int y = r.y0; y <= r.y1; y++)
+                    for (int x = r.x0; x <= r.x1; x++)
+                        grid.clusters[(z * CLUSTER_Y + y) * CLUSTER_X + x].y++;
+        }
+
+        // If the index list would overflow every cluster keeps only its fair share, filled in insertion order.
+        uint32_t total = 0;
+        for (auto &cluster: grid.clusters)
+            total += cluster.y;
+        uint32_t maxPerCluster = total > MAX_CLUSTER_INDICES ? MAX_CLUSTER_INDICES / CLUSTER_COUNT : MAX_SCENE_LIGHTS;
+        if (total > MAX_CLUSTER_INDICES && !overflowReported) {
+            std::cout << "Light grid full: keeping " << maxPerCluster << " lights per cluster\n";
+            overflowReported = true;
+        }
+
+        // Prefix sum of the counts gives the offset of every cluster inside the index list.
+        uint32_t offset = 0;
+        for (auto &cluster: grid.clusters) {
+            cluster.x = offset;
+            offset += glm::min(cluster.y, maxPerCluster);
+            cluster.y = 0;
+        }
+        indexCount = offset;
+
+        for (uint32_t v = 0; v < visible.size(); v++) {
+            uint32_t lightIdx = lightCount++;
+            lights[lightIdx] = localLights[visible[v]].data;
+            const ClusterRange &r = ranges[v];
+            for (int z = r.z0; z <= r.z1; z++)
+                for (int y = r.y0; y <= r.y1; y++)
+                    for (int x = r.x0; x <= r.x1; x++) {
+                        int c = (z * CLUSTER_Y + y) * CLUSTER_X + x;
+                        uint32_t end = c + 1 < CLUSTER_COUNT ? grid.clusters[c + 1].x : indexCount;
+                        uint32_t slot = grid.clusters[c].x + grid.clusters[c].y;
+                        if (slot < end) {
+                            grid.indices[slot] = lightIdx;
+                            grid.clusters[c].y++;
+                        }
+                    }
+        }
+    }
+
+    int lightsSize() const {
+        return (int) (lightCount * sizeof(LightData));
+    }
+
+    int gridSize() const {
+        return (int) (offsetof(ClusterGrid, indices) + indexCount * sizeof(uint32_t));
+    }
+};
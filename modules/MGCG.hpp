@@ -0,0 +1,433 @@
+/* MGCG MODELS */
+// Encrypted and deflated glTF models. The inflated payload is either a glTF JSON, with base64 buffers, or a binary
+// .glb, which skips the base64 overhead both in the inflated size and in the parse time. mgcg-pack converts between
+// them. There are two versions of the container:
+// - v1 is AES-128-CBC encrypted as a whole, with no padding scheme: the plaintext is a 16-byte header holding the
+//   inflated size as an ASCII number, followed by the deflate stream, zero-padded to the AES block size with at least
+//   one zero (see mgcgDecrypt).
+// - v2 starts with a plain 16-byte header ("MGCG", version, inflated size, chunk count) and a table of MGCGChunk.
+//   Every chunk is a deflate stream of its own, zero-padded and encrypted with its own IV, so the chunks of a big
+//   model are decoded in parallel.
+#define MGCG_HEADER_SIZE 16
+
+const unsigned char mgcgIV[16] = {
+        0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+        0x08, 0x09, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F,
+};
+
+std::vector<unsigned char> mgcgKey() {
+    return plusaes::key_from_string(&"CG2023SkelKey128"); // 16-char = 128-bit
+}
+
+
+/* AES-128-CBC DECRYPTION */
+// Unlike encryption, CBC decryption has no dependency between blocks (P[i] = D(C[i]) ^ C[i-1]), so the hardware
+// paths keep MGCG_AES_LANES blocks in flight to hide the latency of the AES rounds. The ARMv8 path is compiled only
+// when the compiler targets the crypto extension (e.g. Apple Silicon, or -march=armv8-a+crypto).
+#define MGCG_AES_LANES 8
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define MGCG_AES_NI
+#include <wmmintrin.h>
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#define MGCG_TARGET_AES
+#else
+#define MGCG_TARGET_AES __attribute__((target("aes,sse2")))
+#endif
+#elif (defined(__aarch64__) || defined(_M_ARM64)) && (defined(__ARM_FEATURE_AES) || defined(__ARM_FEATURE_CRYPTO))
+#define MGCG_AES_ARMV8
+#include <arm_neon.h>
+#endif
+
+enum MGCGCipher {
+    MGCG_CIPHER_PORTABLE, MGCG_CIPHER_AESNI, MGCG_CIPHER_ARMV8, MGCG_CIPHER_COUNT
+};
+
+const char *mgcgCipherNames[] = {"plusaes", "AES-NI", "ARMv8"};
+
+bool mgcgCipherSupported(MGCGCipher cipher) {
+    switch (cipher) {
+        case MGCG_CIPHER_PORTABLE:
+            return true;
+#ifdef MGCG_AES_NI
+        case MGCG_CIPHER_AESNI: {
+#if defined(_MSC_VER) && !defined(__clang__)
+            int info[4];
+            __cpuid(info, 1);
+            return (info[2] & (1 << 25)) != 0;
+#else
+            return __builtin_cpu_supports("aes");
+#endif
+        }
+#endif
+#ifdef MGCG_AES_ARMV8
+        case MGCG_CIPHER_ARMV8:
+            return true;
+#endif
+        default:
+            return false;
+    }
+}
+
+MGCGCipher mgcgBestCipher() {
+    static const MGCGCipher best = mgcgCipherSupported(MGCG_CIPHER_AESNI) ? MGCG_CIPHER_AESNI :
+                                   mgcgCipherSupported(MGCG_CIPHER_ARMV8) ? MGCG_CIPHER_ARMV8 :
+                                   MGCG_CIPHER_PORTABLE;
+    return best;
+}
+
+#ifdef MGCG_AES_NI
+MGCG_TARGET_AES
+void mgcgDecryptAESNI(const plusaes::detail::RoundKeys &rkeys, const unsigned char *data, size_t blocks,
+                      unsigned char *out, unsigned char *iv) {
+    // Equivalent inverse cipher: the middle round keys go through InvMixColumns
+    __m128i dk[11];
+    dk[0] = _mm_loadu_si128((const __m128i *) &rkeys[10]);
+    for (int r = 1; r < 10; r++)
+        dk[r] = _mm_aesimc_si128(_mm_loadu_si128((const __m128i *) &rkeys[10 - r]));
+    dk[10] = _mm_loadu_si128((const __m128i *) &rkeys[0]);
+
+    __m128i prev = _mm_loadu_si128((const __m128i *) iv);
+    size_t b = 0;
+    for (; b + MGCG_AES_LANES <= blocks; b += MGCG_AES_LANES) {
+        __m128i c[MGCG_AES_LANES], x[MGCG_AES_LANES];
+        for (int l = 0; l < MGCG_AES_LANES; l++) {
+            c[l] = _mm_loadu_si128((const __m128i *) (data + 16 * (b + l)));
+            x[l] = _mm_xor_si128(c[l], dk[0]);
+        }
+        for (int r = 1; r < 10; r++)
+            for (int l = 0; l < MGCG_AES_LANES; l++)
+                x[l] = _mm_aesdec_si128(x[l], dk[r]);
+        for (int l = 0; l < MGCG_AES_LANES; l++) {
+            x[l] = _mm_aesdeclast_si128(x[l], dk[10]);
+            _mm_storeu_si128((__m128i *) (out + 16 * (b + l)), _mm_xor_si128(x[l], l == 0 ? prev : c[l - 1]));
+        }
+        prev = c[MGCG_AES_LANES - 1];
+    }
+    for (; b < blocks; b++) {
+        __m128i c = _mm_loadu_si128((const __m128i *) (data + 16 * b));
+        __m128i x = _mm_xor_si128(c, dk[0]);
+        for (int r = 1; r < 10; r++)
+            x = _mm_aesdec_si128(x, dk[r]);
+        x = _mm_aesdeclast_si128(x, dk[10]);
+        _mm_storeu_si128((__m128i *) (out + 16 * b), _mm_xor_si128(x, prev));
+        prev = c;
+    }
+    _mm_storeu_si128((__m128i *) iv, prev);
+}
+#endif
+
+#ifdef MGCG_AES_ARMV8
+void mgcgDecryptARMv8(const plusaes::detail::RoundKeys &rkeys, const unsigned char *data, size_t blocks,
+                      unsigned char *out, unsigned char *iv) {
+    // AESD adds the round key before the inverse rounds, so the last one is a plain xor
+    uint8x16_t dk[11];
+    dk[0] = vld1q_u8((const uint8_t *) &rkeys[10]);
+    for (int r = 1; r < 10; r++)
+        dk[r] = vaesimcq_u8(vld1q_u8((const uint8_t *) &rkeys[10 - r]));
+    dk[10] = vld1q_u8((const uint8_t *) &rkeys[0]);
+
+    uint8x16_t prev = vld1q_u8(iv);
+    size_t b = 0;
+    for (; b + MGCG_AES_LANES <= blocks; b += MGCG_AES_LANES) {
+        uint8x16_t c[MGCG_AES_LANES], x[MGCG_AES_LANES];
+        for (int l = 0; l < MGCG_AES_LANES; l++) {
+            c[l] = vld1q_u8(data + 16 * (b + l));
+            x[l] = vaesdq_u8(c[l], dk[0]);
+        }
+        for (int r = 1; r < 10; r++)
+            for (int l = 0; l < MGCG_AES_LANES; l++)
+                x[l] = vaesdq_u8(vaesimcq_u8(x[l]), dk[r]);
+        for (int l = 0; l < MGCG_AES_LANES; l++) {
+            x[l] = veorq_u8(x[l], dk[10]);
+            vst1q_u8(out + 16 * (b + l), veorq_u8(x[l], l == 0 ? prev : c[l - 1]));
+        }
+        prev = c[MGCG_AES_LANES - 1];
+    }
+    for (; b < blocks; b++) {
+        uint8x16_t c = vld1q_u8(data + 16 * b);
+        uint8x16_t x = vaesdq_u8(c, dk[0]);
+        for (int r = 1; r < 10; r++)
+            x = vaesdq_u8(vaesimcq_u8(x), dk[r]);
+        x = veorq_u8(x, dk[10]);
+        vst1q_u8(out + 16 * b, veorq_u8(x, prev));
+        prev = c;
+    }
+    vst1q_u8(iv, prev);
+}
+#endif
+
+// Decrypts CBC blocks chained to iv, which is then advanced to the last ciphertext block; data and out must not
+// overlap
+void mgcgDecryptBlocks(const unsigned char *data, size_t blocks, unsigned char *out, unsigned char *iv,
+                       MGCGCipher cipher = mgcgBestCipher()) {
+    static const std::vector<unsigned char> key = mgcgKey();
+    static const plusaes::detail::RoundKeys rkeys = plusaes::detail::expand_key(&key[0], (int) key.size());
+    if (blocks == 0)
+        return;
+
+#ifdef MGCG_AES_NI
+    if (cipher == MGCG_CIPHER_AESNI && mgcgCipherSupported(cipher)) {
+        mgcgDecryptAESNI(rkeys, data, blocks, out, iv);
+        return;
+    }
+#endif
+#ifdef MGCG_AES_ARMV8
+    if (cipher == MGCG_CIPHER_ARMV8) {
+        mgcgDecryptARMv8(rkeys, data, blocks, out, iv);
+        return;
+    }
+#endif
+    plusaes::decrypt_cbc(data, blocks * 16, &key[0], key.size(), (const unsigned char (*)[16]) iv, out, blocks * 16,
+                         nullptr);
+    memcpy(iv, data + (blocks - 1) * 16, 16);
+}
+
+// The original loader called plusaes::decrypt_cbc with a padded_size: the last block is kept only if it ends with a
+// valid PKCS#7 padding, which is then zeroed (a final 0 counts as no padding), otherwise it reads as zeros
+void mgcgStripPadding(unsigned char *last) {
+    unsigned int padding = last[15];
+    bool valid = padding <= 16;
+    for (unsigned int i = 0; valid && i < padding; i++)
+        valid = last[15 - i] == padding;
+    if (valid)
+        memset(last + 16 - padding, 0, padding);
+    else
+        memset(last, 0, 16);
+}
+
+// Decrypts size bytes (a multiple of 16) into out, byte-identical to the original loader
+void mgcgDecrypt(const unsigned char *data, size_t size, unsigned char *out, MGCGCipher cipher = mgcgBestCipher()) {
+    if (size < 16)
+        return;
+    unsigned char iv[16];
+    memcpy(iv, mgcgIV, 16);
+    mgcgDecryptBlocks(data, size / 16, out, iv, cipher);
+    mgcgStripPadding(out + size - 16);
+}
+
+// The inflated size in a decrypted v1 header
+int mgcgPayloadSize(const unsigned char *header) {
+    char text[MGCG_HEADER_SIZE + 1] = {};
+    memcpy(text, header, MGCG_HEADER_SIZE);
+    int payloadSize = 0;
+    if (sscanf(text, "%d", &payloadSize) != 1 || payloadSize <= 0) {
+        throw std::runtime_error("Invalid MGCG header");
+    }
+    return payloadSize;
+}
+
+std::vector<unsigned char> inflateMGCG(const unsigned char *decrypted, size_t size) {
+    int payloadSize = mgcgPayloadSize(decrypted);
+    std::vector<unsigned char> payload(payloadSize);
+    int n = sinflate(payload.data(), payloadSize, decrypted + MGCG_HEADER_SIZE, (int) (size - MGCG_HEADER_SIZE));
+    if (n != payloadSize) {
+        throw std::runtime_error("Corrupted MGCG file");
+    }
+    return payload;
+}
+
+/* MGCG V2 */
+#define MGCG_V2_MAGIC "MGCG"
+#define MGCG_V2_VERSION 2
+
+struct MGCGChunk {
+    uint32_t offset; // of the encrypted chunk in the file
+    uint32_t size; // encrypted, a multiple of 16
+    uint32_t inflatedOffset;
+    uint32_t inflatedSize;
+    unsigned char iv[16];
+};
+static_assert(sizeof(MGCGChunk) == 32);
+
+// Runs task(i) for every i in [0, count) on up to `threads` threads, the calling one included, and rethrows the
+// first exception thrown by a task
+template<typename F>
+void mgcgParallelFor(size_t count, F task, unsigned threads = std::thread::hardware_concurrency()) {
+    std::atomic<size_t> next = 0;
+    std::exception_ptr error;
+    std::mutex errorMutex;
+    auto worker = [&]() {
+        try {
+            for (size_t i = next++; i < count; i = next++)
+                task(i);
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(errorMutex);
+            if (!error)
+                error = std::current_exception();
+            next = count;
+        }
+    };
+
+    std::vector<std::thread> pool;
+    for (size_t t = 1; t < std::min<size_t>(std::max(1u, threads), count); t++)
+        pool.emplace_back(worker);
+    worker();
+    for (auto &thread: pool)
+        thread.join();
+    if (error)
+        std::rethrow_exception(error);
+}
+
+bool isMGCGv2(const unsigned char *data, size_t size) {
+    uint32_t version;
+    if (size < MGCG_HEADER_SIZE || memcmp(data, MGCG_V2_MAGIC, 4) != 0)
+        return false;
+    memcpy(&version, data + 4, 4);
+    return version == MGCG_V2_VERSION;
+}
+
+// The chunks must tile the payload in order, and their encrypted ranges follow the table in order without
+// overlapping: the workers never inflate into the same bytes, and no part of the payload is left unwritten
+void validateMGCGChunks(const std::vector<MGCGChunk> &chunks, uint32_t payloadSize, size_t size) {
+    uint64_t inflatedEnd = 0, end = MGCG_HEADER_SIZE + chunks.size() * sizeof(MGCGChunk);
+    for (const auto &chunk: chunks) {
+        if (chunk.size == 0 || chunk.size % 16 != 0 || chunk.offset < end || chunk.offset > size ||
+            chunk.size > size - chunk.offset || chunk.inflatedOffset != inflatedEnd) {
+            throw std::runtime_error("Invalid MGCG chunk table");
+        }
+        end = (uint64_t) chunk.offset + chunk.size;
+        inflatedEnd += chunk.inflatedSize;
+    }
+    if (inflatedEnd != payloadSize) {
+        throw std::runtime_error("Invalid MGCG chunk table");
+    }
+}
+
+std::vector<unsigned char> decodeMGCGv2(const unsigned char *file, size_t size,
+                                        unsigned threads = std::thread::hardware_concurrency()) {
+    uint32_t payloadSize, chunkCount;
+    memcpy(&payloadSize, file + 8, 4);
+    memcpy(&chunkCount, file + 12, 4);
+    if (chunkCount == 0 || chunkCount > (size - MGCG_HEADER_SIZE) / sizeof(MGCGChunk)) {
+        throw std::runtime_error("Invalid MGCG chunk table");
+    }
+    std::vector<MGCGChunk> chunks(chunkCount);
+    memcpy(chunks.data(), file + MGCG_HEADER_SIZE, chunkCount * sizeof(MGCGChunk));
+    validateMGCGChunks(chunks, payloadSize, size);
+
+    std::vector<unsigned char> payload(payloadSize);
+    MGCGCipher cipher = mgcgBestCipher();
+    mgcgParallelFor(chunks.size(), [&](size_t c) {
+        const MGCGChunk &chunk = chunks[c];
+        std::vector<unsigned char> decrypted(chunk.size);
+        unsigned char iv[16];
+        memcpy(iv, chunk.iv, 16);
+        mgcgDecryptBlocks(file + chunk.offset, chunk.size / 16, decrypted.data(), iv, cipher);
+        int n = sinflate(&payload[chunk.inflatedOffset], (int) chunk.inflatedSize, decrypted.data(), (int) chunk.size);
+        if (n != (int) chunk.inflatedSize) {
+            throw std::runtime_error("Corrupted MGCG chunk");
+        }
+    }, threads);
+    return payload;
+}
+
+// Decrypts and inflates an in-memory .mgcg file into its glTF payload
+std::vector<unsigned char> decodeMGCG(const std::vector<char> &file) {
+    if (isMGCGv2((const unsigned char *) file.data(), file.size())) {
+        return decodeMGCGv2((const unsigned char *) file.data(), file.size());
+    }
+    if (file.size() < MGCG_HEADER_SIZE || file.size() % 16 != 0) {
+        throw std::runtime_error("Invalid MGCG file size");
+    }
+    std::vector<unsigned char> decrypted(file.size());
+    mgcgDecrypt((const unsigned char *) file.data(), file.size(), decrypted.data());
+    return inflateMGCG(decrypted.data(), decrypted.size());
+}
+
+// Same, reading the file through a fixed window that is decrypted as soon as it is read and inflated straight into
+// the payload: besides the payload, only the window is ever in memory. The chunks of a v2 file are each read through a
+// window of their own, in parallel.
+#define MGCG_STREAM_WINDOW (64 * 1024)
+
+// Decrypts `size` bytes (a multiple of 16) read from file, chained to iv, and inflates them as they come into out;
+// with stripPadding the last block goes through mgcgStripPadding first. Returns the inflated size.
+size_t mgcgInflateStream(std::istream &file, size_t size, unsigned char *iv, unsigned char *out, size_t cap,
+                         bool stripPadding, MGCGCipher cipher) {
+    auto inflater = std::make_unique<sinfl_stream>();
+    sinflate_stream_init(inflater.get(), out, (int) cap);
+    std::vector<unsigned char> window(std::min(size, (size_t) MGCG_STREAM_WINDOW));
+    // The input the inflater left over goes in front of the next window, and is shorter than a block header
+    std::vector<unsigned char> decrypted(SINFL_HDR_MARGIN + window.size());
+    size_t left = 0;
+    for (size_t offset = 0; offset < size && !sinflate_stream_done(inflater.get());) {
+        size_t n = std::min(window.size(), size - offset);
+        if (!file.read(reinterpret_cast<char *>(window.data()), (std::streamsize) n)) {
+            throw std::runtime_error("failed to read MGCG file");
+        }
+        mgcgDecryptBlocks(window.data(), n / 16, &decrypted[left], iv, cipher);
+        offset += n;
+        if (stripPadding && offset == size) {
+            mgcgStripPadding(&decrypted[left + n - 16]);
+        }
+        int used = sinflate_stream(inflater.get(), decrypted.data(), (int) (left + n), offset == size);
+        if (used < 0) {
+            break;
+        }
+        left += n - used;
+        memmove(decrypted.data(), &decrypted[used], left);
+    }
+    return (size_t) (inflater->out - inflater->out_begin);
+}
+
+std::vector<unsigned char> decodeMGCGFile(const std::string &path) {
+    std::ifstream file(path, std::ios::ate | std::ios::binary);
+    if (!file.is_open()) {
+        throw std::runtime_error("failed to open file: " + path);
+    }
+    auto size = (size_t) file.tellg();
+    if (size < MGCG_HEADER_SIZE) {
+        throw std::runtime_error("Invalid MGCG file size");
+    }
+    file.seekg(0);
+    unsigned char header[MGCG_HEADER_SIZE];
+    file.read(reinterpret_cast<char *>(header), MGCG_HEADER_SIZE);
+    MGCGCipher cipher = mgcgBestCipher();
+
+    if (isMGCGv2(header, MGCG_HEADER_SIZE)) {
+        uint32_t payloadSize, chunkCount;
+        memcpy(&payloadSize, header + 8, 4);
+        memcpy(&chunkCount, header + 12, 4);
+        if (chunkCount == 0 || chunkCount > (size - MGCG_HEADER_SIZE) / sizeof(MGCGChunk)) {
+            throw std::runtime_error("Invalid MGCG chunk table");
+        }
+        std::vector<MGCGChunk> chunks(chunkCount);
+        if (!file.read(reinterpret_cast<char *>(chunks.data()), (std::streamsize) (chunkCount * sizeof(MGCGChunk)))) {
+            throw std::runtime_error("failed to read file: " + path);
+        }
+        validateMGCGChunks(chunks, payloadSize, size);
+
+        std::vector<unsigned char> payload(payloadSize);
+        mgcgParallelFor(chunks.size(), [&](size_t c) {
+            const MGCGChunk &chunk = chunks[c];
+            std::ifstream chunkFile(path, std::ios::binary);
+            chunkFile.seekg(chunk.offset);
+            unsigned char iv[16];
+            memcpy(iv, chunk.iv, 16);
+            if (mgcgInflateStream(chunkFile, chunk.size, iv, payload.data() + chunk.inflatedOffset, chunk.inflatedSize,
+                                  false, cipher) != chunk.inflatedSize) {
+                throw std::runtime_error("Corrupted MGCG chunk");
+            }
+        });
+        return payload;
+    }
+
+    if (size % 16 != 0 || size == MGCG_HEADER_SIZE) {
+        throw std::runtime_error("Invalid MGCG file size");
+    }
+    unsigned char iv[16], decryptedHeader[MGCG_HEADER_SIZE];
+    memcpy(iv, mgcgIV, 16);
+    mgcgDecryptBlocks(header, 1, decryptedHeader, iv, cipher);
+    std::vector<unsigned char> payload(mgcgPayloadSize(decryptedHeader));
+    if (mgcgInflateStream(file, size - MGCG_HEADER_SIZE, iv, payload.data(), payload.size(), true, cipher) !=
+        payload.size()) {
+        throw std::runtime_error("Corrupted MGCG file");
+    }
+    return payload;
+}
+
+// A .glb starts with the "glTF" magic, a JSON glTF with '{'
+bool isGLB(const unsigned char *data, size_t size) {
+    return size >= 4 && memcmp(data, "glTF", 4) == 0;
+}
@@ -0,0 +1,154 @@
+/* RESOURCE CACHE */
+// Textures and models loaded from disk stay resident across scene changes: the next scene is initialised before the
+// old one is cleaned up, so whatever both use is acquired again before it is released and is never reloaded.
+// Resources no scene uses anymore are kept until their size exceeds the budget, then evicted least recently used.
+#define RESOURCE_CACHE_BUDGET (256ull * 1024 * 1024)
+
+
+class ResourceCache {
+    struct TextureEntry {
+        Texture *T;
+        int refs;
+        uint64_t lastUse;
+        VkDeviceSize bytes;
+    };
+
+    struct ModelEntry {
+        Model *M;
+        int refs;
+        uint64_t lastUse;
+        VkDeviceSize bytes;
+    };
+
+    BaseProject *BP = nullptr;
+    std::map<std::pair<std::string, VkFormat>, TextureEntry> textures;
+    std::map<std::tuple<std::string, VertexDescriptor *, ModelType>, ModelEntry> models;
+    uint64_t useClock = 0;
+    VkDeviceSize idleBytes = 0;
+
+    static VkDeviceSize textureBytes(BaseProject *bp, Texture *T) {
+        VkMemoryRequirements memRequirements;
+        vkGetImageMemoryRequirements(bp->device, T->textureImage, &memRequirements);
+        return memRequirements.size;
+    }
+
+    static VkDeviceSize modelBytes(Model *M) {
+        return M->vertices.size() + M->indexBytes();
+    }
+
+public:
+    VkDeviceSize budget = RESOURCE_CACHE_BUDGET;
+
+    void init(BaseProject *bp) {
+        BP = bp;
+    }
+
+    // Whether a texture is streamed is decided by its first acquisition
+    Texture *acquireTexture(const std::string &file, VkFormat Fmt = VK_FORMAT_R8G8B8A8_SRGB, bool stream = false) {
+        auto key = std::make_pair(file, Fmt);
+        auto entry = textures.find(key);
+        if (entry != textures.end()) {
+            if (entry->second.refs++ == 0)
+                idleBytes -= entry->second.bytes;
+            return entry->second.T;
+        }
+
+        auto *T = new Texture();
+        T->init(BP, file, Fmt, true, stream);
+        textures[key] = {T, 1, 0, textureBytes(BP, T)};
+        return T;
+    }
+
+    Model *acquireModel(VertexDescriptor *VD, const std::string &file, ModelType MT) {
+        auto key = std::make_tuple(file, VD, MT);
+        auto entry = models.find(key);
+        if (entry != models.end()) {
+            if (entry->second.refs++ == 0)
+                idleBytes -= entry->second.bytes;
+            return entry->second.M;
+        }
+
+        auto *M = new Model();
+        M->init(BP, VD, file, MT);
+        models[key] = {M, 1, 0, modelBytes(M)};
+        return M;
+    }
+
+    // Returns false if the texture does not come from the cache: the caller still owns it
+    bool release(Texture *T) {
+        for (auto &entry: textures) {
+            if (entry.second.T == T) {
+                if (--entry.second.refs == 0) {
+                    entry.second.lastUse = ++useClock;
+                    idleBytes += entry.second.bytes;
+                }
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool release(Model *M) {
+        for (auto &entry: models) {
+            if (entry.second.M == M) {
+                if (--entry.second.refs == 0) {
+                    entry.second.lastUse = ++useClock;
+                    idleBytes += entry.second.bytes;
+                }
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Must be called when the GPU no longer uses the released resources (e.g. after a scene change)
+    void trim() {
+        while (idleBytes > budget) {
+            auto oldestTexture = textures.end();
+            for (auto it = textures.begin(); it != textures.end(); ++it) {
+                if (it->second.refs == 0 &&
+                    (oldestTexture == textures.end() || it->second.lastUse < oldestTexture->second.lastUse))
+                    oldestTexture = it;
+            }
+            auto oldestModel = models.end();
+            for (auto it = models.begin(); it != models.end(); ++it) {
+                if (it->second.refs == 0 &&
+                    (oldestModel == models.end() || it->second.lastUse < oldestModel->second.lastUse))
+                    oldestModel = it;
+            }
+
+            if (oldestTexture != textures.end() &&
+                (oldestModel == models.end() || oldestTexture->second.lastUse < oldestModel->second.lastUse)) {
+                std::cout << "Resource cache: evicting " << oldestTexture->first.first << "\n";
+                idleBytes -= oldestTexture->second.bytes;
+                oldestTexture->second.T->cleanup();
+                delete oldestTexture->second.T;
+                textures.erase(oldestTexture);
+            } else if (oldestModel != models.end()) {
+                std::cout << "Resource cache: evicting " << std::get<0>(oldestModel->first) << "\n";
+                idleBytes -= oldestModel->second.bytes;
+                oldestModel->second.M->cleanup();
+                delete oldestModel->second.M;
+                models.erase(oldestModel);
+            } else {
+                break;
+            }
+        }
+        std::cout << "Resource cache: " << textures.size() << " textures, " << models.size() << " models resident, "
+                  << idleBytes / 1024 << " KiB unused\n";
+    }
+
+    void cleanup() {
+        for (auto &entry: textures) {
+            entry.second.T->cleanup();
+            delete entry.second.T;
+        }
+        textures.clear();
+        for (auto &entry: models) {
+            entry.second.M->cleanup();
+            delete entry.second.M;
+        }
+        models.clear();
+        idleBytes = 0;
+    }
+};
@@ -1,6 +1,3 @@
-#define MAX_LIGHTS 32
-
-
 /* Uniform buffers. */
 struct ObjectUniform {
     alignas(16) glm::mat4 mvpMat;
@@ -13,18 +10,15 @@ struct SourceUniform {
     alignas(16) glm::vec4 lightCol;
 };
 
+// The lights themselves live in the LightData and ClusterGrid storage buffers (see LightGrid.hpp).
 struct LightUniform {
-    // FIXME: Array of uint32_t, instead of glm::vec3, with switch statement inside fragment shader.
-    alignas(16) glm::vec3 TYPE[MAX_LIGHTS]; // i := DIRECT, j := POINT, k := SPOT.
-    alignas(16) glm::vec3 lightPos[MAX_LIGHTS];
-    alignas(16) glm::vec3 lightDir[MAX_LIGHTS];
-    alignas(16) glm::vec4 lightCol[MAX_LIGHTS];
-    // FIXME: Array of uint32_t, instead of glm::vec3.
-    alignas(16) glm::vec3 lightPow[MAX_LIGHTS];
+    alignas(16) glm::vec3 eyeDir;
+    alignas(16) glm::vec4 clusterScale;
     alignas(4) float cosIn;
     alignas(4) float cosOut;
-    alignas(4)  uint32_t NUMBER;
-    alignas(16) glm::vec3 eyeDir;
+    alignas(4) uint32_t NUMBER;
+    alignas(4) uint32_t GLOBAL; // Lights [0, GLOBAL) reach every cluster.
+    alignas(16) glm::mat4 invViewPrj; // Deferred path: world position from the G-buffer depth.
 };
 
 struct ArgsUniform {
@@ -42,11 +36,23 @@ struct UIUniform {
 };
 
 
+/* Texture table. */
+// All the textures of a level are bound once as one sampler array, instances pick theirs with a push constant.
+// Keep in sync with Phong.frag, Toon.frag, GBufferPhong.frag and GBufferToon.frag.
+#define MAX_SCENE_TEXTURES 64
+
+struct InstancePushConstant {
+    alignas(4) uint32_t textureId;
+};
+
+
 /* Vertex formats. */
+// 16 bytes: position quantized over the mesh bounds (see Model::Dq), octahedral normal and half-float UV.
+// Decoded by Shader.vert.
 struct ObjectVertex {
-    glm::vec3 pos;
-    glm::vec3 norm;
-    glm::vec2 UV;
+    int16_t pos[4];
+    int16_t norm[2];
+    uint16_t UV[2];
 };
 
 struct SourceVertex {
@@ -80,10 +86,12 @@ struct Instance {
 struct PipelineRef {
     std::string *id;
     Pipeline *P;
+    Pipeline *depthP; // Depth pre-pass pipeline, drawn before all the shading ones (optional)
 
-    void init(const char *_id, Pipeline *_P) {
+    void init(const char *_id, Pipeline *_P, Pipeline *_depthP = nullptr) {
         id = new std::string(_id);
         P = _P;
+        depthP = _depthP;
     }
 };
 
@@ -149,13 +157,50 @@ protected:
 
     void addTexture(const std::string &id, const std::string &path) {
         TextureIds[id] = TextureCount;
-        T[TextureCount] = new Texture();
-        T[TextureCount]->init(BP, path);
+        T[TextureCount] = loadTexture(path);
         TextureCount++;
     }
 
+    // Resources loaded from disk come from the resource cache when the scene has one
+    Texture *loadTexture(const std::string &path, VkFormat Fmt = VK_FORMAT_R8G8B8A8_SRGB, bool stream = false) {
+        if (RC != nullptr)
+            return RC->acquireTexture(path, Fmt, stream);
+        auto *Tx = new Texture();
+        Tx->init(BP, path, Fmt, true, stream);
+        return Tx;
+    }
+
+    Model *loadModel(VertexDescriptor *VD, const std::string &path, ModelType MT) {
+        if (RC != nullptr)
+            return RC->acquireModel(VD, path, MT);
+        auto *Mx = new Model();
+        Mx->init(BP, VD, path, MT);
+        return Mx;
+    }
+
+    // Descriptor sets of shared layouts are counted only once per scene.
+    void countDescriptors(const std::vector<DescriptorSetLayout *> &D, int &setsInPool, int &uniformBlocksInPool,
+                          int &texturesInPool, int &storageBlocksInPool) {
+        for (DescriptorSetLayout *DSL: D) {
+            if (DSL->shared && !SharedDSLs.insert(DSL).second) {
+                continue;
+            }
+            setsInPool += 1;
+
+            for (auto &B: DSL->Bindings) {
+                if (B.type == VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER) {
+                    uniformBlocksInPool += 1;
+                } else if (B.type == VK_DESCRIPTOR_TYPE_STORAGE_BUFFER) {
+                    storageBlocksInPool += 1;
+                } else {
+                    texturesInPool += B.count;
+                }
+            }
+        }
+    }
+
     void addInstance(const std::string &id, const std::string &mid, const std::vector<std::string> &tids,
-                     int &setsInPool, int &uniformBlocksInPool, int &texturesInPool) {
+                     int &setsInPool, int &uniformBlocksInPool, int &texturesInPool, int &storageBlocksInPool) {
         int instanceIdx = PI[PipelineInstanceCount].InstanceCount;
         PI[PipelineInstanceCount].I[instanceIdx].id = new std::string(id);
         PI[PipelineInstanceCount].I[instanceIdx].Mid = MeshIds[mid];
@@ -171,20 +216,8 @@ protected:
         PI[PipelineInstanceCount].I[instanceIdx].PI = &PI[PipelineInstanceCount];
         PI[PipelineInstanceCount].I[instanceIdx].D = &PI[PipelineInstanceCount].P->P->D;
         PI[PipelineInstanceCount].I[instanceIdx].NDs = PI[PipelineInstanceCount].I[instanceIdx].D->size();
-        setsInPool += PI[PipelineInstanceCount].I[instanceIdx].NDs;
-
-        for (int h = 0; h < PI[PipelineInstanceCount].I[instanceIdx].NDs; h++) {
-            DescriptorSetLayout *DSL = (*PI[PipelineInstanceCount].I[instanceIdx].D)[h];
-            int DSLsize = DSL->Bindings.size();
-
-            for (int l = 0; l < DSLsize; l++) {
-                if (DSL->Bindings[l].type == VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER) {
-                    uniformBlocksInPool += 1;
-                } else {
-                    texturesInPool += 1;
-                }
-            }
-        }
+        countDescriptors(*PI[PipelineInstanceCount].I[instanceIdx].D, setsInPool, uniformBlocksInPool,
+                         texturesInPool, storageBlocksInPool);
 
         PI[PipelineInstanceCount].InstanceCount++;
         InstanceCount++;
@@ -211,6 +244,7 @@ public:
 
     BaseProject *BP{};
     SceneController *SC{};
+    ResourceCache *RC{};
 
     // Models, textures and Descriptors (values assigned to the uniforms)
     // Please note that Model objects depends on the corresponding vertex structure
@@ -236,6 +270,14 @@ public:
     PipelineInstances *PI{};
     std::unordered_map<std::string, VertexDescriptor *> VDIds;
 
+    // Descriptor sets of shared layouts, bound by every instance using the layout
+    std::set<DescriptorSetLayout *> SharedDSLs;
+    std::unordered_map<DescriptorSetLayout *, DescriptorSet *> SharedDS;
+    std::unordered_map<DescriptorSetLayout *, std::vector<Texture *>> SharedTextures;
+
+    // Recording order of the instances of every pipeline group (empty: as loaded)
+    std::vector<std::vector<int>> drawOrder;
+
 
     virtual int init(BaseProject *_BP, std::vector<VertexDescriptorRef> &VDRs,
                      std::vector<PipelineRef> &PRs, const std::string &file) = 0;
@@ -244,7 +286,20 @@ public:
         SC = sc;
     }
 
-    void pipelinesAndDescriptorSetsInit() const {
+    void setResourceCache(ResourceCache *rc) {
+        RC = rc;
+    }
+
+    DescriptorSet *getSharedDS(const std::string &pipelineId, int setId) {
+        auto PR = PipelineIds.find(pipelineId);
+        if (PR == PipelineIds.end()) {
+            return nullptr;
+        }
+        auto DS = SharedDS.find(PR->second->P->D[setId]);
+        return DS == SharedDS.end() ? nullptr : DS->second;
+    }
+
+    void pipelinesAndDescriptorSetsInit() {
         std::cout << "Scene DS init\n";
         for (int i = 0; i < InstanceCount; i++) {
             std::cout << "I: " << i << ", NTx: " << I[i]->NTx << ", NDs: " << I[i]->NDs << "\n";
@@ -256,36 +311,56 @@ public:
 
             I[i]->DS = (DescriptorSet **) calloc(I[i]->NDs, sizeof(DescriptorSet *));
             for (int j = 0; j < I[i]->NDs; j++) {
-                I[i]->DS[j] = new DescriptorSet();
-                I[i]->DS[j]->init(BP, (*I[i]->D)[j], Tids);
+                DescriptorSetLayout *DSL = (*I[i]->D)[j];
+                if (DSL->shared) {
+                    if (SharedDS.find(DSL) == SharedDS.end()) {
+                        SharedDS[DSL] = new DescriptorSet();
+                        SharedDS[DSL]->init(BP, DSL, SharedTextures[DSL]);
+                    }
+                    I[i]->DS[j] = SharedDS[DSL];
+                } else {
+                    I[i]->DS[j] = new DescriptorSet();
+                    I[i]->DS[j]->init(BP, DSL, Tids);
+                }
             }
         }
         std::cout << "Scene DS init Done\n";
     }
 
-    void pipelinesAndDescriptorSetsCleanup() const {
+    void pipelinesAndDescriptorSetsCleanup() {
         // Cleanup datasets
         for (int i = 0; i < InstanceCount; i++) {
             for (int j = 0; j < I[i]->NDs; j++) {
-                I[i]->DS[j]->cleanup();
-                delete I[i]->DS[j];
+                if (!(*I[i]->D)[j]->shared) {
+                    I[i]->DS[j]->cleanup();
+                    delete I[i]->DS[j];
+                }
             }
             free(I[i]->DS);
         }
+        for (auto &DS: SharedDS) {
+            DS.second->cleanup();
+            delete DS.second;
+        }
+        SharedDS.clear();
     }
 
-    void localCleanup() const {
+    virtual void localCleanup() const {
         std::cout << "Cleanup textures." << std::endl;
         for (int i = 0; i < TextureCount; i++) {
-            T[i]->cleanup();
-            delete T[i];
+            if (RC == nullptr || !RC->release(T[i])) {
+                T[i]->cleanup();
+                delete T[i];
+            }
         }
         free(T);
 
         std::cout << "Cleanup models" << std::endl;
         for (int i = 0; i < ModelCount; i++) {
-            M[i]->cleanup();
-            delete M[i];
+            if (RC == nullptr || !RC->release(M[i])) {
+                M[i]->cleanup();
+                delete M[i];
+            }
         }
         free(M);
 
@@ -307,22 +382,85 @@ public:
         free(SC);
     }
 
-    void populateCommandBuffer(VkCommandBuffer commandBuffer, int currentImage) const {
+    virtual void populateFrameCommandBuffer(VkCommandBuffer commandBuffer, int currentImage) {}
+
+    // Front-to-back along viewDir, so that the early depth test rejects hidden fragments before the light loop.
+    // The key is the pipeline (the groups keep their order), then the view depth, then the material: depths are
+    // bucketed so that neighbouring instances sharing texture and model are drawn together.
+    void sortInstances(glm::vec3 viewDir) {
+        const float depthBucket = 1.0f;
+        drawOrder.resize(PipelineInstanceCount);
         for (int k = 0; k < PipelineInstanceCount; k++) {
+            std::vector<std::tuple<int, int, int, int>> keys(PI[k].InstanceCount);
             for (int i = 0; i < PI[k].InstanceCount; i++) {
-                Pipeline *P = PI[k].I[i].PI->P->P;
-                P->bind(commandBuffer);
+                const Instance &inst = PI[k].I[i];
+                float depth = glm::dot(glm::vec3(inst.Wm[3]), viewDir);
+                keys[i] = {(int) glm::floor(depth / depthBucket), inst.NTx > 0 ? inst.Tid[0] : -1, inst.Mid, i};
+            }
+            std::sort(keys.begin(), keys.end());
+            drawOrder[k].resize(PI[k].InstanceCount);
+            for (int i = 0; i < PI[k].InstanceCount; i++)
+                drawOrder[k][i] = std::get<3>(keys[i]);
+        }
+    }
+
+    // Records the instances whose pipeline targets the pass being recorded (G-buffer or main)
+    void populateCommandBuffer(VkCommandBuffer commandBuffer, int currentImage, bool gBuffer = false) const {
+        // Depth pre-pass: lay down the depth of the groups that have one, their shading pipeline tests EQUAL
+        if (!gBuffer) {
+            for (int k = 0; k < PipelineInstanceCount; k++) {
+                if (PI[k].P->depthP != nullptr && !PI[k].P->P->gBuffer)
+                    populateInstances(commandBuffer, currentImage, k, PI[k].P->depthP);
+            }
+        }
+        for (int k = 0; k < PipelineInstanceCount; k++) {
+            if (PI[k].P->P->gBuffer == gBuffer)
+                populateInstances(commandBuffer, currentImage, k, PI[k].P->P);
+        }
+    }
+
+    // Shared sets (lights, texture table) are bound once per group, the per-instance ones at every draw
+    void populateInstances(VkCommandBuffer commandBuffer, int currentImage, int k, Pipeline *P) const {
+        P->bind(commandBuffer);
+        int boundMid = -1;
+        std::vector<DescriptorSet *> boundDS(P->D.size(), nullptr);
+        for (int n = 0; n < PI[k].InstanceCount; n++) {
+            int i = drawOrder.empty() ? n : drawOrder[k][n];
 
-                //std::cout << "Drawing Instance " << i << "\n";
+            //std::cout << "Drawing Instance " << i << "\n";
+            if (PI[k].I[i].Mid != boundMid) {
                 M[PI[k].I[i].Mid]->bind(commandBuffer);
-                //std::cout << "Binding DS: " << DS[i] << "\n";
-                for (int j = 0; j < PI[k].I[i].NDs; j++) {
+                boundMid = PI[k].I[i].Mid;
+            }
+            //std::cout << "Binding DS: " << DS[i] << "\n";
+            for (int j = 0; j < PI[k].I[i].NDs; j++) {
+                if (PI[k].I[i].DS[j] != boundDS[j]) {
                     PI[k].I[i].DS[j]->bind(commandBuffer, *P, j, currentImage);
+                    boundDS[j] = PI[k].I[i].DS[j];
+                }
+            }
+            const Model *Mi = M[PI[k].I[i].Mid];
+            if (P->pushConstantSize == 0 || Mi->subMeshes.size() <= 1) {
+                if (P->pushConstantSize > 0) {
+                    InstancePushConstant pc{(uint32_t) (PI[k].I[i].NTx > 0 ? PI[k].I[i].Tid[0] : 0)};
+                    vkCmdPushConstants(commandBuffer, P->pipelineLayout, P->pushConstantStages, 0, sizeof(pc), &pc);
                 }
+                vkCmdDrawIndexed(commandBuffer, static_cast<uint32_t>(Mi->indices.size()), 1, 0, 0, 0);
+                continue;
+            }
 
-                //std::cout << "Draw Call\n";
-                vkCmdDrawIndexed(commandBuffer,
-                                 static_cast<uint32_t>(M[PI[k].I[i].Mid]->indices.size()), 1, 0, 0, 0);
+            // One draw per sub-mesh: its material index picks the texture among those of the instance
+            uint32_t pushedTexture = UINT32_MAX;
+            for (size_t s = 0; s < Mi->subMeshes.size(); s++) {
+                int material = Mi->subMeshes[s].material;
+                int t = material >= 0 && material < PI[k].I[i].NTx ? material : 0;
+                uint32_t texture = PI[k].I[i].NTx > 0 ? (uint32_t) PI[k].I[i].Tid[t] : 0;
+                if (texture != pushedTexture) {
+                    InstancePushConstant pc{texture};
+                    vkCmdPushConstants(commandBuffer, P->pipelineLayout, P->pushConstantStages, 0, sizeof(pc), &pc);
+                    pushedTexture = texture;
+                }
+                Mi->drawSubMesh(commandBuffer, s);
             }
         }
     }
@@ -330,17 +468,7 @@ public:
 
 class LevelScene : public Scene {
 public:
-    std::map<std::string, SceneObjectType> str2enum = {
-            {"PLAYER",   SceneObjectType::SO_PLAYER},
-            {"GROUND",   SceneObjectType::SO_GROUND},
-            {"WALL",     SceneObjectType::SO_WALL},
-            {"LIGHT",    SceneObjectType::SO_LIGHT},
-            {"TORCH",    SceneObjectType::SO_TORCH},
-            {"LAMP",     SceneObjectType::SO_LAMP},
-            {"BONFIRE",  SceneObjectType::SO_BONFIRE},
-            {"TRAPDOOR", SceneObjectType::SO_TRAPDOOR},
-            {"OTHER",    SceneObjectType::SO_OTHER}
-    };
+    ShadowAtlas shadowAtlas;
 
     int init(BaseProject *_BP, std::vector<VertexDescriptorRef> &VDRs,
              std::vector<PipelineRef> &PRs, const std::string &file) override {
@@ -354,32 +482,39 @@ public:
         }
 
         // Models, textures and Descriptors (values assigned to the uniforms)
-        nlohmann::json js;
         std::string path = "models/" + file;
-        std::ifstream ifs(path);
-        if (!ifs.is_open()) {
+        if (!std::ifstream(path).is_open()) {
             std::cout << "Error! Scene file not found!";
             exit(-1);
         }
         try {
-            std::cout << "Parsing JSON\n";
-            ifs >> js;
-            ifs.close();
-            std::cout << "\nScene contains " << js.size() << " definitions sections\n\n";
+            // The compiled scene scene-gen writes next to the JSON, unless it is stale
+            SceneDescription desc;
+            std::string compiled = compiledScenePath(path);
+            if (!compiled.empty()) {
+                try {
+                    std::cout << "Mapping " << compiled << "\n";
+                    desc = loadSceneBinary(compiled);
+                } catch (const std::runtime_error &e) {
+                    std::cout << e.what() << "\n";
+                    compiled.clear();
+                }
+            }
+            if (compiled.empty()) {
+                std::cout << "Parsing JSON\n";
+                desc = loadSceneJSON(path);
+            }
 
             // MODELS
-            nlohmann::json ms = js["models"];
-            ModelCount = ms.size();
+            ModelCount = (int) desc.models.size();
             std::cout << "Models count: " << ModelCount << "\n";
 
             M = (Model **) calloc(ModelCount + 1, sizeof(Model *)); // +1 for the skybox
             for (int k = 0; k < ModelCount; k++) {
-                MeshIds[ms[k]["id"]] = k;
-                std::string MT = ms[k]["format"].template get<std::string>();
-                std::string VDN = ms[k]["VD"].template get<std::string>();
-
-                M[k] = new Model();
-                M[k]->init(BP, VDIds[VDN], ms[k]["model"], (MT[0] == 'O') ? OBJ : ((MT[0] == 'G') ? GLTF : MGCG));
+                const SceneModelDesc &md = desc.models[k];
+                MeshIds[md.id] = k;
+                M[k] = loadModel(VDIds[md.VD], md.model,
+                                 (md.format[0] == 'O') ? OBJ : ((md.format[0] == 'G') ? GLTF : MGCG));
             }
 
             // Skybox model
@@ -394,24 +529,23 @@ public:
             addModel("skybox-m", "skybox", vertices, indices);
 
             // TEXTURES
-            nlohmann::json ts = js["textures"];
-            TextureCount = ts.size();
+            TextureCount = (int) desc.textures.size();
             std::cout << "Textures count: " << TextureCount << "\n";
 
             T = (Texture **) calloc(TextureCount + 1, sizeof(Texture *)); // +1 for the skybox
             for (int k = 0; k < TextureCount; k++) {
-                TextureIds[ts[k]["id"]] = k;
-                std::string TT = ts[k]["format"].template get<std::string>();
-
-                T[k] = new Texture();
-                if (TT[0] == 'C') {
-                    T[k]->init(BP, ts[k]["texture"]);
-                } else if (TT[0] == 'D') {
-                    T[k]->init(BP, ts[k]["texture"], VK_FORMAT_R8G8B8A8_UNORM);
+                const SceneTextureDesc &td = desc.textures[k];
+                TextureIds[td.id] = k;
+
+                // the level textures are streamed, the UI ones are needed whole from the first frame
+                if (td.format[0] == 'C') {
+                    T[k] = loadTexture(td.texture, VK_FORMAT_R8G8B8A8_SRGB, true);
+                } else if (td.format[0] == 'D') {
+                    T[k] = loadTexture(td.texture, VK_FORMAT_R8G8B8A8_UNORM, true);
                 } else {
-                    std::cout << "FORMAT UNKNOWN: " << TT << "\n";
+                    std::cout << "FORMAT UNKNOWN: " << td.format << "\n";
                 }
-                std::cout << ts[k]["id"] << "(" << k << ") " << TT << "\n";
+                std::cout << td.id << "(" << k << ") " << td.format << "\n";
             }
 
             // Skybox texture
@@ -419,94 +553,93 @@ public:
                        "textures/menu/deep-fold.png"); // Credits: https://deep-fold.itch.io/space-background-generator
 
             // INSTANCES
-            nlohmann::json pis = js["instances"];
-            PipelineInstanceCount = pis.size();
+            PipelineInstanceCount = (int) desc.pipelines.size();
             std::cout << "Pipeline Instances count: " << PipelineInstanceCount << "\n";
-            PI = (PipelineInstances *) calloc(PipelineInstanceCount + 1,
-                                              sizeof(PipelineInstances)); // +1 for the skybox
+            PI = (PipelineInstances *) calloc(PipelineInstanceCount + 2,
+                                              sizeof(PipelineInstances)); // +1 for the skybox, +1 for deferred lighting
             InstanceCount = 0;
             int setsInPool = 0;
             int uniformBlocksInPool = 0;
             int texturesInPool = 0;
+            int storageBlocksInPool = 0;
 
             for (int k = 0; k < PipelineInstanceCount; k++) {
-                std::string Pid = pis[k]["pipeline"].template get<std::string>();
+                const ScenePipelineDesc &pd = desc.pipelines[k];
 
-                PI[k].P = PipelineIds[Pid];
-                nlohmann::json is = pis[k]["elements"];
-                PI[k].InstanceCount = is.size();
-                std::cout << "Pipeline: " << Pid << "(" << k << "), Instances count: " << PI[k].InstanceCount << "\n";
+                PI[k].P = PipelineIds[pd.pipeline];
+                PI[k].InstanceCount = (int) pd.elements.size();
+                std::cout << "Pipeline: " << pd.pipeline << "(" << k << "), Instances count: " << PI[k].InstanceCount
+                          << "\n";
                 PI[k].I = (Instance *) calloc(PI[k].InstanceCount, sizeof(Instance));
 
                 for (int j = 0; j < PI[k].InstanceCount; j++) {
+                    const SceneInstanceDesc &id = pd.elements[j];
                     auto *oi = new ObjectInstance();
-                    oi->I_id = is[j]["id"];
-                    oi->type = static_cast<SceneObjectType>(str2enum[is[j]["label"]]);
+                    oi->I_id = id.id;
+                    oi->type = id.type;
                     if (oi->type == SceneObjectType::SO_TORCH || oi->type == SceneObjectType::SO_LAMP ||
                         oi->type == SceneObjectType::SO_BONFIRE) {
-                        oi->lType = is[j]["type"];
-                        oi->lColor = glm::vec4(is[j]["color"][0], is[j]["color"][1], is[j]["color"][2], 1.0f);
-                        oi->lPower = is[j]["power"];
-                        oi->lPosition = glm::vec3(is[j]["where"][0], is[j]["where"][1], is[j]["where"][2]);
+                        oi->lType = id.lType;
+                        oi->lColor = glm::vec4(id.lColor, 1.0f);
+                        oi->lPower = id.lPower;
+                        oi->lPosition = id.lPosition;
                     }
                     if (oi->type == SceneObjectType::SO_TORCH)
                         oi->isOn = false;
                     if (oi->type == SceneObjectType::SO_LAMP || oi->type == SceneObjectType::SO_BONFIRE)
                         oi->isOn = true;
-                    std::pair<int, int> coords = {is[j]["coordinates"][0], is[j]["coordinates"][1]};
-                    SC->addObjectToMap(coords, oi);
-                    std::cout << k << "." << j << "\t" << is[j]["id"] << ", " << is[j]["model"] << "("
-                              << MeshIds[is[j]["model"]] << "), {";
-                    PI[k].I[j].id = new std::string(is[j]["id"]);
-                    PI[k].I[j].Mid = MeshIds[is[j]["model"]];
-                    int NTextures = is[j]["texture"].size();
+                    SC->addObjectToMap(id.coordinates, oi);
+                    PI[k].I[j].id = new std::string(id.id);
+                    PI[k].I[j].Mid = MeshIds[id.model];
+                    std::cout << k << "." << j << "\t" << id.id << ", " << id.model << "(" << PI[k].I[j].Mid << "), {";
+                    int NTextures = (int) id.textures.size();
                     PI[k].I[j].NTx = NTextures;
                     PI[k].I[j].Tid = (int *) calloc(NTextures, sizeof(int));
                     std::cout << "#" << NTextures;
                     for (int h = 0; h < NTextures; h++) {
-                        PI[k].I[j].Tid[h] = TextureIds[is[j]["texture"][h]];
-                        std::cout << " " << is[j]["texture"][h] << "(" << PI[k].I[j].Tid[h] << ")";
+                        PI[k].I[j].Tid[h] = TextureIds[id.textures[h]];
+                        std::cout << " " << id.textures[h] << "(" << PI[k].I[j].Tid[h] << ")";
                     }
                     std::cout << "}\n";
-                    nlohmann::json TMjson = is[j]["transform"];
-                    float TMj[16];
-                    for (int h = 0; h < 16; h++) { TMj[h] = TMjson[h]; }
-                    PI[k].I[j].Wm = glm::mat4(TMj[0], TMj[4], TMj[8], TMj[12], TMj[1], TMj[5], TMj[9], TMj[13], TMj[2],
-                                              TMj[6], TMj[10], TMj[14], TMj[3], TMj[7], TMj[11], TMj[15]);
+                    PI[k].I[j].Wm = id.Wm;
 
                     PI[k].I[j].PI = &PI[k];
                     PI[k].I[j].D = &PI[k].P->P->D;
                     PI[k].I[j].NDs = PI[k].I[j].D->size();
-                    setsInPool += PI[k].I[j].NDs;
-
-                    for (int h = 0; h < PI[k].I[j].NDs; h++) {
-                        DescriptorSetLayout *DSL = (*PI[k].I[j].D)[h];
-                        int DSLsize = DSL->Bindings.size();
-
-                        for (int l = 0; l < DSLsize; l++) {
-                            if (DSL->Bindings[l].type == VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER) {
-                                uniformBlocksInPool += 1;
-                            } else {
-                                texturesInPool += 1;
-                            }
-                        }
-                    }
+                    countDescriptors(*PI[k].I[j].D, setsInPool, uniformBlocksInPool, texturesInPool,
+                                     storageBlocksInPool);
                     InstanceCount++;
                 }
             }
 
+            // Deferred lighting: a full-screen quad over the G-buffer, drawn before the skybox so that the
+            // skybox only fills the pixels left empty by the level
+            auto deferredPR = PipelineIds.find("deferred");
+            if (deferredPR != PipelineIds.end()) {
+                PI[PipelineInstanceCount].P = deferredPR->second;
+                PI[PipelineInstanceCount].InstanceCount = 0;
+                PI[PipelineInstanceCount].I = (Instance *) calloc(1, sizeof(Instance));
+
+                addInstance("deferred-obj", "skybox-m", {}, setsInPool, uniformBlocksInPool, texturesInPool,
+                            storageBlocksInPool);
+                SharedTextures[deferredPR->second->P->D[1]] = BP->getGBuffer();
+                PipelineInstanceCount++;
+            }
+
             // Skybox pipeline instance + object instance
             PI[PipelineInstanceCount].P = PipelineIds["skybox"];
             PI[PipelineInstanceCount].InstanceCount = 0;
             PI[PipelineInstanceCount].I = (Instance *) calloc(1, sizeof(Instance));
 
             // background instance
-            addInstance("skybox-obj", "skybox-m", {"skybox-tex"}, setsInPool, uniformBlocksInPool, texturesInPool);
+            addInstance("skybox-obj", "skybox-m", {"skybox-tex"}, setsInPool, uniformBlocksInPool, texturesInPool,
+                        storageBlocksInPool);
             PipelineInstanceCount++;
 
             // Request xInPool
             BP->requestSetsInPool(setsInPool);
             BP->requestUniformBlocksInPool(uniformBlocksInPool);
+            BP->requestStorageBlocksInPool(storageBlocksInPool);
             BP->requestTexturesInPool(texturesInPool);
 
             std::cout << "Creating instances\n";
@@ -524,6 +657,22 @@ public:
             }
             std::cout << i << " instances created\n";
 
+            // The instances of the phong pipeline are the level itself: they are the (static) shadow casters
+            PipelineRef *phong = PipelineIds["phong"];
+            if (TextureCount > MAX_SCENE_TEXTURES) {
+                throw std::runtime_error("too many textures for the scene texture table!");
+            }
+            SharedTextures[phong->P->D[2]] = std::vector<Texture *>(T, T + TextureCount);
+            shadowAtlas.init(BP, VDIds["object"], phong->P->D[0]);
+            for (int k = 0; k < PipelineInstanceCount; k++) {
+                if (PI[k].P == phong) {
+                    for (int j = 0; j < PI[k].InstanceCount; j++) {
+                        shadowAtlas.addCaster(M[PI[k].I[j].Mid], PI[k].I[j].Wm);
+                    }
+                }
+            }
+            SharedTextures[phong->P->D[0]] = {&shadowAtlas.texture};
+            std::cout << shadowAtlas.casters.size() << " shadow casters\n";
 
         } catch (const nlohmann::json::exception &e) {
             std::cout << "\n\n\nException while parsing JSON file: " << file << "\n";
@@ -555,6 +704,16 @@ public:
         std::cout << "Leaving scene loading and creation\n";
         return 0;
     }
+
+    // tiles of the lights that got a slot in this frame, and of the carried torch
+    void populateFrameCommandBuffer(VkCommandBuffer commandBuffer, int currentImage) override {
+        shadowAtlas.populateFrameCommandBuffer(commandBuffer, getSharedDS("phong", 0), currentImage);
+    }
+
+    void localCleanup() const override {
+        shadowAtlas.localCleanup();
+        Scene::localCleanup();
+    }
 };
 
 class ScreenScene : public Scene {
@@ -630,6 +789,7 @@ public:
         int setsInPool = 0;
         int uniformBlocksInPool = 0;
         int texturesInPool = 0;
+        int storageBlocksInPool = 0;
         // background pipeline
         PI[PipelineInstanceCount].P = PipelineIds["skybox"];
         PI[PipelineInstanceCount].InstanceCount = 0;
@@ -637,7 +797,7 @@ public:
                                                           sizeof(Instance)); // calculate the number of instances: 1 background, 1 cursor, 2 buttons (one active at each scene)
         // background instance
         addInstance("bg-obj", "bg-m", {"bg-tex"}, setsInPool, uniformBlocksInPool,
-                    texturesInPool);
+                    texturesInPool, storageBlocksInPool);
 
         PipelineInstanceCount++;
 
@@ -652,7 +812,8 @@ public:
             texIds = {"play-tex-before", "play-tex-after"};
         else
             texIds = {"exit-tex-before", "exit-tex-after"};
-        addInstance("button-obj", "button-m", texIds, setsInPool, uniformBlocksInPool, texturesInPool);
+        addInstance("button-obj", "button-m", texIds, setsInPool, uniformBlocksInPool, texturesInPool,
+                    storageBlocksInPool);
         auto oi = new ObjectInstance();
         oi->I_id = "button-obj";
         oi->type = SceneObjectType::SO_BUTTON;
@@ -660,7 +821,7 @@ public:
         SC->addObjectToMap({0, 0}, oi);
 
         addInstance("cursor-obj", "cursor-m", {"cursor-tex", "cursor-tex"}, setsInPool, uniformBlocksInPool,
-                    texturesInPool);
+                    texturesInPool, storageBlocksInPool);
         oi = new ObjectInstance();
         oi->I_id = "cursor-obj";
         oi->type = SceneObjectType::SO_CURSOR;
@@ -671,6 +832,7 @@ public:
         // Request xInPool
         BP->requestSetsInPool(setsInPool);
         BP->requestUniformBlocksInPool(uniformBlocksInPool);
+        BP->requestStorageBlocksInPool(storageBlocksInPool);
         BP->requestTexturesInPool(texturesInPool);
 
         std::cout << "Creating instances\n";
@@ -696,11 +858,22 @@ class LevelSceneController : public SceneController {
     LevelScene *scene{};
     std::map<std::pair<int, int>, std::vector<ObjectInstance *>> myMap = {};
     ObjectInstance *torchWithPlayer = nullptr;
+    LightGrid lightGrid;
+
+    // Static light sources indexed by the BVH, direct lights reach everything and are kept apart
+    std::vector<ObjectInstance *> lightSources;
+    std::vector<ObjectInstance *> directLights;
+    LightBVH lightBVH;
+    std::vector<uint32_t> lightCandidates;
+    std::vector<std::pair<float, ObjectInstance *>> rankedLights;
+    const size_t maxActiveLights = 256;
+    // Synthetic point lights around the spawn (--lights=N), position and colour
+    std::vector<std::pair<glm::vec3, glm::vec4>> stressLights;
+    constexpr static const float STRESS_LIGHT_SPREAD = 8.0f;
+    constexpr static const float STRESS_LIGHT_POWER = 0.02f;
 
     constexpr static const float UNIT = 3.0f;
 
-    const float lightRenderDistance = 40.0f;
-
     const float zoom_speed = 1.0f;
     const float max_zoom = 8.0f;
     const float min_zoom = 1.5f;
@@ -776,12 +949,13 @@ class LevelSceneController : public SceneController {
     std::chrono::high_resolution_clock::time_point lightAnimStartTime = std::chrono::high_resolution_clock::now();
     bool animatingLights = false;
 
-    static void updateObjectBuffer(uint32_t currentImage, Instance *I, glm::mat4 ViewPrj, glm::mat4 baseTr,
-                                   const std::vector<void *> &gubos, bool spec) {
+    static void updateObjectBuffer(uint32_t currentImage, Instance *I, Model *M, glm::mat4 ViewPrj, glm::mat4 baseTr,
+                                   bool spec) {
         ObjectUniform oubo{};
 
-        oubo.mMat = baseTr * I->Wm;
-        oubo.nMat = glm::inverse(glm::transpose(oubo.mMat));
+        // Normals are decoded in model space, so the dequantization of the positions stays out of nMat
+        oubo.nMat = glm::inverse(glm::transpose(baseTr * I->Wm));
+        oubo.mMat = baseTr * I->Wm * M->Dq;
         oubo.mvpMat = ViewPrj * oubo.mMat;
 
         ArgsUniform aubo{};
@@ -791,7 +965,6 @@ class LevelSceneController : public SceneController {
 
         I->DS[1]->map(currentImage, &oubo, 0);
         I->DS[1]->map(currentImage, &aubo, 2);
-        I->DS[0]->map(currentImage, gubos[0], 0);
     }
 
     static void updateSourceBuffer(uint32_t currentImage, Instance *I, ObjectInstance *obj,
@@ -809,19 +982,12 @@ class LevelSceneController : public SceneController {
         I->DS[0]->map(currentImage, &pubo, 2);
     }
 
-    static void updateLightBuffer(uint32_t currentImage, ObjectInstance *obj,
-                                  glm::vec3 lPosition, LightUniform *gubo, int idx, float powerFactor) {
-        if (obj->lType == "DIRECT")
-            gubo->TYPE[idx] = glm::vec3(1, 0, 0);
-        else if (obj->lType == "POINT")
-            gubo->TYPE[idx] = glm::vec3(0, 1, 0);
-        else if (obj->lType == "SPOT")
-            gubo->TYPE[idx] = glm::vec3(0, 0, 1);
-        gubo->lightPos[idx] = lPosition;
-        gubo->lightDir[idx] = glm::vec3(obj->lDirection);
-        gubo->lightCol[idx] = obj->lColor;
-        gubo->lightPow[idx] = glm::vec3(obj->lPower * powerFactor);
-        gubo->NUMBER = idx + 1;
+    static LightType getLightType(const std::string &lType) {
+        if (lType == "DIRECT")
+            return LIGHT_DIRECT;
+        else if (lType == "SPOT")
+            return LIGHT_SPOT;
+        return LIGHT_POINT;
     }
 
     static auto ease_in_ease_out(auto start, auto target, float timeI) {
@@ -849,12 +1015,56 @@ public:
         }
     }
 
+    static bool isLightSource(const ObjectInstance *obj) {
+        return obj->type == SceneObjectType::SO_LIGHT || obj->type == SceneObjectType::SO_TORCH ||
+               obj->type == SceneObjectType::SO_LAMP || obj->type == SceneObjectType::SO_BONFIRE;
+    }
+
     void init() override {
+        // index the light sources once, with the radius they reach at full power
+        lightSources.clear();
+        directLights.clear();
+        lightBVH.clear();
+        for (auto &pair: myMap) {
+            for (auto &obj: pair.second) {
+                if (!isLightSource(obj))
+                    continue;
+                if (getLightType(obj->lType) == LIGHT_DIRECT) {
+                    directLights.push_back(obj);
+                    continue;
+                }
+                lightBVH.add(obj->lPosition, LightGrid::lightRadius(obj->lColor, obj->lPower), lightSources.size());
+                lightSources.push_back(obj);
+            }
+        }
+        lightBVH.build();
+        std::cout << "Light BVH: " << lightSources.size() << " lights\n";
+
+        // benchmark lights on a golden angle spiral around the spawn, each one reaching a few units
+        lightGrid.clustered = scene->BP->isClusteredLighting();
+        stressLights.clear();
+        int stressCount = scene->BP->getStressLights();
+        for (int i = 0; i < stressCount; i++) {
+            float r = STRESS_LIGHT_SPREAD * glm::sqrt(((float) i + 0.5f) / (float) stressCount);
+            float a = (float) i * 2.39996323f;
+            glm::vec3 hue = glm::fract(glm::vec3((float) i * 0.618034f) + glm::vec3(0.0f, 2.0f / 3.0f, 1.0f / 3.0f));
+            glm::vec3 col = glm::clamp(glm::abs(hue * 6.0f - 3.0f) - 1.0f, 0.0f, 1.0f);
+            stressLights.emplace_back(currPlayerPos + glm::vec3(r * glm::cos(a), 0.3f, r * glm::sin(a)),
+                                      glm::vec4(col, 1.0f));
+        }
+        if (stressCount > 0)
+            std::cout << "Stress lights: " << stressCount << (lightGrid.clustered ? " clustered\n" : " flat\n");
+
+        scene->sortInstances(viewDirection(projRot));
+
         // set text for torches
         scene->BP->changeText("Lit Torches: " + std::to_string(numLitTorches) + "/" + std::to_string(numTorches), 0);
     }
 
     void localCleanup() override {
+        lightSources.clear();
+        directLights.clear();
+        lightBVH.clear();
         for (auto &pair: myMap) {
             for (auto &obj: pair.second) {
                 delete obj;
@@ -862,6 +1072,19 @@ public:
         }
     }
 
+    // Isometric camera, turned by quarters of a revolution
+    static glm::mat4 cameraView(float rot) {
+        return glm::rotate(glm::mat4(1.0f), glm::radians(35.264f), glm::vec3(1.0f, 0.0f, 0.0f)) *
+               glm::rotate(glm::mat4(1.0f), glm::radians(-45.0f), glm::vec3(0.0f, 1.0f, 0.0f)) *
+               glm::rotate(glm::mat4(1.0f), glm::radians(90.f * rot), glm::vec3(0.0f, 1.0f, 0.0f)) *
+               glm::translate(glm::mat4(1.0f), glm::vec3(0.0f, -1.0f, 0.0f));
+    }
+
+    // World direction the camera looks at: the view depth of a point is its dot product with it
+    static glm::vec3 viewDirection(float rot) {
+        return glm::transpose(glm::mat3(cameraView(rot))) * glm::vec3(0.0f, 0.0f, -1.0f);
+    }
+
     static float updatePlayerRot(glm::vec3 m, float projRot, float playerRot) {
         // rotate m by projRot
         glm::vec4 rotatedM = glm::rotate(glm::mat4(1.f), glm::radians(-90 * projRot),
@@ -983,16 +1206,16 @@ public:
                 currProjRot = projRot_old = projRot;
                 isCameraRotating = false;
                 std::cout << "Camera ENDED rotating to " << projRot << "\n";
+                // the view direction changed: restore the front-to-back order
+                scene->sortInstances(viewDirection(projRot));
+                scene->BP->requestCommandBufferRebuild();
             } else {
                 currProjRot = ease_in_ease_out(projRot_old, projRot, elapsed / camRotDuration);
                 //std::cout << "Camera still rotating\n";
             }
         }
 
-        glm::mat4 View = glm::rotate(glm::mat4(1.0f), glm::radians(35.264f), glm::vec3(1.0f, 0.0f, 0.0f)) *
-                         glm::rotate(glm::mat4(1.0f), glm::radians(-45.0f), glm::vec3(0.0f, 1.0f, 0.0f)) *
-                         glm::rotate(glm::mat4(1.0f), glm::radians(90.f * currProjRot), glm::vec3(0.0f, 1.0f, 0.0f)) *
-                         glm::translate(glm::mat4(1.0f), glm::vec3(0.0f, -1.0f, 0.0f));
+        glm::mat4 View = cameraView(currProjRot);
 
         glm::mat4 ViewPrj = Prj * View;
 
@@ -1208,31 +1431,68 @@ public:
         LightUniform lubo{};
         lubo.eyeDir = glm::vec3(glm::inverse(View) * glm::vec4(0, 0, 1, 1));
         // std::cout << "EyeDir: " << lubo.eyeDir.x << ", " << lubo.eyeDir.y << ", " << lubo.eyeDir.z << "\n";
-        int idx = 0;
-        for (auto &pair: myMap) {
-            for (auto &obj: pair.second) {
-                if (obj->type != SceneObjectType::SO_LIGHT &&
-                    !(obj->type == SceneObjectType::SO_TORCH && obj->isOn) &&
-                    obj->type != SceneObjectType::SO_LAMP && obj->type != SceneObjectType::SO_BONFIRE)
-                    continue;
-                if (obj->type == SceneObjectType::SO_TORCH || obj->type == SceneObjectType::SO_LAMP ||
-                    obj->type == SceneObjectType::SO_BONFIRE) {
-                    if (obj->lType != "DIRECT" && obj != torchWithPlayer &&
-                        glm::distance(currPlayerPos, obj->lPosition) > lightRenderDistance)
-                        continue;
-                }
-                glm::vec3 lPosition;
-                if (obj == torchWithPlayer)
-                    lPosition = glm::vec3(torchPlTr * glm::vec4(obj->lPosition, 1.0f));
-                else
-                    lPosition = obj->lPosition;
-                updateLightBuffer(currentImage, obj, lPosition, &lubo, idx,
-                                  obj->type == SceneObjectType::SO_LIGHT ? 1.0f : currPowerFactor);
-                idx++;
-            }
-        }
         lubo.cosIn = glm::cos(glm::radians(30.0f));
         lubo.cosOut = glm::cos(glm::radians(45.0f));
+        float spotAngle = 2.0f * glm::acos(lubo.cosOut);
+
+        ShadowAtlas &shadowAtlas = scene->shadowAtlas;
+        shadowAtlas.beginFrame();
+        lightGrid.clear();
+        for (auto &obj: directLights)
+            lightGrid.addLight(LIGHT_DIRECT, obj->lPosition, obj->lDirection, obj->lColor, obj->lPower);
+
+        // the torch carried by the player always comes first, then the lights reaching the view by importance
+        if (torchWithPlayer && torchWithPlayer->isOn) {
+            LightType type = getLightType(torchWithPlayer->lType);
+            glm::vec3 lPosition = glm::vec3(torchPlTr * glm::vec4(torchWithPlayer->lPosition, 1.0f));
+            int shadowTile = shadowAtlas.acquireDynamic(type, lPosition, torchWithPlayer->lDirection,
+                                                        LightGrid::lightRadius(torchWithPlayer->lColor,
+                                                                               torchWithPlayer->lPower), spotAngle);
+            lightGrid.addLight(type, lPosition, torchWithPlayer->lDirection, torchWithPlayer->lColor,
+                               torchWithPlayer->lPower * currPowerFactor, shadowTile);
+        }
+
+        lightCandidates.clear();
+        lightBVH.query(ViewPrj, lightCandidates);
+        rankedLights.clear();
+        for (uint32_t id: lightCandidates) {
+            ObjectInstance *obj = lightSources[id];
+            if (obj == torchWithPlayer || (obj->type == SceneObjectType::SO_TORCH && !obj->isOn))
+                continue;
+            glm::vec3 d = obj->lPosition - currPlayerPos;
+            rankedLights.emplace_back(obj->lPower / glm::max(glm::dot(d, d), 1.0f), obj);
+        }
+        size_t activeLights = glm::min(rankedLights.size(), maxActiveLights);
+        std::partial_sort(rankedLights.begin(), rankedLights.begin() + activeLights, rankedLights.end(),
+                          [](const auto &a, const auto &b) { return a.first > b.first; });
+        for (size_t i = 0; i < activeLights; i++) {
+            ObjectInstance *obj = rankedLights[i].second;
+            LightType type = getLightType(obj->lType);
+            // the most important lights get the shadow slots, a light keeps its tiles while it stays in use
+            int shadowTile = shadowAtlas.acquire(obj, type, obj->lPosition, obj->lDirection,
+                                                 LightGrid::lightRadius(obj->lColor, obj->lPower), spotAngle);
+            lightGrid.addLight(type, obj->lPosition, obj->lDirection, obj->lColor,
+                               obj->lPower * (obj->type == SceneObjectType::SO_LIGHT ? 1.0f : currPowerFactor),
+                               shadowTile);
+        }
+        for (auto &light: stressLights)
+            lightGrid.addLight(LIGHT_POINT, light.first, glm::vec3(0.0f, -1.0f, 0.0f), light.second,
+                               STRESS_LIGHT_POWER);
+        // The selected lights are binned into the clusters they reach
+        lightGrid.build(ViewPrj, scene->BP->getExtent());
+        lubo.clusterScale = lightGrid.clusterScale;
+        lubo.NUMBER = lightGrid.lightCount;
+        lubo.GLOBAL = lightGrid.globalCount;
+        lubo.invViewPrj = glm::inverse(ViewPrj);
+
+        // The light set is shared by all the Phong and Toon instances: upload it once
+        DescriptorSet *lightDS = scene->getSharedDS("phong", 0);
+        if (lightDS != nullptr) {
+            lightDS->map(currentImage, &lubo, 0);
+            lightDS->map(currentImage, lightGrid.lights, 1, lightGrid.lightsSize());
+            lightDS->map(currentImage, &lightGrid.grid, 2, lightGrid.gridSize());
+            lightDS->map(currentImage, &shadowAtlas.uniform, 3);
+        }
 
         for (auto &pair: myMap) {
             for (auto &obj: pair.second) {
@@ -1249,12 +1509,14 @@ public:
                     case SceneObjectType::SO_GROUND:
                     case SceneObjectType::SO_TRAPDOOR:
                     case SceneObjectType::SO_WALL:
-                        updateObjectBuffer(currentImage, scene->I[scene->InstanceIds[obj->I_id]], ViewPrj, baseTr,
-                                           {&lubo}, false);
+                        updateObjectBuffer(currentImage, scene->I[scene->InstanceIds[obj->I_id]],
+                                           scene->M[scene->I[scene->InstanceIds[obj->I_id]]->Mid], ViewPrj, baseTr,
+                                           false);
                         break;
                     case SceneObjectType::SO_OTHER:
-                        updateObjectBuffer(currentImage, scene->I[scene->InstanceIds[obj->I_id]], ViewPrj, baseTr,
-                                           {&lubo}, true);
+                        updateObjectBuffer(currentImage, scene->I[scene->InstanceIds[obj->I_id]],
+                                           scene->M[scene->I[scene->InstanceIds[obj->I_id]]->Mid], ViewPrj, baseTr,
+                                           true);
                         break;
                     case SceneObjectType::SO_TORCH:
                         if (obj == torchWithPlayer) {
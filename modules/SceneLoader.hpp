@@ -0,0 +1,548 @@
+/* SCENE DESCRIPTIONS */
+// The content of a scenes/*.json level: the models, textures and instances tables LevelScene::init builds the scene
+// from, with the instance labels already resolved and the transforms already as matrices.
+struct SceneModelDesc {
+    std::string id;
+    std::string model;
+    std::string format;
+    std::string VD;
+};
+
+struct SceneTextureDesc {
+    std::string id;
+    std::string texture;
+    std::string format;
+};
+
+struct SceneInstanceDesc {
+    std::string id;
+    std::string model;
+    std::vector<std::string> textures;
+    SceneObjectType type = SceneObjectType::SO_OTHER;
+    glm::mat4 Wm = glm::mat4(1.0f);
+    std::pair<int, int> coordinates = {0, 0};
+
+    // Torches, lamps and bonfires
+    std::string lType;
+    glm::vec3 lColor = glm::vec3(0.0f);
+    float lPower = 0.0f;
+    glm::vec3 lPosition = glm::vec3(0.0f);
+};
+
+struct ScenePipelineDesc {
+    std::string pipeline;
+    std::vector<SceneInstanceDesc> elements;
+};
+
+struct SceneDescription {
+    std::vector<SceneModelDesc> models;
+    std::vector<SceneTextureDesc> textures;
+    std::vector<ScenePipelineDesc> pipelines;
+};
+
+const std::unordered_map<std::string, SceneObjectType> sceneObjectLabels = {
+        {"PLAYER",   SceneObjectType::SO_PLAYER},
+        {"SPAWN",    SceneObjectType::SO_PLAYER},
+        {"GROUND",   SceneObjectType::SO_GROUND},
+        {"WALL",     SceneObjectType::SO_WALL},
+        {"LIGHT",    SceneObjectType::SO_LIGHT},
+        {"TORCH",    SceneObjectType::SO_TORCH},
+        {"LAMP",     SceneObjectType::SO_LAMP},
+        {"BONFIRE",  SceneObjectType::SO_BONFIRE},
+        {"TRAPDOOR", SceneObjectType::SO_TRAPDOOR},
+        {"OTHER",    SceneObjectType::SO_OTHER}
+};
+
+
+/* SCENE JSON LOADER */
+// SAX handler filling a SceneDescription while the file is parsed, with no JSON document in between. It only tracks
+// the keys on the path to the current value: the section (depth 1), the field of a model, texture or pipeline
+// (depth 3) and the field of an instance (depth 5); everything else is skipped.
+class SceneJSONHandler : public nlohmann::json_sax<nlohmann::json> {
+    enum class Field {
+        NONE, ID, MODEL, TEXTURE, FORMAT, VD, PIPELINE, ELEMENTS,
+        LABEL, TYPE, COLOR, POWER, WHERE, COORDINATES, TRANSFORM
+    };
+
+    SceneDescription &scene;
+    int depth = 0;
+    int index = 0; // in the array of the current instance field
+    Field section = Field::NONE; // MODEL, TEXTURE or PIPELINE
+    Field field = Field::NONE;
+    Field instanceField = Field::NONE;
+
+    static Field fieldOf(const std::string &key) {
+        static const std::unordered_map<std::string, Field> fields = {
+                {"id",          Field::ID},
+                {"model",       Field::MODEL},
+                {"texture",     Field::TEXTURE},
+                {"format",      Field::FORMAT},
+                {"VD",          Field::VD},
+                {"pipeline",    Field::PIPELINE},
+                {"elements",    Field::ELEMENTS},
+                {"label",       Field::LABEL},
+                {"type",        Field::TYPE},
+                {"color",       Field::COLOR},
+                {"power",       Field::POWER},
+                {"where",       Field::WHERE},
+                {"coordinates", Field::COORDINATES},
+                {"transform",   Field::TRANSFORM}
+        };
+        auto f = fields.find(key);
+        return f == fields.end() ? Field::NONE : f->second;
+    }
+
+    bool inInstance() const {
+        return section == Field::PIPELINE && field == Field::ELEMENTS;
+    }
+
+    bool number(double v) {
+        if (depth == 5 && inInstance() && instanceField == Field::POWER) {
+            scene.pipelines.back().elements.back().lPower = (float) v;
+        } else if (depth == 6 && inInstance()) {
+            SceneInstanceDesc &instance = scene.pipelines.back().elements.back();
+            switch (instanceField) {
+                case Field::TRANSFORM:
+                    // Row-major in the file
+                    if (index < 16)
+                        instance.Wm[index % 4][index / 4] = (float) v;
+                    break;
+                case Field::COORDINATES:
+                    if (index == 0)
+                        instance.coordinates.first = (int) v;
+                    else if (index == 1)
+                        instance.coordinates.second = (int) v;
+                    break;
+                case Field::COLOR:
+                    if (index < 3)
+                        instance.lColor[index] = (float) v;
+                    break;
+                case Field::WHERE:
+                    if (index < 3)
+                        instance.lPosition[index] = (float) v;
+                    break;
+                default:
+                    break;
+            }
+        }
+        index++;
+        return true;
+    }
+
+    bool other() {
+        index++;
+        return true;
+    }
+
+public:
+    explicit SceneJSONHandler(SceneDescription &_scene) : scene(_scene) {}
+
+    bool null() override { return other(); }
+
+    bool boolean(bool) override { return other(); }
+
+    bool number_integer(number_integer_t v) override { return number((double) v); }
+
+    bool number_unsigned(number_unsigned_t v) override { return number((double) v); }
+
+    bool number_float(number_float_t v, const string_t &) override { return number(v); }
+
+    bool binary(binary_t &) override { return other(); }
+
+    bool string(string_t &v) override {
+        if (depth == 3) {
+            switch (section) {
+                case Field::MODEL: {
+                    SceneModelDesc &model = scene.models.back();
+                    if (field == Field::ID) model.id = std::move(v);
+                    else if (field == Field::MODEL) model.model = std::move(v);
+                    else if (field == Field::FORMAT) model.format = std::move(v);
+                    else if (field == Field::VD) model.VD = std::move(v);
+                    break;
+                }
+                case Field::TEXTURE: {
+                    SceneTextureDesc &texture = scene.textures.back();
+                    if (field == Field::ID) texture.id = std::move(v);
+                    else if (field == Field::TEXTURE) texture.texture = std::move(v);
+                    else if (field == Field::FORMAT) texture.format = std::move(v);
+                    break;
+                }
+                case Field::PIPELINE:
+                    if (field == Field::PIPELINE)
+                        scene.pipelines.back().pipeline = std::move(v);
+                    break;
+                default:
+                    break;
+            }
+        } else if (depth == 5 && inInstance()) {
+            SceneInstanceDesc &instance = scene.pipelines.back().elements.back();
+            if (instanceField == Field::ID) {
+                instance.id = std::move(v);
+            } else if (instanceField == Field::MODEL) {
+                instance.model = std::move(v);
+            } else if (instanceField == Field::TYPE) {
+                instance.lType = std::move(v);
+            } else if (instanceField == Field::LABEL) {
+                auto label = sceneObjectLabels.find(v);
+                instance.type = label == sceneObjectLabels.end() ? SceneObjectType::SO_OTHER : label->second;
+            }
+        } else if (depth == 6 && inInstance() && instanceField == Field::TEXTURE) {
+            scene.pipelines.back().elements.back().textures.push_back(std::move(v));
+        }
+        index++;
+        return true;
+    }
+
+    bool key(string_t &k) override {
+        if (depth == 1) {
+            section = k == "models" ? Field::MODEL : k == "textures" ? Field::TEXTURE :
+                                                     k == "instances" ? Field::PIPELINE : Field::NONE;
+        } else if (depth == 3) {
+            field = fieldOf(k);
+        } else if (depth == 5) {
+            instanceField = fieldOf(k);
+        }
+        return true;
+    }
+
+    bool start_object(std::size_t) override {
+        depth++;
+        if (depth == 3) {
+            field = Field::NONE;
+            if (section == Field::MODEL) scene.models.emplace_back();
+            else if (section == Field::TEXTURE) scene.textures.emplace_back();
+            else if (section == Field::PIPELINE) scene.pipelines.emplace_back();
+        } else if (depth == 5 && inInstance()) {
+            instanceField = Field::NONE;
+            scene.pipelines.back().elements.emplace_back();
+        }
+        return true;
+    }
+
+    bool end_object() override {
+        depth--;
+        return true;
+    }
+
+    bool start_array(std::size_t) override {
+        depth++;
+        index = 0;
+        return true;
+    }
+
+    bool end_array() override {
+        depth--;
+        return true;
+    }
+
+    bool parse_error(std::size_t, const std::string &, const nlohmann::detail::exception &e) override {
+        throw e;
+    }
+};
+
+SceneDescription parseSceneJSON(const std::string &text) {
+    SceneDescription scene;
+    SceneJSONHandler handler(scene);
+    nlohmann::json::sax_parse(text, &handler);
+    return scene;
+}
+
+SceneDescription loadSceneJSON(const std::string &path) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file.is_open()) {
+        throw std::runtime_error("failed to open file: " + path);
+    }
+    std::string text((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    return parseSceneJSON(text);
+}
+
+
+/* SCENE BINARY */
+// A level compiled by scene-gen from its JSON (scenes/*.scene), read straight out of a memory mapped file. After the
+// header come the model, texture, pipeline and instance tables, the texture references of the instances and the string
+// table; strings are offsets into the string table, which holds them NUL-terminated. Everything is little-endian and
+// 4-byte aligned, and the instances of a pipeline are contiguous.
+#define SCENE_BINARY_MAGIC "MGSC"
+#define SCENE_BINARY_VERSION 1
+
+struct SceneBinaryHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t modelCount;
+    uint32_t textureCount;
+    uint32_t pipelineCount;
+    uint32_t instanceCount;
+    uint32_t textureRefCount;
+    uint32_t stringBytes;
+};
+
+struct SceneBinaryModel {
+    uint32_t id, model, format, VD;
+};
+
+struct SceneBinaryTexture {
+    uint32_t id, texture, format;
+};
+
+struct SceneBinaryPipeline {
+    uint32_t pipeline;
+    uint32_t firstInstance, instanceCount;
+};
+
+struct SceneBinaryInstance {
+    float Wm[4][3]; // the columns of the world matrix without their last row, which is (0, 0, 0, 1)
+    uint32_t id, model;
+    uint32_t firstTexture, textureCount;
+    int32_t coordinates[2];
+    uint32_t type; // SceneObjectType
+    uint32_t lType;
+    float lColor[3];
+    float lPower;
+    float lPosition[3];
+};
+
+static_assert(sizeof(SceneBinaryHeader) == 32 && sizeof(SceneBinaryInstance) == 108, "unexpected padding");
+
+// Read-only mapping of a whole file
+class MappedFile {
+    const unsigned char *bytes = nullptr;
+    size_t length = 0;
+#ifdef _WIN32
+    HANDLE file = INVALID_HANDLE_VALUE;
+    HANDLE mapping = nullptr;
+#else
+    int fd = -1;
+#endif
+
+    void close() {
+#ifdef _WIN32
+        if (bytes) UnmapViewOfFile(bytes);
+        if (mapping) CloseHandle(mapping);
+        if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+        mapping = nullptr;
+        file = INVALID_HANDLE_VALUE;
+#else
+        if (bytes) munmap((void *) bytes, length);
+        if (fd >= 0) ::close(fd);
+        fd = -1;
+#endif
+        bytes = nullptr;
+        length = 0;
+    }
+
+    void fail(const std::string &path) {
+        close();
+        throw std::runtime_error("failed to map file: " + path);
+    }
+
+public:
+    explicit MappedFile(const std::string &path) {
+#ifdef _WIN32
+        file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+                           FILE_ATTRIBUTE_NORMAL, nullptr);
+        LARGE_INTEGER fileSize;
+        if (file == INVALID_HANDLE_VALUE || !GetFileSizeEx(file, &fileSize) || fileSize.QuadPart == 0) fail(path);
+        length = (size_t) fileSize.QuadPart;
+        mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (!mapping) fail(path);
+        bytes = (const unsigned char *) MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+        if (!bytes) fail(path);
+#else
+        fd = open(path.c_str(), O_RDONLY);
+        struct stat st{};
+        if (fd < 0 || fstat(fd, &st) != 0 || st.st_size == 0) fail(path);
+        length = (size_t) st.st_size;
+        void *view = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (view == MAP_FAILED) fail(path);
+        bytes = (const unsigned char *) view;
+#endif
+    }
+
+    MappedFile(const MappedFile &) = delete;
+
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    ~MappedFile() {
+        close();
+    }
+
+    const unsigned char *data() const {
+        return bytes;
+    }
+
+    size_t size() const {
+        return length;
+    }
+};
+
+void saveSceneBinary(const SceneDescription &scene, const std::string &path) {
+    std::vector<SceneBinaryModel> models;
+    std::vector<SceneBinaryTexture> textures;
+    std::vector<SceneBinaryPipeline> pipelines;
+    std::vector<SceneBinaryInstance> instances;
+    std::vector<uint32_t> textureRefs;
+    std::string strings;
+    std::unordered_map<std::string, uint32_t> stringIds;
+    auto str = [&](const std::string &s) {
+        auto [it, inserted] = stringIds.try_emplace(s, (uint32_t) strings.size());
+        if (inserted) {
+            strings += s;
+            strings += '\0';
+        }
+        return it->second;
+    };
+    str("");
+
+    for (const auto &model: scene.models) {
+        models.push_back({str(model.id), str(model.model), str(model.format), str(model.VD)});
+    }
+    for (const auto &texture: scene.textures) {
+        textures.push_back({str(texture.id), str(texture.texture), str(texture.format)});
+    }
+    for (const auto &pipeline: scene.pipelines) {
+        pipelines.push_back({str(pipeline.pipeline), (uint32_t) instances.size(), (uint32_t) pipeline.elements.size()});
+        for (const auto &instance: pipeline.elements) {
+            if (instance.Wm[0][3] != 0.0f || instance.Wm[1][3] != 0.0f || instance.Wm[2][3] != 0.0f ||
+                instance.Wm[3][3] != 1.0f) {
+                throw std::runtime_error(path + ": the transform of " + instance.id + " is not affine");
+            }
+            SceneBinaryInstance record{};
+            for (int c = 0; c < 4; c++) {
+                for (int r = 0; r < 3; r++)
+                    record.Wm[c][r] = instance.Wm[c][r];
+            }
+            record.id = str(instance.id);
+            record.model = str(instance.model);
+            record.firstTexture = (uint32_t) textureRefs.size();
+            record.textureCount = (uint32_t) instance.textures.size();
+            for (const auto &texture: instance.textures)
+                textureRefs.push_back(str(texture));
+            record.coordinates[0] = instance.coordinates.first;
+            record.coordinates[1] = instance.coordinates.second;
+            record.type = (uint32_t) instance.type;
+            record.lType = str(instance.lType);
+            for (int i = 0; i < 3; i++) {
+                record.lColor[i] = instance.lColor[i];
+                record.lPosition[i] = instance.lPosition[i];
+            }
+            record.lPower = instance.lPower;
+            instances.push_back(record);
+        }
+    }
+    strings.resize((strings.size() + 3) & ~size_t(3), '\0');
+
+    SceneBinaryHeader header{};
+    memcpy(header.magic, SCENE_BINARY_MAGIC, 4);
+    header.version = SCENE_BINARY_VERSION;
+    header.modelCount = (uint32_t) models.size();
+    header.textureCount = (uint32_t) textures.size();
+    header.pipelineCount = (uint32_t) pipelines.size();
+    header.instanceCount = (uint32_t) instances.size();
+    header.textureRefCount = (uint32_t) textureRefs.size();
+    header.stringBytes = (uint32_t) strings.size();
+
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+    auto write = [&](const void *data, size_t size) {
+        file.write(reinterpret_cast<const char *>(data), (std::streamsize) size);
+    };
+    write(&header, sizeof(header));
+    write(models.data(), models.size() * sizeof(SceneBinaryModel));
+    write(textures.data(), textures.size() * sizeof(SceneBinaryTexture));
+    write(pipelines.data(), pipelines.size() * sizeof(SceneBinaryPipeline));
+    write(instances.data(), instances.size() * sizeof(SceneBinaryInstance));
+    write(textureRefs.data(), textureRefs.size() * sizeof(uint32_t));
+    write(strings.data(), strings.size());
+    if (!file) {
+        throw std::runtime_error("failed to write file: " + path);
+    }
+}
+
+// Nothing is parsed: the records are read straight from the mapping once their offsets are checked, and copied into
+// the same SceneDescription the JSON loaders fill
+SceneDescription loadSceneBinary(const std::string &path) {
+    MappedFile file(path);
+    const unsigned char *bytes = file.data();
+    SceneBinaryHeader header{};
+    if (file.size() >= sizeof(header))
+        memcpy(&header, bytes, sizeof(header));
+    if (memcmp(header.magic, SCENE_BINARY_MAGIC, 4) != 0 || header.version != SCENE_BINARY_VERSION) {
+        throw std::runtime_error(path + ": not a compiled scene");
+    }
+    uint64_t size = sizeof(header) + (uint64_t) header.modelCount * sizeof(SceneBinaryModel) +
+                    (uint64_t) header.textureCount * sizeof(SceneBinaryTexture) +
+                    (uint64_t) header.pipelineCount * sizeof(SceneBinaryPipeline) +
+                    (uint64_t) header.instanceCount * sizeof(SceneBinaryInstance) +
+                    (uint64_t) header.textureRefCount * sizeof(uint32_t) + header.stringBytes;
+    if (size != file.size() || header.stringBytes == 0 || bytes[size - 1] != '\0') {
+        throw std::runtime_error(path + ": invalid compiled scene");
+    }
+
+    const auto *models = reinterpret_cast<const SceneBinaryModel *>(bytes + sizeof(header));
+    const auto *textures = reinterpret_cast<const SceneBinaryTexture *>(models + header.modelCount);
+    const auto *pipelines = reinterpret_cast<const SceneBinaryPipeline *>(textures + header.textureCount);
+    const auto *instances = reinterpret_cast<const SceneBinaryInstance *>(pipelines + header.pipelineCount);
+    const auto *textureRefs = reinterpret_cast<const uint32_t *>(instances + header.instanceCount);
+    const auto *strings = reinterpret_cast<const char *>(textureRefs + header.textureRefCount);
+    auto str = [&](uint32_t offset) {
+        if (offset >= header.stringBytes) {
+            throw std::runtime_error(path + ": invalid compiled scene");
+        }
+        return std::string(strings + offset);
+    };
+
+    SceneDescription scene;
+    scene.models.reserve(header.modelCount);
+    for (uint32_t k = 0; k < header.modelCount; k++) {
+        const SceneBinaryModel &m = models[k];
+        scene.models.push_back({str(m.id), str(m.model), str(m.format), str(m.VD)});
+    }
+    scene.textures.reserve(header.textureCount);
+    for (uint32_t k = 0; k < header.textureCount; k++) {
+        const SceneBinaryTexture &t = textures[k];
+        scene.textures.push_back({str(t.id), str(t.texture), str(t.format)});
+    }
+    scene.pipelines.resize(header.pipelineCount);
+    for (uint32_t k = 0; k < header.pipelineCount; k++) {
+        const SceneBinaryPipeline &p = pipelines[k];
+        if ((uint64_t) p.firstInstance + p.instanceCount > header.instanceCount) {
+            throw std::runtime_error(path + ": invalid compiled scene");
+        }
+        ScenePipelineDesc &pipeline = scene.pipelines[k];
+        pipeline.pipeline = str(p.pipeline);
+        pipeline.elements.resize(p.instanceCount);
+        for (uint32_t j = 0; j < p.instanceCount; j++) {
+            const SceneBinaryInstance &i = instances[p.firstInstance + j];
+            if ((uint64_t) i.firstTexture + i.textureCount > header.textureRefCount ||
+                i.type > (uint32_t) SceneObjectType::SO_OTHER) {
+                throw std::runtime_error(path + ": invalid compiled scene");
+            }
+            SceneInstanceDesc &instance = pipeline.elements[j];
+            instance.id = str(i.id);
+            instance.model = str(i.model);
+            instance.textures.reserve(i.textureCount);
+            for (uint32_t t = 0; t < i.textureCount; t++)
+                instance.textures.push_back(str(textureRefs[i.firstTexture + t]));
+            instance.type = (SceneObjectType) i.type;
+            instance.Wm = glm::mat4(glm::vec4(i.Wm[0][0], i.Wm[0][1], i.Wm[0][2], 0.0f),
+                                    glm::vec4(i.Wm[1][0], i.Wm[1][1], i.Wm[1][2], 0.0f),
+                                    glm::vec4(i.Wm[2][0], i.Wm[2][1], i.Wm[2][2], 0.0f),
+                                    glm::vec4(i.Wm[3][0], i.Wm[3][1], i.Wm[3][2], 1.0f));
+            instance.coordinates = {i.coordinates[0], i.coordinates[1]};
+            instance.lType = str(i.lType);
+            instance.lColor = glm::vec3(i.lColor[0], i.lColor[1], i.lColor[2]);
+            instance.lPower = i.lPower;
+            instance.lPosition = glm::vec3(i.lPosition[0], i.lPosition[1], i.lPosition[2]);
+        }
+    }
+    return scene;
+}
+
+// The compiled scene next to a JSON scene, if it is there and not older than the JSON
+std::string compiledScenePath(const std::string &jsonPath) {
+    std::filesystem::path compiled = std::filesystem::path(jsonPath).replace_extension(".scene");
+    std::error_code error;
+    auto compiledTime = std::filesystem::last_write_time(compiled, error);
+    if (error) return "";
+    auto jsonTime = std::filesystem::last_write_time(jsonPath, error);
+    return !error && compiledTime >= jsonTime ? compiled.string() : "";
+}
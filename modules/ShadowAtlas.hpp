@@ -0,0 +1,530 @@
+/* SHADOW ATLAS */
+// A single depth texture split in square tiles, grouped in slots of six: a point light renders one tile per cube
+// face, a spot light only the first tile of its slot. The shadow casters are static, so the tiles of a light are
+// rendered once when the slot is assigned and kept until another light takes it; only the dynamic slot, used by the
+// torch carried by the player, is rendered every frame. Each tile draws only the casters inside its frustum.
+// Keep the constants in sync with Phong.frag and Toon.frag.
+#define SHADOW_ATLAS_SIZE 4096
+#define SHADOW_TILE_SIZE 512
+#define SHADOW_TILES_PER_ROW (SHADOW_ATLAS_SIZE / SHADOW_TILE_SIZE)
+#define SHADOW_TILES (SHADOW_TILES_PER_ROW * SHADOW_TILES_PER_ROW)
+#define SHADOW_SLOT_TILES 6
+#define SHADOW_SLOTS (SHADOW_TILES / SHADOW_SLOT_TILES)
+#define SHADOW_DYNAMIC_SLOT (SHADOW_SLOTS - 1)
+#define SHADOW_NEAR 0.05f
+
+struct ShadowUniform {
+    alignas(16) glm::mat4 tileVP[SHADOW_TILES];
+};
+
+struct ShadowPushConstant {
+    alignas(16) glm::mat4 mMat;
+    alignas(4) uint32_t tile;
+};
+
+struct ShadowCaster {
+    Model *M;
+    glm::mat4 Wm;
+    glm::vec3 center;
+    float radius;
+};
+
+class ShadowAtlas {
+    struct Slot {
+        const void *key = nullptr;
+        LightType type = LIGHT_POINT;
+        glm::vec3 lightPos;
+        float radius;
+        uint32_t lastUsed = 0;
+        bool dirty = false;
+        // Tiles holding only the clear value, that need no work while no caster enters them
+        uint32_t emptyTiles = 0;
+    };
+
+    BaseProject *BP{};
+    VertexDescriptor *VD{};
+    VkFormat format{};
+    VkImage image{};
+    VkDeviceMemory imageMemory{};
+    VkRenderPass renderPass{};
+    VkFramebuffer framebuffer{};
+    VkShaderModule vertShaderModule{};
+    VkPipelineLayout pipelineLayout{};
+    VkPipeline pipeline{};
+
+    Slot slots[SHADOW_SLOTS];
+    uint32_t frame = 0;
+    std::vector<const ShadowCaster *> slotCasters;
+
+    void createAtlas() {
+        format = BP->findSupportedFormat({VK_FORMAT_D32_SFLOAT, VK_FORMAT_D16_UNORM}, VK_IMAGE_TILING_OPTIMAL,
+                                         VK_FORMAT_FEATURE_DEPTH_STENCIL_ATTACHMENT_BIT |
+                                         VK_FORMAT_FEATURE_SAMPLED_IMAGE_BIT |
+                                         VK_FORMAT_FEATURE_SAMPLED_IMAGE_FILTER_LINEAR_BIT);
+
+        BP->createImage(SHADOW_ATLAS_SIZE, SHADOW_ATLAS_SIZE, 1, 1, VK_SAMPLE_COUNT_1_BIT, format,
+                        VK_IMAGE_TILING_OPTIMAL,
+                        VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT | VK_IMAGE_USAGE_SAMPLED_BIT, 0,
+                        VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, image, imageMemory);
+        texture.BP = BP;
+        texture.mipLevels = 1;
+        texture.imgs = 1;
+        texture.textureImage = image;
+        texture.textureImageMemory = imageMemory;
+        texture.textureImageView = BP->createImageView(image, format, VK_IMAGE_ASPECT_DEPTH_BIT, 1,
+                                                       VK_IMAGE_VIEW_TYPE_2D, 1);
+
+        // Between the shadow passes the atlas always stays in the layout read by the fragment shaders
+        VkCommandBuffer commandBuffer = BP->beginSingleTimeCommands();
+        VkImageMemoryBarrier barrier{};
+        barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+        barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+        barrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+        barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        barrier.image = image;
+        barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_DEPTH_BIT;
+        barrier.subresourceRange.baseMipLevel = 0;
+        barrier.subresourceRange.levelCount = 1;
+        barrier.subresourceRange.baseArrayLayer = 0;
+        barrier.subresourceRange.layerCount = 1;
+        barrier.srcAccessMask = 0;
+        barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+        vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+                             VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0, 0, nullptr, 0, nullptr, 1, &barrier);
+        BP->endSingleTimeCommands(commandBuffer);
+
+        // Hardware 2x2 PCF: the comparison is done by the sampler
+        VkSamplerCreateInfo samplerInfo{};
+        samplerInfo.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
+        samplerInfo.magFilter = VK_FILTER_LINEAR;
+        samplerInfo.minFilter = VK_FILTER_LINEAR;
+        samplerInfo.addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+        samplerInfo.addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+        samplerInfo.addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+        samplerInfo.anisotropyEnable = VK_FALSE;
+        samplerInfo.maxAnisotropy = 1.0f;
+        samplerInfo.borderColor = VK_BORDER_COLOR_FLOAT_OPAQUE_WHITE;
+        samplerInfo.unnormalizedCoordinates = VK_FALSE;
+        samplerInfo.compareEnable = VK_TRUE;
+        samplerInfo.compareOp = VK_COMPARE_OP_LESS_OR_EQUAL;
+        samplerInfo.mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST;
+        samplerInfo.mipLodBias = 0.0f;
+        samplerInfo.minLod = 0.0f;
+        samplerInfo.maxLod = 0.0f;
+
+        texture.textureSampler = BP->getSampler(samplerInfo);
+    }
+
+    void createRenderPass() {
+        VkAttachmentDescription depthAttachment{};
+        depthAttachment.format = format;
+        depthAttachment.samples = VK_SAMPLE_COUNT_1_BIT;
+        depthAttachment.loadOp = VK_ATTACHMENT_LOAD_OP_LOAD;
+        depthAttachment.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
+        depthAttachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+        depthAttachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+        depthAttachment.initialLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+        depthAttachment.finalLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+
+        VkAttachmentReference depthAttachmentRef{};
+        depthAttachmentRef.attachment = 0;
+        depthAttachmentRef.layout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+
+        VkSubpassDescription subpass{};
+        subpass.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
+        subpass.colorAttachmentCount = 0;
+        subpass.pDepthStencilAttachment = &depthAttachmentRef;
+
+        // Tiles are written only after the previous frames stopped sampling them, and sampled after being written
+        std::array<VkSubpassDependency, 2> dependencies{};
+        dependencies[0].srcSubpass = VK_SUBPASS_EXTERNAL;
+        dependencies[0].dstSubpass = 0;
+        dependencies[0].srcStageMask = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
+        dependencies[0].srcAccessMask = VK_ACCESS_SHADER_READ_BIT;
+        dependencies[0].dstStageMask = VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT |
+                                       VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT;
+        dependencies[0].dstAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT |
+                                        VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+        dependencies[1].srcSubpass = 0;
+        dependencies[1].dstSubpass = VK_SUBPASS_EXTERNAL;
+        dependencies[1].srcStageMask = VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT |
+                                       VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT;
+        dependencies[1].srcAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+        dependencies[1].dstStageMask = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
+        dependencies[1].dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+
+        VkRenderPassCreateInfo renderPassInfo{};
+        renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
+        renderPassInfo.attachmentCount = 1;
+        renderPassInfo.pAttachments = &depthAttachment;
+        renderPassInfo.subpassCount = 1;
+        renderPassInfo.pSubpasses = &subpass;
+        renderPassInfo.dependencyCount = static_cast<uint32_t>(dependencies.size());
+        renderPassInfo.pDependencies = dependencies.data();
+
+        VkResult result = vkCreateRenderPass(BP->device, &renderPassInfo, nullptr, &renderPass);
+        if (result != VK_SUCCESS) {
+            PrintVkError(result);
+            throw std::runtime_error("failed to create shadow render pass!");
+        }
+
+        VkFramebufferCreateInfo framebufferInfo{};
+        framebufferInfo.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
+        framebufferInfo.renderPass = renderPass;
+        framebufferInfo.attachmentCount = 1;
+        framebufferInfo.pAttachments = &texture.textureImageView;
+        framebufferInfo.width = SHADOW_ATLAS_SIZE;
+        framebufferInfo.height = SHADOW_ATLAS_SIZE;
+        framebufferInfo.layers = 1;
+
+        result = vkCreateFramebuffer(BP->device, &framebufferInfo, nullptr, &framebuffer);
+        if (result != VK_SUCCESS) {
+            PrintVkError(result);
+            throw std::runtime_error("failed to create shadow framebuffer!");
+        }
+    }
+
+    // Depth only: the vertex shader reads the tile matrix from the light set and the model matrix from push constants
+    void createPipeline(DescriptorSetLayout *LightDSL) {
+        auto vertShaderCode = readFile("shaders/Shadow.vert.spv");
+        std::cout << "Vertex shader <shaders/Shadow.vert.spv> len: " << vertShaderCode.size() << "\n";
+
+        VkShaderModuleCreateInfo createInfo{};
+        createInfo.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
+        createInfo.codeSize = vertShaderCode.size();
+        createInfo.pCode = reinterpret_cast<const uint32_t *>(vertShaderCode.data());
+
+        VkResult result = vkCreateShaderModule(BP->device, &createInfo, nullptr, &vertShaderModule);
+        if (result != VK_SUCCESS) {
+            PrintVkError(result);
+            throw std::runtime_error("failed to create shader module!");
+        }
+
+        VkPipelineShaderStageCreateInfo vertShaderStageInfo{};
+        vertShaderStageInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+        vertShaderStageInfo.stage = VK_SHADER_STAGE_VERTEX_BIT;
+        vertShaderStageInfo.module = vertShaderModule;
+        vertShaderStageInfo.pName = "main";
+
+        // Only the position of the vertex format of the casters is read: quantized positions come in normalized and
+        // are scaled back by the dequantization folded into the model matrix
+        if (VD->Position.format != VK_FORMAT_R32G32B32_SFLOAT &&
+            VD->Position.format != VK_FORMAT_R16G16B16A16_SNORM) {
+            throw std::runtime_error("unsupported shadow caster position format!");
+        }
+        auto bindingDescription = VD->getBindingDescription();
+        VkVertexInputAttributeDescription positionAttribute{};
+        positionAttribute.binding = 0;
+        positionAttribute.location = 0;
+        positionAttribute.format = VD->Position.format;
+        positionAttribute.offset = VD->Position.offset;
+
+        VkPipelineVertexInputStateCreateInfo vertexInputInfo{};
+        vertexInputInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
+        vertexInputInfo.vertexBindingDescriptionCount = static_cast<uint32_t>(bindingDescription.size());
+        vertexInputInfo.pVertexBindingDescriptions = bindingDescription.data();
+        vertexInputInfo.vertexAttributeDescriptionCount = 1;
+        vertexInputInfo.pVertexAttributeDescriptions = &positionAttribute;
+
+        VkPipelineInputAssemblyStateCreateInfo inputAssembly{};
+        inputAssembly.sType = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO;
+        inputAssembly.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
+        inputAssembly.primitiveRestartEnable = VK_FALSE;
+
+        // Viewport and scissor select the tile
+        VkPipelineViewportStateCreateInfo viewportState{};
+        viewportState.sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
+        viewportState.viewportCount = 1;
+        viewportState.scissorCount = 1;
+
+        std::array<VkDynamicState, 2> dynamicStates = {VK_DYNAMIC_STATE_VIEWPORT, VK_DYNAMIC_STATE_SCISSOR};
+        VkPipelineDynamicStateCreateInfo dynamicState{};
+        dynamicState.sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO;
+        dynamicState.dynamicStateCount = static_cast<uint32_t>(dynamicStates.size());
+        dynamicState.pDynamicStates = dynamicStates.data();
+
+        // Walls and floors are single sided: render both faces, and push the depth back against acne
+        VkPipelineRasterizationStateCreateInfo rasterizer{};
+        rasterizer.sType = VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO;
+        rasterizer.depthClampEnable = VK_FALSE;
+        rasterizer.rasterizerDiscardEnable = VK_FALSE;
+        rasterizer.polygonMode = VK_POLYGON_MODE_FILL;
+        rasterizer.lineWidth = 1.0f;
+        rasterizer.cullMode = VK_CULL_MODE_NONE;
+        rasterizer.frontFace = VK_FRONT_FACE_COUNTER_CLOCKWISE;
+        rasterizer.depthBiasEnable = VK_TRUE;
+        rasterizer.depthBiasConstantFactor = 1.25f;
+        rasterizer.depthBiasClamp = 0.0f;
+        rasterizer.depthBiasSlopeFactor = 1.75f;
+
+        VkPipelineMultisampleStateCreateInfo multisampling{};
+        multisampling.sType = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO;
+        multisampling.sampleShadingEnable = VK_FALSE;
+        multisampling.rasterizationSamples = VK_SAMPLE_COUNT_1_BIT;
+
+        VkPipelineDepthStencilStateCreateInfo depthStencil{};
+        depthStencil.sType = VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO;
+        depthStencil.depthTestEnable = VK_TRUE;
+        depthStencil.depthWriteEnable = VK_TRUE;
+        depthStencil.depthCompareOp = VK_COMPARE_OP_LESS;
+        depthStencil.depthBoundsTestEnable = VK_FALSE;
+        depthStencil.stencilTestEnable = VK_FALSE;
+
+        VkPipelineColorBlendStateCreateInfo colorBlending{};
+        colorBlending.sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO;
+        colorBlending.logicOpEnable = VK_FALSE;
+        colorBlending.attachmentCount = 0;
+
+        VkPushConstantRange pushConstantRange{};
+        pushConstantRange.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
+        pushConstantRange.offset = 0;
+        pushConstantRange.size = sizeof(ShadowPushConstant);
+
+        VkPipelineLayoutCreateInfo pipelineLayoutInfo{};
+        pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+        pipelineLayoutInfo.setLayoutCount = 1;
+        pipelineLayoutInfo.pSetLayouts = &LightDSL->descriptorSetLayout;
+        pipelineLayoutInfo.pushConstantRangeCount = 1;
+        pipelineLayoutInfo.pPushConstantRanges = &pushConstantRange;
+
+        result = vkCreatePipelineLayout(BP->device, &pipelineLayoutInfo, nullptr, &pipelineLayout);
+        if (result != VK_SUCCESS) {
+            PrintVkError(result);
+            throw std::runtime_error("failed to create shadow pipeline layout!");
+        }
+
+        VkGraphicsPipelineCreateInfo pipelineInfo{};
+        pipelineInfo.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
+        pipelineInfo.stageCount = 1;
+        pipelineInfo.pStages = &vertShaderStageInfo;
+        pipelineInfo.pVertexInputState = &vertexInputInfo;
+        pipelineInfo.pInputAssemblyState = &inputAssembly;
+        pipelineInfo.pViewportState = &viewportState;
+        pipelineInfo.pRasterizationState = &rasterizer;
+        pipelineInfo.pMultisampleState = &multisampling;
+        pipelineInfo.pDepthStencilState = &depthStencil;
+        pipelineInfo.pColorBlendState = &colorBlending;
+        pipelineInfo.pDynamicState = &dynamicState;
+        pipelineInfo.layout = pipelineLayout;
+        pipelineInfo.renderPass = renderPass;
+        pipelineInfo.subpass = 0;
+        pipelineInfo.basePipelineHandle = VK_NULL_HANDLE;
+        pipelineInfo.basePipelineIndex = -1;
+
+        result = vkCreateGraphicsPipelines(BP->device, VK_NULL_HANDLE, 1, &pipelineInfo, nullptr, &pipeline);
+        if (result != VK_SUCCESS) {
+            PrintVkError(result);
+            throw std::runtime_error("failed to create shadow pipeline!");
+        }
+    }
+
+    void setSlotMatrices(int slot, LightType type, glm::vec3 lightPos, glm::vec3 lightDir, float radius,
+                         float spotAngle) {
+        int first = slot * SHADOW_SLOT_TILES;
+        if (type == LIGHT_SPOT) {
+            glm::vec3 up = glm::abs(lightDir.y) > 0.99f ? glm::vec3(0, 0, 1) : glm::vec3(0, 1, 0);
+            uniform.tileVP[first] = glm::perspective(spotAngle, 1.0f, SHADOW_NEAR, radius) *
+                                    glm::lookAt(lightPos, lightPos + lightDir, up);
+            return;
+        }
+
+        // Cube faces in the order +X, -X, +Y, -Y, +Z, -Z, selected in the shaders by the major axis
+        static const glm::vec3 faceDir[6] = {{1, 0, 0}, {-1, 0, 0}, {0, 1, 0}, {0, -1, 0}, {0, 0, 1}, {0, 0, -1}};
+        static const glm::vec3 faceUp[6] = {{0, 1, 0}, {0, 1, 0}, {0, 0, 1}, {0, 0, -1}, {0, 1, 0}, {0, 1, 0}};
+        glm::mat4 Prj = glm::perspective(glm::radians(90.0f), 1.0f, SHADOW_NEAR, radius);
+        for (int f = 0; f < 6; f++)
+            uniform.tileVP[first + f] = Prj * glm::lookAt(lightPos, lightPos + faceDir[f], faceUp[f]);
+    }
+
+    // Side and far planes of the frustum of a tile, pointing inwards
+    static void tilePlanes(const glm::mat4 &VP, glm::vec4 planes[5]) {
+        glm::vec4 r[4];
+        for (int i = 0; i < 4; i++)
+            r[i] = glm::vec4(VP[0][i], VP[1][i], VP[2][i], VP[3][i]);
+        planes[0] = r[3] + r[0];
+        planes[1] = r[3] - r[0];
+        planes[2] = r[3] + r[1];
+        planes[3] = r[3] - r[1];
+        planes[4] = r[3] - r[2];
+    }
+
+    static bool inTile(const glm::vec4 planes[5], const ShadowCaster &caster) {
+        for (int p = 0; p < 5; p++) {
+            if (glm::dot(glm::vec3(planes[p]), caster.center) + planes[p].w <
+                -caster.radius * glm::length(glm::vec3(planes[p])))
+                return false;
+        }
+        return true;
+    }
+
+    void recordSlot(VkCommandBuffer commandBuffer, int slot) {
+        Slot &S = slots[slot];
+        slotCasters.clear();
+        for (auto &caster: casters) {
+            if (glm::distance(caster.center, S.lightPos) <= caster.radius + S.radius)
+                slotCasters.push_back(&caster);
+        }
+
+        int first = slot * SHADOW_SLOT_TILES;
+        int count = S.type == LIGHT_SPOT ? 1 : SHADOW_SLOT_TILES;
+        for (int t = first; t < first + count; t++) {
+            glm::vec4 planes[5];
+            tilePlanes(uniform.tileVP[t], planes);
+            bool empty = std::none_of(slotCasters.begin(), slotCasters.end(),
+                                      [&planes](const ShadowCaster *caster) { return inTile(planes, *caster); });
+            uint32_t bit = 1u << (t - first);
+            if (empty && (S.emptyTiles & bit))
+                continue;
+
+            VkViewport viewport{};
+            viewport.x = (float) ((t % SHADOW_TILES_PER_ROW) * SHADOW_TILE_SIZE);
+            viewport.y = (float) ((t / SHADOW_TILES_PER_ROW) * SHADOW_TILE_SIZE);
+            viewport.width = (float) SHADOW_TILE_SIZE;
+            viewport.height = (float) SHADOW_TILE_SIZE;
+            viewport.minDepth = 0.0f;
+            viewport.maxDepth = 1.0f;
+            VkRect2D scissor{};
+            scissor.offset = {(int32_t) viewport.x, (int32_t) viewport.y};
+            scissor.extent = {SHADOW_TILE_SIZE, SHADOW_TILE_SIZE};
+            vkCmdSetViewport(commandBuffer, 0, 1, &viewport);
+            vkCmdSetScissor(commandBuffer, 0, 1, &scissor);
+
+            VkClearAttachment clearAttachment{};
+            clearAttachment.aspectMask = VK_IMAGE_ASPECT_DEPTH_BIT;
+            clearAttachment.clearValue.depthStencil = {1.0f, 0};
+            VkClearRect clearRect{};
+            clearRect.rect = scissor;
+            clearRect.baseArrayLayer = 0;
+            clearRect.layerCount = 1;
+            vkCmdClearAttachments(commandBuffer, 1, &clearAttachment, 1, &clearRect);
+
+            S.emptyTiles = empty ? S.emptyTiles | bit : S.emptyTiles & ~bit;
+            if (empty)
+                continue;
+            for (const ShadowCaster *caster: slotCasters) {
+                if (!inTile(planes, *caster))
+                    continue;
+                ShadowPushConstant pc{};
+                pc.mMat = caster->Wm * caster->M->Dq;
+                pc.tile = t;
+                vkCmdPushConstants(commandBuffer, pipelineLayout, VK_SHADER_STAGE_VERTEX_BIT, 0,
+                                   sizeof(ShadowPushConstant), &pc);
+                caster->M->bind(commandBuffer);
+                vkCmdDrawIndexed(commandBuffer, static_cast<uint32_t>(caster->M->indices.size()), 1, 0, 0, 0);
+            }
+        }
+    }
+
+    void beginRenderPass(VkCommandBuffer commandBuffer, DescriptorSet *lightDS, int currentImage) const {
+        VkRenderPassBeginInfo renderPassInfo{};
+        renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
+        renderPassInfo.renderPass = renderPass;
+        renderPassInfo.framebuffer = framebuffer;
+        renderPassInfo.renderArea.offset = {0, 0};
+        renderPassInfo.renderArea.extent = {SHADOW_ATLAS_SIZE, SHADOW_ATLAS_SIZE};
+        renderPassInfo.clearValueCount = 0;
+        vkCmdBeginRenderPass(commandBuffer, &renderPassInfo, VK_SUBPASS_CONTENTS_INLINE);
+
+        vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline);
+        vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelineLayout, 0, 1,
+                                &lightDS->descriptorSets[currentImage], 0, nullptr);
+    }
+
+public:
+    // Image view and comparison sampler of the atlas, bound by the light descriptor set
+    Texture texture{};
+    ShadowUniform uniform{};
+    std::vector<ShadowCaster> casters;
+
+    void init(BaseProject *bp, VertexDescriptor *vd, DescriptorSetLayout *LightDSL) {
+        BP = bp;
+        VD = vd;
+        createAtlas();
+        createRenderPass();
+        createPipeline(LightDSL);
+    }
+
+    void addCaster(Model *M, glm::mat4 Wm) {
+        // Bounding sphere of the model in world space, to render into a tile only what the light can reach
+        glm::vec3 bmin(std::numeric_limits<float>::max()), bmax(-std::numeric_limits<float>::max());
+        for (size_t v = 0; v < M->vertices.size() / VD->Bindings[0].stride; v++) {
+            glm::vec3 pos = M->getPosition(v);
+            bmin = glm::min(bmin, pos);
+            bmax = glm::max(bmax, pos);
+        }
+        if (bmin.x > bmax.x)
+            return;
+        float scale = glm::max(glm::length(glm::vec3(Wm[0])),
+                               glm::max(glm::length(glm::vec3(Wm[1])), glm::length(glm::vec3(Wm[2]))));
+        casters.push_back({M, Wm, glm::vec3(Wm * glm::vec4((bmin + bmax) * 0.5f, 1.0f)),
+                           glm::length(bmax - bmin) * 0.5f * scale});
+    }
+
+    void beginFrame() {
+        frame++;
+        slots[SHADOW_DYNAMIC_SLOT].dirty = false;
+    }
+
+    // Returns the first tile of the slot of a static light, assigning the least recently used one if needed,
+    // or -1 if all the slots are taken by more important lights in this frame.
+    int acquire(const void *key, LightType type, glm::vec3 lightPos, glm::vec3 lightDir, float radius,
+                float spotAngle) {
+        int lru = -1;
+        for (int s = 0; s < SHADOW_DYNAMIC_SLOT; s++) {
+            if (slots[s].key == key) {
+                slots[s].lastUsed = frame;
+                return s * SHADOW_SLOT_TILES;
+            }
+            // Free slots have lastUsed == 0 and are taken first
+            if (slots[s].lastUsed != frame && (lru < 0 || slots[s].lastUsed < slots[lru].lastUsed))
+                lru = s;
+        }
+        if (lru < 0)
+            return -1;
+
+        slots[lru] = {key, type, lightPos, radius, frame, true};
+        setSlotMatrices(lru, type, lightPos, lightDir, radius, spotAngle);
+        return lru * SHADOW_SLOT_TILES;
+    }
+
+    // The dynamic slot follows the carried torch: it is rendered again in every frame that acquires it
+    int acquireDynamic(LightType type, glm::vec3 lightPos, glm::vec3 lightDir, float radius, float spotAngle) {
+        Slot &S = slots[SHADOW_DYNAMIC_SLOT];
+        S.type = type;
+        S.lightPos = lightPos;
+        S.radius = radius;
+        S.lastUsed = frame;
+        S.dirty = true;
+        setSlotMatrices(SHADOW_DYNAMIC_SLOT, type, lightPos, lightDir, radius, spotAngle);
+        return SHADOW_DYNAMIC_SLOT * SHADOW_SLOT_TILES;
+    }
+
+    // Records the slots acquired in this frame into its one-time command buffer. The tile matrices must already be
+    // in the light set of the frame.
+    void populateFrameCommandBuffer(VkCommandBuffer commandBuffer, DescriptorSet *lightDS, int currentImage) {
+        bool dirty = false;
+        for (auto &slot: slots)
+            dirty = dirty || slot.dirty;
+        if (!dirty || lightDS == nullptr)
+            return;
+
+        beginRenderPass(commandBuffer, lightDS, currentImage);
+        for (int s = 0; s < SHADOW_SLOTS; s++) {
+            if (slots[s].dirty) {
+                recordSlot(commandBuffer, s);
+                slots[s].dirty = false;
+            }
+        }
+        vkCmdEndRenderPass(commandBuffer);
+    }
+
+    void localCleanup() const {
+        vkDestroyPipeline(BP->device, pipeline, nullptr);
+        vkDestroyPipelineLayout(BP->device, pipelineLayout, nullptr);
+        vkDestroyShaderModule(BP->device, vertShaderModule, nullptr);
+        vkDestroyFramebuffer(BP->device, framebuffer, nullptr);
+        vkDestroyRenderPass(BP->device, renderPass, nullptr);
+        texture.cleanup();
+    }
+};
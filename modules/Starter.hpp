@@ -7,11 +7,41 @@
 #include <cstring>
 #include <optional>
 #include <set>
+#include <map>
+#include <unordered_map>
 #include <cstdint>
 #include <algorithm>
 #include <fstream>
 #include <array>
+#include <tuple>
 #include <cmath>
+#include <limits>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <exception>
+#include <memory>
+#include <future>
+#include <filesystem>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+
+#include <windows.h>
+
+#else
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#endif
 
 #define GLM_FORCE_RADIANS
 #define GLM_FORCE_DEFAULT_ALIGNED_GENTYPES
@@ -48,6 +78,8 @@
 
 #include "sinfl.h"
 
+#include "MGCG.hpp"
+
 
 // For compile compatibility issues. (Already present in <math.h>)
 
@@ -68,6 +100,59 @@
 
 const int MAX_FRAMES_IN_FLIGHT = 2;
 
+// G-buffer of the deferred path: albedo + material id, normal, depth.
+const int GBUFFER_COLOR_ATTACHMENTS = 2;
+const int GBUFFER_ATTACHMENTS = GBUFFER_COLOR_ATTACHMENTS + 1;
+
+// Anti-aliasing tiers. MSAA resolves in the main pass and shades once per pixel; FXAA is a post pass over the
+// single-sampled image.
+enum AntiAliasing {
+    AA_OFF,
+    AA_MSAA_2,
+    AA_MSAA_4,
+    AA_MSAA_8,
+    AA_FXAA,
+    AA_COUNT
+};
+
+const char *const antiAliasingNames[AA_COUNT] = {"off", "msaa2", "msaa4", "msaa8", "fxaa"};
+
+// Seconds between two frame time reports.
+const float FRAME_STATS_PERIOD = 2.0f;
+
+// GPU timestamps written by the command buffer of each swap chain image: start, end of the scene passes, end of the
+// post pass.
+const uint32_t GPU_TIMESTAMPS = 3;
+
+// Texture streaming: the mip chain is built by a worker thread and uploaded coarsest level first, at most
+// TEXTURE_STREAM_BUDGET bytes per frame. Once the levels up to TEXTURE_STREAM_TAIL texels are resident they are
+// magnified into the larger ones, until those arrive too.
+const int TEXTURE_STREAM_TAIL = 128;
+const VkDeviceSize TEXTURE_STREAM_BUDGET = 2 * 1024 * 1024;
+
+// Mip chain generation: one blit per level, or a single compute dispatch (shaders/Mipmap.comp) that also works for
+// formats without linear blit support. Blits are the default: on a software device they loaded the 1024x1024 dungeon
+// atlas in ~53 ms against ~770 ms for the compute pass, and the other textures 8 to 16 times faster.
+enum MipmapGenerator {
+    MIPMAP_BLIT,
+    MIPMAP_COMPUTE,
+    MIPMAP_COUNT
+};
+
+const char *const mipmapGeneratorNames[MIPMAP_COUNT] = {"blit", "compute"};
+
+// Level 0 texels reduced by one workgroup of Mipmap.comp, keep in sync with the shader.
+const int MIPMAP_TILE = 32;
+
+struct MipmapPushConstant {
+    uint32_t width;
+    uint32_t height;
+    uint32_t levels;
+    uint32_t layers;
+    uint32_t srgb;
+    uint32_t counterOffset;
+};
+
 const std::vector<const char *> validationLayers = {
         "VK_LAYER_KHRONOS_validation"
 };
@@ -205,6 +290,7 @@ struct VertexDescriptorElement {
 struct VertexComponent {
     bool hasIt;
     uint32_t offset;
+    VkFormat format;
 };
 
 class BaseProject;
@@ -235,6 +321,14 @@ enum ModelType {
     OBJ, GLTF, MGCG
 };
 
+// Range of Model::indices drawn with one material (the glTF material index, -1 if none). The scenes draw it with the
+// texture of the instance at that index, the first one if the instance has fewer.
+struct SubMesh {
+    uint32_t firstIndex;
+    uint32_t indexCount;
+    int material;
+};
+
 class Model {
     BaseProject *BP;
 
@@ -244,10 +338,28 @@ class Model {
     VkDeviceMemory indexBufferMemory;
     VertexDescriptor *VD;
 
+    void setPositionBounds(glm::vec3 bmin, glm::vec3 bmax);
+
+    void writePosition(unsigned char *vertex, glm::vec3 pos) const;
+
+    void writeNormal(unsigned char *vertex, glm::vec3 norm) const;
+
+    void writeUV(unsigned char *vertex, glm::vec2 texCoord) const;
+
 public:
     glm::mat4 Wm;
+    // Maps the quantized positions of a compressed vertex format back to model space (identity otherwise)
+    glm::mat4 Dq = glm::mat4(1);
     std::vector<unsigned char> vertices{};
     std::vector<uint32_t> indices{};
+    // One per glTF primitive, a single one covering all the indices for the other formats
+    std::vector<SubMesh> subMeshes{};
+    // Width of the index buffer on the GPU, indices is always kept 32-bit on the CPU
+    VkIndexType indexType = VK_INDEX_TYPE_UINT32;
+
+    VkDeviceSize indexBytes() const;
+
+    glm::vec3 getPosition(size_t i) const;
 
     void loadModelOBJ(const std::string& file);
 
@@ -264,6 +376,8 @@ public:
     void cleanup();
 
     void bind(VkCommandBuffer commandBuffer);
+
+    void drawSubMesh(VkCommandBuffer commandBuffer, size_t subMesh, uint32_t instanceCount = 1) const;
 };
 
 struct Texture {
@@ -276,10 +390,28 @@ struct Texture {
     int imgs;
     static const int maxImgs = 6;
 
-    void createTextureImage(std::vector<std::string> files, VkFormat Fmt);
+    void createTextureImage(std::vector<std::string> files, VkFormat Fmt, bool stream);
+
+    void createStreamedTextureImage(stbi_uc *pixels, int texWidth, int texHeight, VkFormat Fmt);
+
+    static void downsampleMip(const std::vector<stbi_uc> &src, int width, int height, std::vector<stbi_uc> &dst,
+                              bool srgb);
+
+    static std::vector<std::vector<stbi_uc>> buildMipChain(stbi_uc *pixels, int texWidth, int texHeight,
+                                                           uint32_t mipLevels, bool srgb);
 
     void createTextureImageView(VkFormat Fmt);
 
+    static VkSamplerCreateInfo samplerInfo(VkFilter magFilter,
+                                           VkFilter minFilter,
+                                           VkSamplerAddressMode addressModeU,
+                                           VkSamplerAddressMode addressModeV,
+                                           VkSamplerMipmapMode mipmapMode,
+                                           VkBool32 anisotropyEnable,
+                                           float maxAnisotropy,
+                                           float maxLod
+    );
+
     void createTextureSampler(VkFilter magFilter,
                               VkFilter minFilter,
                               VkSamplerAddressMode addressModeU,
@@ -290,7 +422,8 @@ struct Texture {
                               float maxLod
     );
 
-    void init(BaseProject *bp, std::string file, VkFormat Fmt, bool initSampler);
+    // Streamed textures are usable right away and get their mips over the next frames (see TEXTURE_STREAM_BUDGET)
+    void init(BaseProject *bp, std::string file, VkFormat Fmt, bool initSampler, bool stream);
 
     void initCubic(BaseProject *bp, const std::vector<std::string>&, VkFormat Fmt);
 
@@ -303,6 +436,8 @@ struct DescriptorSetLayoutBinding {
     VkShaderStageFlags flags;
     int linkSize;
     int count;
+    // Baked into the layout for every element of the binding, the sampler of the written textures is ignored
+    VkSampler immutableSampler = VK_NULL_HANDLE;
 };
 
 
@@ -311,8 +446,10 @@ struct DescriptorSetLayout {
     VkDescriptorSetLayout descriptorSetLayout;
     std::vector<DescriptorSetLayoutBinding> Bindings;
     int imgInfoSize;
+    // A shared layout gets a single descriptor set per scene instead of one per instance.
+    bool shared;
 
-    void init(BaseProject *bp, std::vector<DescriptorSetLayoutBinding> B);
+    void init(BaseProject *bp, std::vector<DescriptorSetLayoutBinding> B, bool shared);
 
     void cleanup() const;
 };
@@ -330,6 +467,11 @@ struct Pipeline {
     VkPolygonMode polyModel;
     VkCullModeFlagBits CM;
     bool transp;
+    bool gBuffer;
+    bool colorWrite;
+    bool depthWrite;
+    VkShaderStageFlags pushConstantStages;
+    uint32_t pushConstantSize;
 
     VertexDescriptor *VD;
 
@@ -340,6 +482,12 @@ struct Pipeline {
     void setAdvancedFeatures(VkCompareOp _compareOp, VkPolygonMode _polyModel,
                              VkCullModeFlagBits _CM, bool _transp);
 
+    void setGBuffer(bool _gBuffer);
+
+    void setWriteMask(bool _colorWrite, bool _depthWrite);
+
+    void setPushConstants(VkShaderStageFlags _stages, uint32_t _size);
+
     void create();
 
     void destroy() const;
@@ -368,12 +516,13 @@ struct DescriptorSet {
 
     void bind(VkCommandBuffer commandBuffer, Pipeline &P, int setId, int currentImage);
 
-    void map(int currentImage, void *src, int slot);
+    void map(int currentImage, void *src, int slot, int size);
 };
 
 
 struct PoolSizes {
     int uniformBlocksInPool = 0;
+    int storageBlocksInPool = 0;
     int texturesInPool = 0;
     int setsInPool = 0;
 };
@@ -395,6 +544,10 @@ class BaseProject {
 
     friend class DescriptorSet;
 
+    friend class ShadowAtlas;
+
+    friend class ResourceCache;
+
 public:
 
     SceneId currSceneId;
@@ -425,6 +578,12 @@ public:
         }
     }
 
+    void requestStorageBlocksInPool(int n) {
+        if (DPSZs.storageBlocksInPool < n) {
+            DPSZs.storageBlocksInPool = n;
+        }
+    }
+
     void requestTexturesInPool(int n) {
         if (DPSZs.texturesInPool < n) {
             DPSZs.texturesInPool = n;
@@ -437,10 +596,91 @@ public:
         return Ar;
     }
 
+    // Samplers are shared by every texture with the same state, and destroyed with the device
+    VkSampler getSampler(const VkSamplerCreateInfo &samplerInfo) {
+        SamplerKey key{samplerInfo.magFilter, samplerInfo.minFilter, samplerInfo.mipmapMode,
+                       samplerInfo.addressModeU, samplerInfo.addressModeV, samplerInfo.addressModeW,
+                       samplerInfo.mipLodBias, samplerInfo.anisotropyEnable, samplerInfo.maxAnisotropy,
+                       samplerInfo.compareEnable, samplerInfo.compareOp, samplerInfo.minLod, samplerInfo.maxLod,
+                       samplerInfo.borderColor, samplerInfo.unnormalizedCoordinates};
+        auto cached = samplerCache.find(key);
+        if (cached != samplerCache.end()) {
+            return cached->second;
+        }
+
+        VkSampler sampler;
+        VkResult result = vkCreateSampler(device, &samplerInfo, nullptr, &sampler);
+        if (result != VK_SUCCESS) {
+            PrintVkError(result);
+            throw std::runtime_error("failed to create texture sampler!");
+        }
+        samplerCache[key] = sampler;
+        return sampler;
+    }
+
+    VkExtent2D getExtent() {
+        return swapChainExtent;
+    }
+
     void closeWindow() {
         glfwSetWindowShouldClose(window, GL_TRUE);
     }
 
+    // Re-records the command buffers after the current frame, without rebuilding the swap chain
+    void requestCommandBufferRebuild() {
+        commandBuffersDirty = true;
+    }
+
+    // Must be chosen before run(): the G-buffer is created together with the swap chain.
+    void setDeferred(bool _deferred) {
+        deferred = _deferred;
+    }
+
+    bool isDeferred() const {
+        return deferred;
+    }
+
+    std::vector<Texture *> getGBuffer() {
+        return {&gBuffer[0], &gBuffer[1], &gBuffer[2]};
+    }
+
+    // Applied when the swap chain is (re)created: call before run(), or cycle at runtime.
+    void setAntiAliasing(AntiAliasing aa) {
+        requestedAntiAliasing = aa;
+    }
+
+    void setMipmapGenerator(MipmapGenerator generator) {
+        mipmapGenerator = generator;
+    }
+
+    // Without streaming every texture gets its whole mip chain at load time (e.g. to time the mipmap generators)
+    void setTextureStreaming(bool streaming) {
+        textureStreaming = streaming;
+    }
+
+    // Synthetic point lights added around the spawn of the levels, to time the lighting with many lights
+    void setStressLights(int count) {
+        stressLights = count;
+    }
+
+    int getStressLights() const {
+        return stressLights;
+    }
+
+    // Without clusters every fragment loops over all the lights in view (e.g. to compare with the light grid)
+    void setClusteredLighting(bool clustered) {
+        clusteredLighting = clustered;
+    }
+
+    bool isClusteredLighting() const {
+        return clusteredLighting;
+    }
+
+    void cycleAntiAliasing() {
+        requestedAntiAliasing = (AntiAliasing) ((requestedAntiAliasing + 1) % AA_COUNT);
+        framebufferResized = true;
+    }
+
     virtual void changeScene(SceneId newSceneId) = 0;
     virtual void changeText(std::string newText, int line) = 0;
 
@@ -479,16 +719,88 @@ protected:
     VkDeviceMemory depthImageMemory;
     VkImageView depthImageView;
 
+    AntiAliasing requestedAntiAliasing = AA_MSAA_4;
+    AntiAliasing antiAliasing = AA_MSAA_4;
+    VkSampleCountFlagBits maxMsaaSamples = VK_SAMPLE_COUNT_1_BIT;
+    VkSampleCountFlags msaaSampleCounts = VK_SAMPLE_COUNT_1_BIT;
+    // VK_EXT_descriptor_indexing: array bindings (the scene texture table) may be partially written
+    bool descriptorIndexing = false;
+
+    // Mips of a texture still waiting to be uploaded, from the coarsest one not yet resident down to level 0. The
+    // chain comes from a worker thread, and every level is released as soon as it is copied.
+    struct TextureStream {
+        Texture *T;
+        int width, height;
+        uint32_t tail;
+        bool linearBlit;
+        bool cleared;
+        uint32_t level;
+        uint32_t row;
+        std::future<std::vector<std::vector<stbi_uc>>> chain;
+        std::vector<std::vector<stbi_uc>> levels;
+    };
+    std::vector<TextureStream> textureStreams;
+    std::vector<VkCommandBuffer> frameCommandBuffers;
+    std::vector<VkBuffer> streamStagingBuffers;
+    std::vector<VkDeviceMemory> streamStagingMemory;
+    std::vector<void *> streamStagingData;
+
+    using SamplerKey = std::tuple<VkFilter, VkFilter, VkSamplerMipmapMode, VkSamplerAddressMode,
+            VkSamplerAddressMode, VkSamplerAddressMode, float, VkBool32, float, VkBool32, VkCompareOp, float, float,
+            VkBorderColor, VkBool32>;
+    std::map<SamplerKey, VkSampler> samplerCache;
     VkSampleCountFlagBits msaaSamples = VK_SAMPLE_COUNT_1_BIT;
     VkImage colorImage;
     VkDeviceMemory colorImageMemory;
     VkImageView colorImageView;
 
+    // Deferred path: the opaque geometry is rendered into the G-buffer, then lit by a full-screen pass
+    bool deferred = false;
+    VkRenderPass gBufferPass;
+    VkFramebuffer gBufferFramebuffer;
+    Texture gBuffer[GBUFFER_ATTACHMENTS];
+
+    // FXAA: the main pass renders into sceneColor, then a full-screen pass filters it into the swap chain image
+    Texture sceneColor;
+    VkRenderPass postRenderPass;
+    std::vector<VkFramebuffer> postFramebuffers;
+    VkDescriptorSetLayout postDescriptorSetLayout;
+    VkDescriptorPool postDescriptorPool;
+    VkDescriptorSet postDescriptorSet;
+    VkShaderModule postVertShaderModule;
+    VkShaderModule postFragShaderModule;
+    VkPipelineLayout postPipelineLayout;
+    VkPipeline postPipeline;
+
+    std::chrono::high_resolution_clock::time_point frameStatsStart;
+    int frameStatsCount = 0;
+    // Disabled (null pool) when the graphics queue has no timestamps
+    VkQueryPool timestampQueryPool = VK_NULL_HANDLE;
+    uint32_t timestampQueryCount = 0;
+    float timestampPeriod = 0.0f;
+    uint64_t timestampMask = 0;
+    std::vector<bool> timestampsWritten;
+    double gpuSceneTime = 0.0;
+    double gpuPostTime = 0.0;
+    int gpuStatsCount = 0;
+
+    bool textureStreaming = true;
+    int stressLights = 0;
+    bool clusteredLighting = true;
+    MipmapGenerator mipmapGenerator = MIPMAP_BLIT;
+    // Compute mipmap generator, created by the first texture that uses it
+    VkDescriptorSetLayout mipmapDescriptorSetLayout = VK_NULL_HANDLE;
+    VkDescriptorPool mipmapDescriptorPool;
+    VkDescriptorSet mipmapDescriptorSet;
+    VkPipelineLayout mipmapPipelineLayout;
+    VkPipeline mipmapPipeline;
+
     PoolSizes DPSZs;
 
     std::vector<VkFramebuffer> swapChainFramebuffers;
     size_t currentFrame = 0;
     bool framebufferResized = false;
+    bool commandBuffersDirty = false;
 
     std::vector<VkSemaphore> imageAvailableSemaphores;
     std::vector<VkSemaphore> renderFinishedSemaphores;
@@ -530,11 +842,16 @@ protected:
         createLogicalDevice();
         createSwapChain();
         createImageViews();
+        applyAntiAliasing();
         createRenderPass();
         createCommandPool();
+        initTimestamps();
+        createTextureStreamResources();
         createColorResources();
         createDepthResources();
         createFramebuffers();
+        createGBufferResources();
+        createPostResources();
         localInit();
 
         createDescriptorPool();
@@ -769,8 +1086,15 @@ protected:
             bool suitable = isDeviceSuitable(dev, devRep);
             if (suitable) {
                 physicalDevice = dev;
-                msaaSamples = getMaxUsableSampleCount();
-                std::cout << "\n\nMaximum samples for anti-aliasing: " << msaaSamples << "\n\n\n";
+                maxMsaaSamples = getMaxUsableSampleCount();
+                msaaSampleCounts = getUsableSampleCounts();
+                std::cout << "\n\nMaximum samples for anti-aliasing: " << maxMsaaSamples << "\n\n\n";
+                descriptorIndexing = checkDescriptorIndexingSupport(dev);
+                if (descriptorIndexing) {
+                    deviceExtensions.push_back(VK_KHR_MAINTENANCE3_EXTENSION_NAME);
+                    deviceExtensions.push_back(VK_EXT_DESCRIPTOR_INDEXING_EXTENSION_NAME);
+                }
+                std::cout << "Texture table: " << (descriptorIndexing ? "partially bound" : "fully written") << "\n";
                 break;
             } else {
                 std::cout << "Device " << dev << " is not suitable\n";
@@ -783,6 +1107,27 @@ protected:
         }
     }
 
+    // The features query needs VK_KHR_get_physical_device_properties2, enabled on the instance when available.
+    bool checkDescriptorIndexingSupport(VkPhysicalDevice dev) {
+        if (!checkIfItHasDeviceExtension(dev, VK_EXT_DESCRIPTOR_INDEXING_EXTENSION_NAME) ||
+            !checkIfItHasDeviceExtension(dev, VK_KHR_MAINTENANCE3_EXTENSION_NAME)) {
+            return false;
+        }
+        auto getFeatures2 = (PFN_vkGetPhysicalDeviceFeatures2KHR)
+                vkGetInstanceProcAddr(instance, "vkGetPhysicalDeviceFeatures2KHR");
+        if (getFeatures2 == nullptr) {
+            return false;
+        }
+
+        VkPhysicalDeviceDescriptorIndexingFeaturesEXT indexingFeatures{};
+        indexingFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DESCRIPTOR_INDEXING_FEATURES_EXT;
+        VkPhysicalDeviceFeatures2KHR features{};
+        features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2_KHR;
+        features.pNext = &indexingFeatures;
+        getFeatures2(dev, &features);
+        return indexingFeatures.descriptorBindingPartiallyBound == VK_TRUE;
+    }
+
     bool isDeviceSuitable(VkPhysicalDevice dev, deviceReport &devRep) {
         QueueFamilyIndices indices = findQueueFamilies(dev);
 
@@ -888,13 +1233,16 @@ protected:
         return details;
     }
 
-    VkSampleCountFlagBits getMaxUsableSampleCount() {
+    VkSampleCountFlags getUsableSampleCounts() {
         VkPhysicalDeviceProperties physicalDeviceProperties;
         vkGetPhysicalDeviceProperties(physicalDevice, &physicalDeviceProperties);
 
-        VkSampleCountFlags counts =
-                physicalDeviceProperties.limits.framebufferColorSampleCounts &
-                physicalDeviceProperties.limits.framebufferDepthSampleCounts;
+        return physicalDeviceProperties.limits.framebufferColorSampleCounts &
+               physicalDeviceProperties.limits.framebufferDepthSampleCounts;
+    }
+
+    VkSampleCountFlagBits getMaxUsableSampleCount() {
+        VkSampleCountFlags counts = getUsableSampleCounts();
 
         if (counts & VK_SAMPLE_COUNT_64_BIT) { return VK_SAMPLE_COUNT_64_BIT; }
         if (counts & VK_SAMPLE_COUNT_32_BIT) { return VK_SAMPLE_COUNT_32_BIT; }
@@ -923,13 +1271,27 @@ protected:
             queueCreateInfos.push_back(queueCreateInfo);
         }
 
+        // The texture table is indexed with a push constant, which is dynamically uniform
+        VkPhysicalDeviceFeatures supportedFeatures;
+        vkGetPhysicalDeviceFeatures(physicalDevice, &supportedFeatures);
+        if (supportedFeatures.shaderSampledImageArrayDynamicIndexing != VK_TRUE) {
+            throw std::runtime_error("failed to find support for indexing the texture table!");
+        }
+
         VkPhysicalDeviceFeatures deviceFeatures{};
         deviceFeatures.samplerAnisotropy = VK_TRUE;
-        deviceFeatures.sampleRateShading = VK_TRUE;
         deviceFeatures.fillModeNonSolid = VK_TRUE;
+        deviceFeatures.shaderSampledImageArrayDynamicIndexing = VK_TRUE;
+
+        VkPhysicalDeviceDescriptorIndexingFeaturesEXT indexingFeatures{};
+        indexingFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DESCRIPTOR_INDEXING_FEATURES_EXT;
+        indexingFeatures.descriptorBindingPartiallyBound = VK_TRUE;
 
         VkDeviceCreateInfo createInfo{};
         createInfo.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
+        if (descriptorIndexing) {
+            createInfo.pNext = &indexingFeatures;
+        }
 
         createInfo.pQueueCreateInfos = queueCreateInfos.data();
         createInfo.queueCreateInfoCount =
@@ -1093,7 +1455,26 @@ protected:
         return imageView;
     }
 
+    void applyAntiAliasing() {
+        static const VkSampleCountFlagBits samples[AA_COUNT] = {VK_SAMPLE_COUNT_1_BIT, VK_SAMPLE_COUNT_2_BIT,
+                                                                VK_SAMPLE_COUNT_4_BIT, VK_SAMPLE_COUNT_8_BIT,
+                                                                VK_SAMPLE_COUNT_1_BIT};
+        antiAliasing = requestedAntiAliasing;
+        // the device may skip some counts below its maximum (e.g. only 1 and 4), take the next supported one down
+        msaaSamples = samples[antiAliasing];
+        while (msaaSamples > VK_SAMPLE_COUNT_1_BIT && !(msaaSampleCounts & msaaSamples))
+            msaaSamples = (VkSampleCountFlagBits) (msaaSamples >> 1);
+        std::cout << "Anti-aliasing: " << antiAliasingNames[antiAliasing] << " (" << msaaSamples << " samples)\n";
+
+        frameStatsStart = std::chrono::high_resolution_clock::now();
+        frameStatsCount = 0;
+        gpuStatsCount = 0;
+    }
+
     void createRenderPass() {
+        // Single-sampled tiers write the swap chain image (or the FXAA input) directly, without a resolve
+        bool resolve = msaaSamples != VK_SAMPLE_COUNT_1_BIT;
+
         VkAttachmentDescription colorAttachmentResolve{};
         colorAttachmentResolve.format = swapChainImageFormat;
         colorAttachmentResolve.samples = VK_SAMPLE_COUNT_1_BIT;
@@ -1133,7 +1514,9 @@ protected:
         colorAttachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
         colorAttachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
         colorAttachment.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-        colorAttachment.finalLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+        colorAttachment.finalLayout = resolve ? VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL :
+                                      antiAliasing == AA_FXAA ? VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL :
+                                      VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
 
         VkAttachmentReference colorAttachmentRef{};
         colorAttachmentRef.attachment = 0;
@@ -1145,19 +1528,34 @@ protected:
         subpass.colorAttachmentCount = 1;
         subpass.pColorAttachments = &colorAttachmentRef;
         subpass.pDepthStencilAttachment = &depthAttachmentRef;
-        subpass.pResolveAttachments = &colorAttachmentResolveRef;
-
-        VkSubpassDependency dependency{};
-        dependency.srcSubpass = VK_SUBPASS_EXTERNAL;
-        dependency.dstSubpass = 0;
-        dependency.srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
-        dependency.srcAccessMask = 0;
-        dependency.dstStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
-        dependency.dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+        subpass.pResolveAttachments = resolve ? &colorAttachmentResolveRef : nullptr;
+
+        std::vector<VkSubpassDependency> dependencies(1);
+        dependencies[0].srcSubpass = VK_SUBPASS_EXTERNAL;
+        dependencies[0].dstSubpass = 0;
+        dependencies[0].srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+        dependencies[0].srcAccessMask = 0;
+        dependencies[0].dstStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+        dependencies[0].dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+
+        if (antiAliasing == AA_FXAA) {
+            // The previous FXAA pass must be done reading the image before it is cleared, and this frame's
+            // pass must see it written
+            dependencies[0].srcStageMask |= VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
+
+            VkSubpassDependency postDependency{};
+            postDependency.srcSubpass = 0;
+            postDependency.dstSubpass = VK_SUBPASS_EXTERNAL;
+            postDependency.srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+            postDependency.srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+            postDependency.dstStageMask = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
+            postDependency.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+            dependencies.push_back(postDependency);
+        }
 
-        std::array<VkAttachmentDescription, 3> attachments =
-                {colorAttachment, depthAttachment,
-                 colorAttachmentResolve};
+        std::vector<VkAttachmentDescription> attachments = {colorAttachment, depthAttachment};
+        if (resolve)
+            attachments.push_back(colorAttachmentResolve);
 
         VkRenderPassCreateInfo renderPassInfo{};
         renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
@@ -1165,8 +1563,8 @@ protected:
         renderPassInfo.pAttachments = attachments.data();
         renderPassInfo.subpassCount = 1;
         renderPassInfo.pSubpasses = &subpass;
-        renderPassInfo.dependencyCount = 1;
-        renderPassInfo.pDependencies = &dependency;
+        renderPassInfo.dependencyCount = static_cast<uint32_t>(dependencies.size());
+        renderPassInfo.pDependencies = dependencies.data();
 
         VkResult result = vkCreateRenderPass(device, &renderPassInfo, nullptr,
                                              &renderPass);
@@ -1179,11 +1577,13 @@ protected:
     void createFramebuffers() {
         swapChainFramebuffers.resize(swapChainImageViews.size());
         for (size_t i = 0; i < swapChainImageViews.size(); i++) {
-            std::array<VkImageView, 3> attachments = {
-                    colorImageView,
-                    depthImageView,
-                    swapChainImageViews[i]
-            };
+            std::vector<VkImageView> attachments;
+            if (msaaSamples != VK_SAMPLE_COUNT_1_BIT)
+                attachments = {colorImageView, depthImageView, swapChainImageViews[i]};
+            else if (antiAliasing == AA_FXAA)
+                attachments = {sceneColor.textureImageView, depthImageView};
+            else
+                attachments = {swapChainImageViews[i], depthImageView};
 
             VkFramebufferCreateInfo framebufferInfo{};
             framebufferInfo.sType =
@@ -1205,6 +1605,372 @@ protected:
         }
     }
 
+    VkFormat findGBufferDepthFormat() {
+        return findSupportedFormat({VK_FORMAT_D32_SFLOAT,
+                                    VK_FORMAT_D16_UNORM},
+                                   VK_IMAGE_TILING_OPTIMAL,
+                                   VK_FORMAT_FEATURE_DEPTH_STENCIL_ATTACHMENT_BIT |
+                                   VK_FORMAT_FEATURE_SAMPLED_IMAGE_BIT);
+    }
+
+    void createGBufferResources() {
+        if (!deferred)
+            return;
+
+        VkFormat formats[GBUFFER_ATTACHMENTS] = {VK_FORMAT_R8G8B8A8_UNORM, VK_FORMAT_R16G16B16A16_SFLOAT,
+                                                 findGBufferDepthFormat()};
+
+        std::array<VkAttachmentDescription, GBUFFER_ATTACHMENTS> attachments{};
+        std::array<VkAttachmentReference, GBUFFER_COLOR_ATTACHMENTS> colorAttachmentRefs{};
+        for (int i = 0; i < GBUFFER_ATTACHMENTS; i++) {
+            attachments[i].format = formats[i];
+            attachments[i].samples = VK_SAMPLE_COUNT_1_BIT;
+            attachments[i].loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
+            attachments[i].storeOp = VK_ATTACHMENT_STORE_OP_STORE;
+            attachments[i].stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+            attachments[i].stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+            attachments[i].initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+            attachments[i].finalLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+            if (i < GBUFFER_COLOR_ATTACHMENTS)
+                colorAttachmentRefs[i] = {(uint32_t) i, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL};
+        }
+        VkAttachmentReference depthAttachmentRef{GBUFFER_COLOR_ATTACHMENTS,
+                                                 VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL};
+
+        VkSubpassDescription subpass{};
+        subpass.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
+        subpass.colorAttachmentCount = GBUFFER_COLOR_ATTACHMENTS;
+        subpass.pColorAttachments = colorAttachmentRefs.data();
+        subpass.pDepthStencilAttachment = &depthAttachmentRef;
+
+        // The lighting pass of the previous frame must be done reading before the G-buffer is cleared,
+        // and the G-buffer must be written before this frame's lighting pass samples it.
+        std::array<VkSubpassDependency, 2> dependencies{};
+        dependencies[0].srcSubpass = VK_SUBPASS_EXTERNAL;
+        dependencies[0].dstSubpass = 0;
+        dependencies[0].srcStageMask = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
+        dependencies[0].srcAccessMask = VK_ACCESS_SHADER_READ_BIT;
+        dependencies[0].dstStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT |
+                                       VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT;
+        dependencies[0].dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT |
+                                        VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+
+        dependencies[1].srcSubpass = 0;
+        dependencies[1].dstSubpass = VK_SUBPASS_EXTERNAL;
+        dependencies[1].srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT |
+                                       VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT;
+        dependencies[1].srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT |
+                                        VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+        dependencies[1].dstStageMask = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
+        dependencies[1].dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+
+        VkRenderPassCreateInfo renderPassInfo{};
+        renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
+        renderPassInfo.attachmentCount = static_cast<uint32_t>(attachments.size());
+        renderPassInfo.pAttachments = attachments.data();
+        renderPassInfo.subpassCount = 1;
+        renderPassInfo.pSubpasses = &subpass;
+        renderPassInfo.dependencyCount = static_cast<uint32_t>(dependencies.size());
+        renderPassInfo.pDependencies = dependencies.data();
+
+        VkResult result = vkCreateRenderPass(device, &renderPassInfo, nullptr, &gBufferPass);
+        if (result != VK_SUCCESS) {
+            PrintVkError(result);
+            throw std::runtime_error("failed to create G-buffer render pass!");
+        }
+
+        std::array<VkImageView, GBUFFER_ATTACHMENTS> views{};
+        for (int i = 0; i < GBUFFER_ATTACHMENTS; i++) {
+            bool depth = i == GBUFFER_COLOR_ATTACHMENTS;
+            gBuffer[i].BP = this;
+            gBuffer[i].mipLevels = 1;
+            gBuffer[i].imgs = 1;
+            createImage(swapChainExtent.width, swapChainExtent.height, 1, 1,
+                        VK_SAMPLE_COUNT_1_BIT, formats[i], VK_IMAGE_TILING_OPTIMAL,
+                        (depth ? VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT : VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT) |
+                        VK_IMAGE_USAGE_SAMPLED_BIT, 0,
+                        VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                        gBuffer[i].textureImage, gBuffer[i].textureImageMemory);
+            gBuffer[i].textureImageView = createImageView(gBuffer[i].textureImage, formats[i],
+                                                          depth ? VK_IMAGE_ASPECT_DEPTH_BIT
+                                                                : VK_IMAGE_ASPECT_COLOR_BIT, 1,
+                                                          VK_IMAGE_VIEW_TYPE_2D, 1);
+            gBuffer[i].createTextureSampler(VK_FILTER_NEAREST, VK_FILTER_NEAREST,
+                                            VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
+                                            VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
+                                            VK_SAMPLER_MIPMAP_MODE_NEAREST, VK_FALSE, 1.0f, 0.0f);
+            views[i] = gBuffer[i].textureImageView;
+        }
+
+        VkFramebufferCreateInfo framebufferInfo{};
+        framebufferInfo.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
+        framebufferInfo.renderPass = gBufferPass;
+        framebufferInfo.attachmentCount = static_cast<uint32_t>(views.size());
+        framebufferInfo.pAttachments = views.data();
+        framebufferInfo.width = swapChainExtent.width;
+        framebufferInfo.height = swapChainExtent.height;
+        framebufferInfo.layers = 1;
+
+        result = vkCreateFramebuffer(device, &framebufferInfo, nullptr, &gBufferFramebuffer);
+        if (result != VK_SUCCESS) {
+            PrintVkError(result);
+            throw std::runtime_error("failed to create G-buffer framebuffer!");
+        }
+    }
+
+    void cleanupGBufferResources() {
+        if (!deferred)
+            return;
+
+        vkDestroyFramebuffer(device, gBufferFramebuffer, nullptr);
+        for (auto &attachment: gBuffer)
+            attachment.cleanup();
+        vkDestroyRenderPass(device, gBufferPass, nullptr);
+    }
+
+    VkShaderModule createPostShaderModule(const std::string &file) {
+        auto code = readFile(file);
+        std::cout << "Post-process shader <" << file << "> len: " << code.size() << "\n";
+
+        VkShaderModuleCreateInfo createInfo{};
+        createInfo.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
+        createInfo.codeSize = code.size();
+        createInfo.pCode = reinterpret_cast<const uint32_t *>(code.data());
+
+        VkShaderModule shaderModule;
+        VkResult result = vkCreateShaderModule(device, &createInfo, nullptr, &shaderModule);
+        if (result != VK_SUCCESS) {
+            PrintVkError(result);
+            throw std::runtime_error("failed to create shader module!");
+        }
+        return shaderModule;
+    }
+
+    // FXAA pass: a full-screen triangle sampling sceneColor, written to the swap chain image
+    void createPostResources() {
+        if (antiAliasing != AA_FXAA)
+            return;
+
+        VkAttachmentDescription colorAttachment{};
+        colorAttachment.format = swapChainImageFormat;
+        colorAttachment.samples = VK_SAMPLE_COUNT_1_BIT;
+        colorAttachment.loadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+        colorAttachment.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
+        colorAttachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+        colorAttachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+        colorAttachment.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+        colorAttachment.finalLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+
+        VkAttachmentReference colorAttachmentRef{0, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL};
+
+        VkSubpassDescription subpass{};
+        subpass.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
+        subpass.colorAttachmentCount = 1;
+        subpass.pColorAttachments = &colorAttachmentRef;
+
+        VkSubpassDependency dependency{};
+        dependency.srcSubpass = VK_SUBPASS_EXTERNAL;
+        dependency.dstSubpass = 0;
+        dependency.srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+        dependency.srcAccessMask = 0;
+        dependency.dstStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+        dependency.dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+
+        VkRenderPassCreateInfo renderPassInfo{};
+        renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
+        renderPassInfo.attachmentCount = 1;
+        renderPassInfo.pAttachments = &colorAttachment;
+        renderPassInfo.subpassCount = 1;
+        renderPassInfo.pSubpasses = &subpass;
+        renderPassInfo.dependencyCount = 1;
+        renderPassInfo.pDependencies = &dependency;
+
+        VkResult result = vkCreateRenderPass(device, &renderPassInfo, nullptr, &postRenderPass);
+        if (result != VK_SUCCESS) {
+            PrintVkError(result);
+            throw std::runtime_error("failed to create post-process render pass!");
+        }
+
+        postFramebuffers.resize(swapChainImageViews.size());
+        for (size_t i = 0; i < swapChainImageViews.size(); i++) {
+            VkFramebufferCreateInfo framebufferInfo{};
+            framebufferInfo.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
+            framebufferInfo.renderPass = postRenderPass;
+            framebufferInfo.attachmentCount = 1;
+            framebufferInfo.pAttachments = &swapChainImageViews[i];
+            framebufferInfo.width = swapChainExtent.width;
+            framebufferInfo.height = swapChainExtent.height;
+            framebufferInfo.layers = 1;
+
+            result = vkCreateFramebuffer(device, &framebufferInfo, nullptr, &postFramebuffers[i]);
+            if (result != VK_SUCCESS) {
+                PrintVkError(result);
+                throw std::runtime_error("failed to create post-process framebuffer!");
+            }
+        }
+
+        VkDescriptorSetLayoutBinding samplerBinding{};
+        samplerBinding.binding = 0;
+        samplerBinding.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+        samplerBinding.descriptorCount = 1;
+        samplerBinding.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
+
+        VkDescriptorSetLayoutCreateInfo layoutInfo{};
+        layoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+        layoutInfo.bindingCount = 1;
+        layoutInfo.pBindings = &samplerBinding;
+
+        result = vkCreateDescriptorSetLayout(device, &layoutInfo, nullptr, &postDescriptorSetLayout);
+        if (result != VK_SUCCESS) {
+            PrintVkError(result);
+            throw std::runtime_error("failed to create post-process descriptor set layout!");
+        }
+
+        VkDescriptorPoolSize poolSize{VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 1};
+        VkDescriptorPoolCreateInfo poolInfo{};
+        poolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+        poolInfo.poolSizeCount = 1;
+        poolInfo.pPoolSizes = &poolSize;
+        poolInfo.maxSets = 1;
+
+        result = vkCreateDescriptorPool(device, &poolInfo, nullptr, &postDescriptorPool);
+        if (result != VK_SUCCESS) {
+            PrintVkError(result);
+            throw std::runtime_error("failed to create post-process descriptor pool!");
+        }
+
+        VkDescriptorSetAllocateInfo allocInfo{};
+        allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+        allocInfo.descriptorPool = postDescriptorPool;
+        allocInfo.descriptorSetCount = 1;
+        allocInfo.pSetLayouts = &postDescriptorSetLayout;
+
+        result = vkAllocateDescriptorSets(device, &allocInfo, &postDescriptorSet);
+        if (result != VK_SUCCESS) {
+            PrintVkError(result);
+            throw std::runtime_error("failed to allocate post-process descriptor set!");
+        }
+
+        VkDescriptorImageInfo imageInfo{};
+        imageInfo.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+        imageInfo.imageView = sceneColor.textureImageView;
+        imageInfo.sampler = sceneColor.textureSampler;
+
+        VkWriteDescriptorSet descriptorWrite{};
+        descriptorWrite.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        descriptorWrite.dstSet = postDescriptorSet;
+        descriptorWrite.dstBinding = 0;
+        descriptorWrite.dstArrayElement = 0;
+        descriptorWrite.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+        descriptorWrite.descriptorCount = 1;
+        descriptorWrite.pImageInfo = &imageInfo;
+        vkUpdateDescriptorSets(device, 1, &descriptorWrite, 0, nullptr);
+
+        postVertShaderModule = createPostShaderModule("shaders/FXAA.vert.spv");
+        postFragShaderModule = createPostShaderModule("shaders/FXAA.frag.spv");
+
+        VkPipelineShaderStageCreateInfo shaderStages[2]{};
+        shaderStages[0].sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+        shaderStages[0].stage = VK_SHADER_STAGE_VERTEX_BIT;
+        shaderStages[0].module = postVertShaderModule;
+        shaderStages[0].pName = "main";
+        shaderStages[1].sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+        shaderStages[1].stage = VK_SHADER_STAGE_FRAGMENT_BIT;
+        shaderStages[1].module = postFragShaderModule;
+        shaderStages[1].pName = "main";
+
+        // The triangle is generated from gl_VertexIndex
+        VkPipelineVertexInputStateCreateInfo vertexInputInfo{};
+        vertexInputInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
+
+        VkPipelineInputAssemblyStateCreateInfo inputAssembly{};
+        inputAssembly.sType = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO;
+        inputAssembly.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
+        inputAssembly.primitiveRestartEnable = VK_FALSE;
+
+        VkViewport viewport{0.0f, 0.0f, (float) swapChainExtent.width, (float) swapChainExtent.height, 0.0f, 1.0f};
+        VkRect2D scissor{{0, 0}, swapChainExtent};
+
+        VkPipelineViewportStateCreateInfo viewportState{};
+        viewportState.sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
+        viewportState.viewportCount = 1;
+        viewportState.pViewports = &viewport;
+        viewportState.scissorCount = 1;
+        viewportState.pScissors = &scissor;
+
+        VkPipelineRasterizationStateCreateInfo rasterizer{};
+        rasterizer.sType = VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO;
+        rasterizer.polygonMode = VK_POLYGON_MODE_FILL;
+        rasterizer.lineWidth = 1.0f;
+        rasterizer.cullMode = VK_CULL_MODE_NONE;
+        rasterizer.frontFace = VK_FRONT_FACE_COUNTER_CLOCKWISE;
+
+        VkPipelineMultisampleStateCreateInfo multisampling{};
+        multisampling.sType = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO;
+        multisampling.sampleShadingEnable = VK_FALSE;
+        multisampling.rasterizationSamples = VK_SAMPLE_COUNT_1_BIT;
+
+        VkPipelineColorBlendAttachmentState colorBlendAttachment{};
+        colorBlendAttachment.colorWriteMask = VK_COLOR_COMPONENT_R_BIT | VK_COLOR_COMPONENT_G_BIT |
+                                              VK_COLOR_COMPONENT_B_BIT | VK_COLOR_COMPONENT_A_BIT;
+        colorBlendAttachment.blendEnable = VK_FALSE;
+
+        VkPipelineColorBlendStateCreateInfo colorBlending{};
+        colorBlending.sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO;
+        colorBlending.logicOpEnable = VK_FALSE;
+        colorBlending.attachmentCount = 1;
+        colorBlending.pAttachments = &colorBlendAttachment;
+
+        VkPipelineLayoutCreateInfo pipelineLayoutInfo{};
+        pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+        pipelineLayoutInfo.setLayoutCount = 1;
+        pipelineLayoutInfo.pSetLayouts = &postDescriptorSetLayout;
+
+        result = vkCreatePipelineLayout(device, &pipelineLayoutInfo, nullptr, &postPipelineLayout);
+        if (result != VK_SUCCESS) {
+            PrintVkError(result);
+            throw std::runtime_error("failed to create post-process pipeline layout!");
+        }
+
+        VkGraphicsPipelineCreateInfo pipelineInfo{};
+        pipelineInfo.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
+        pipelineInfo.stageCount = 2;
+        pipelineInfo.pStages = shaderStages;
+        pipelineInfo.pVertexInputState = &vertexInputInfo;
+        pipelineInfo.pInputAssemblyState = &inputAssembly;
+        pipelineInfo.pViewportState = &viewportState;
+        pipelineInfo.pRasterizationState = &rasterizer;
+        pipelineInfo.pMultisampleState = &multisampling;
+        pipelineInfo.pColorBlendState = &colorBlending;
+        pipelineInfo.layout = postPipelineLayout;
+        pipelineInfo.renderPass = postRenderPass;
+        pipelineInfo.subpass = 0;
+        pipelineInfo.basePipelineHandle = VK_NULL_HANDLE;
+        pipelineInfo.basePipelineIndex = -1;
+
+        result = vkCreateGraphicsPipelines(device, VK_NULL_HANDLE, 1, &pipelineInfo, nullptr, &postPipeline);
+        if (result != VK_SUCCESS) {
+            PrintVkError(result);
+            throw std::runtime_error("failed to create post-process pipeline!");
+        }
+    }
+
+    void cleanupPostResources() {
+        if (antiAliasing != AA_FXAA)
+            return;
+
+        vkDestroyPipeline(device, postPipeline, nullptr);
+        vkDestroyPipelineLayout(device, postPipelineLayout, nullptr);
+        vkDestroyShaderModule(device, postFragShaderModule, nullptr);
+        vkDestroyShaderModule(device, postVertShaderModule, nullptr);
+        vkDestroyDescriptorPool(device, postDescriptorPool, nullptr);
+        vkDestroyDescriptorSetLayout(device, postDescriptorSetLayout, nullptr);
+        for (auto framebuffer: postFramebuffers)
+            vkDestroyFramebuffer(device, framebuffer, nullptr);
+        vkDestroyRenderPass(device, postRenderPass, nullptr);
+        sceneColor.cleanup();
+    }
+
     void createCommandPool() {
         QueueFamilyIndices queueFamilyIndices =
                 findQueueFamilies(physicalDevice);
@@ -1212,7 +1978,7 @@ protected:
         VkCommandPoolCreateInfo poolInfo{};
         poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
         poolInfo.queueFamilyIndex = queueFamilyIndices.graphicsFamily.value();
-        poolInfo.flags = 0; // Optional
+        poolInfo.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT; // The streaming ones are re-recorded
 
         VkResult result = vkCreateCommandPool(device, &poolInfo, nullptr, &commandPool);
         if (result != VK_SUCCESS) {
@@ -1223,15 +1989,35 @@ protected:
 
     void createColorResources() {
         VkFormat colorFormat = swapChainImageFormat;
-        createImage(swapChainExtent.width, swapChainExtent.height, 1, 1,
-                    msaaSamples, colorFormat, VK_IMAGE_TILING_OPTIMAL,
-                    VK_IMAGE_USAGE_TRANSIENT_ATTACHMENT_BIT |
-                    VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT, 0,
-                    VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
-                    colorImage, colorImageMemory);
-        colorImageView = createImageView(colorImage, colorFormat,
-                                         VK_IMAGE_ASPECT_COLOR_BIT, 1,
-                                         VK_IMAGE_VIEW_TYPE_2D, 1);
+        if (msaaSamples != VK_SAMPLE_COUNT_1_BIT) {
+            createImage(swapChainExtent.width, swapChainExtent.height, 1, 1,
+                        msaaSamples, colorFormat, VK_IMAGE_TILING_OPTIMAL,
+                        VK_IMAGE_USAGE_TRANSIENT_ATTACHMENT_BIT |
+                        VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT, 0,
+                        VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                        colorImage, colorImageMemory);
+            colorImageView = createImageView(colorImage, colorFormat,
+                                             VK_IMAGE_ASPECT_COLOR_BIT, 1,
+                                             VK_IMAGE_VIEW_TYPE_2D, 1);
+        }
+
+        if (antiAliasing == AA_FXAA) {
+            sceneColor.BP = this;
+            sceneColor.mipLevels = 1;
+            sceneColor.imgs = 1;
+            createImage(swapChainExtent.width, swapChainExtent.height, 1, 1,
+                        VK_SAMPLE_COUNT_1_BIT, colorFormat, VK_IMAGE_TILING_OPTIMAL,
+                        VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_SAMPLED_BIT, 0,
+                        VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                        sceneColor.textureImage, sceneColor.textureImageMemory);
+            sceneColor.textureImageView = createImageView(sceneColor.textureImage, colorFormat,
+                                                          VK_IMAGE_ASPECT_COLOR_BIT, 1,
+                                                          VK_IMAGE_VIEW_TYPE_2D, 1);
+            sceneColor.createTextureSampler(VK_FILTER_LINEAR, VK_FILTER_LINEAR,
+                                            VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
+                                            VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
+                                            VK_SAMPLER_MIPMAP_MODE_NEAREST, VK_FALSE, 1.0f, 0.0f);
+        }
     }
 
     void createDepthResources() {
@@ -1415,6 +2201,218 @@ protected:
         endSingleTimeCommands(commandBuffer);
     }
 
+    // Compute if requested, or if the format cannot be blitted; blit if the graphics queue cannot run compute
+    bool useComputeMipmaps(VkFormat imageFormat) {
+        VkFormatProperties formatProperties;
+        vkGetPhysicalDeviceFormatProperties(physicalDevice, imageFormat, &formatProperties);
+        bool blit = formatProperties.optimalTilingFeatures & VK_FORMAT_FEATURE_SAMPLED_IMAGE_FILTER_LINEAR_BIT;
+
+        uint32_t queueFamilyCount = 0;
+        vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &queueFamilyCount, nullptr);
+        std::vector<VkQueueFamilyProperties> queueFamilies(queueFamilyCount);
+        vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &queueFamilyCount, queueFamilies.data());
+        bool compute = queueFamilies[findQueueFamilies(physicalDevice).graphicsFamily.value()].queueFlags &
+                       VK_QUEUE_COMPUTE_BIT;
+
+        if (!blit && !compute) {
+            throw std::runtime_error("texture image format does not support linear blitting!");
+        }
+        return compute && (mipmapGenerator == MIPMAP_COMPUTE || !blit);
+    }
+
+    // Texels of the whole chain, levels one after the other, the layers of a level contiguous (see Mipmap.comp)
+    static VkDeviceSize mipChainSize(int32_t texWidth, int32_t texHeight, uint32_t mipLevels, int layerCount) {
+        VkDeviceSize size = 0;
+        for (uint32_t i = 0; i < mipLevels; i++)
+            size += (VkDeviceSize) std::max(texWidth >> i, 1) * std::max(texHeight >> i, 1) * 4 * layerCount;
+        return size;
+    }
+
+    void createMipmapResources() {
+        VkDescriptorSetLayoutBinding binding{};
+        binding.binding = 0;
+        binding.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+        binding.descriptorCount = 1;
+        binding.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+
+        VkDescriptorSetLayoutCreateInfo layoutInfo{};
+        layoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+        layoutInfo.bindingCount = 1;
+        layoutInfo.pBindings = &binding;
+        VkResult result = vkCreateDescriptorSetLayout(device, &layoutInfo, nullptr, &mipmapDescriptorSetLayout);
+        if (result != VK_SUCCESS) {
+            PrintVkError(result);
+            throw std::runtime_error("failed to create mipmap descriptor set layout!");
+        }
+
+        VkDescriptorPoolSize poolSize{};
+        poolSize.type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+        poolSize.descriptorCount = 1;
+        VkDescriptorPoolCreateInfo poolInfo{};
+        poolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+        poolInfo.poolSizeCount = 1;
+        poolInfo.pPoolSizes = &poolSize;
+        poolInfo.maxSets = 1;
+        result = vkCreateDescriptorPool(device, &poolInfo, nullptr, &mipmapDescriptorPool);
+        if (result != VK_SUCCESS) {
+            PrintVkError(result);
+            throw std::runtime_error("failed to create mipmap descriptor pool!");
+        }
+
+        VkDescriptorSetAllocateInfo allocInfo{};
+        allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+        allocInfo.descriptorPool = mipmapDescriptorPool;
+        allocInfo.descriptorSetCount = 1;
+        allocInfo.pSetLayouts = &mipmapDescriptorSetLayout;
+        result = vkAllocateDescriptorSets(device, &allocInfo, &mipmapDescriptorSet);
+        if (result != VK_SUCCESS) {
+            PrintVkError(result);
+            throw std::runtime_error("failed to allocate mipmap descriptor set!");
+        }
+
+        VkPushConstantRange pushConstantRange{};
+        pushConstantRange.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+        pushConstantRange.offset = 0;
+        pushConstantRange.size = sizeof(MipmapPushConstant);
+        VkPipelineLayoutCreateInfo pipelineLayoutInfo{};
+        pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+        pipelineLayoutInfo.setLayoutCount = 1;
+        pipelineLayoutInfo.pSetLayouts = &mipmapDescriptorSetLayout;
+        pipelineLayoutInfo.pushConstantRangeCount = 1;
+        pipelineLayoutInfo.pPushConstantRanges = &pushConstantRange;
+        result = vkCreatePipelineLayout(device, &pipelineLayoutInfo, nullptr, &mipmapPipelineLayout);
+        if (result != VK_SUCCESS) {
+            PrintVkError(result);
+            throw std::runtime_error("failed to create mipmap pipeline layout!");
+        }
+
+        VkShaderModule shaderModule = createPostShaderModule("shaders/Mipmap.comp.spv");
+        VkComputePipelineCreateInfo pipelineInfo{};
+        pipelineInfo.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+        pipelineInfo.stage.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+        pipelineInfo.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+        pipelineInfo.stage.module = shaderModule;
+        pipelineInfo.stage.pName = "main";
+        pipelineInfo.layout = mipmapPipelineLayout;
+        result = vkCreateComputePipelines(device, VK_NULL_HANDLE, 1, &pipelineInfo, nullptr, &mipmapPipeline);
+        vkDestroyShaderModule(device, shaderModule, nullptr);
+        if (result != VK_SUCCESS) {
+            PrintVkError(result);
+            throw std::runtime_error("failed to create mipmap pipeline!");
+        }
+    }
+
+    void cleanupMipmapResources() {
+        if (mipmapDescriptorSetLayout == VK_NULL_HANDLE)
+            return;
+
+        vkDestroyPipeline(device, mipmapPipeline, nullptr);
+        vkDestroyPipelineLayout(device, mipmapPipelineLayout, nullptr);
+        vkDestroyDescriptorPool(device, mipmapDescriptorPool, nullptr);
+        vkDestroyDescriptorSetLayout(device, mipmapDescriptorSetLayout, nullptr);
+    }
+
+    // stagingBuffer holds level 0 of every layer. The chain is reduced in a device local buffer, then all the levels
+    // are copied into the image (in TRANSFER_DST_OPTIMAL) at once.
+    void generateMipmapsCompute(VkBuffer stagingBuffer, VkImage image, VkFormat imageFormat,
+                                int32_t texWidth, int32_t texHeight, uint32_t mipLevels, int layerCount) {
+        if (mipmapDescriptorSetLayout == VK_NULL_HANDLE)
+            createMipmapResources();
+
+        VkDeviceSize chainSize = mipChainSize(texWidth, texHeight, mipLevels, layerCount);
+        VkDeviceSize countersSize = layerCount * sizeof(uint32_t);
+        VkBuffer chainBuffer;
+        VkDeviceMemory chainBufferMemory;
+        createBuffer(chainSize + countersSize, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+                                               VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                     VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, chainBuffer, chainBufferMemory);
+
+        VkDescriptorBufferInfo bufferInfo{};
+        bufferInfo.buffer = chainBuffer;
+        bufferInfo.offset = 0;
+        bufferInfo.range = VK_WHOLE_SIZE;
+        VkWriteDescriptorSet descriptorWrite{};
+        descriptorWrite.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        descriptorWrite.dstSet = mipmapDescriptorSet;
+        descriptorWrite.dstBinding = 0;
+        descriptorWrite.dstArrayElement = 0;
+        descriptorWrite.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+        descriptorWrite.descriptorCount = 1;
+        descriptorWrite.pBufferInfo = &bufferInfo;
+        vkUpdateDescriptorSets(device, 1, &descriptorWrite, 0, nullptr);
+
+        VkCommandBuffer commandBuffer = beginSingleTimeCommands();
+
+        VkBufferCopy copy{};
+        copy.size = (VkDeviceSize) texWidth * texHeight * 4 * layerCount;
+        vkCmdCopyBuffer(commandBuffer, stagingBuffer, chainBuffer, 1, &copy);
+        vkCmdFillBuffer(commandBuffer, chainBuffer, chainSize, countersSize, 0);
+
+        VkBufferMemoryBarrier bufferBarrier{};
+        bufferBarrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+        bufferBarrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        bufferBarrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        bufferBarrier.buffer = chainBuffer;
+        bufferBarrier.offset = 0;
+        bufferBarrier.size = VK_WHOLE_SIZE;
+        bufferBarrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        bufferBarrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+        vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0,
+                             0, nullptr, 1, &bufferBarrier, 0, nullptr);
+
+        MipmapPushConstant pc{(uint32_t) texWidth, (uint32_t) texHeight, mipLevels, (uint32_t) layerCount,
+                              imageFormat == VK_FORMAT_R8G8B8A8_SRGB ? 1u : 0u, (uint32_t) (chainSize / 4)};
+        vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, mipmapPipeline);
+        vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, mipmapPipelineLayout, 0, 1,
+                                &mipmapDescriptorSet, 0, nullptr);
+        vkCmdPushConstants(commandBuffer, mipmapPipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(pc), &pc);
+        vkCmdDispatch(commandBuffer, (texWidth + MIPMAP_TILE - 1) / MIPMAP_TILE,
+                      (texHeight + MIPMAP_TILE - 1) / MIPMAP_TILE, layerCount);
+
+        bufferBarrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+        bufferBarrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+        vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0,
+                             0, nullptr, 1, &bufferBarrier, 0, nullptr);
+
+        std::vector<VkBufferImageCopy> regions(mipLevels);
+        VkDeviceSize offset = 0;
+        for (uint32_t i = 0; i < mipLevels; i++) {
+            regions[i].bufferOffset = offset;
+            regions[i].imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+            regions[i].imageSubresource.mipLevel = i;
+            regions[i].imageSubresource.baseArrayLayer = 0;
+            regions[i].imageSubresource.layerCount = layerCount;
+            regions[i].imageOffset = {0, 0, 0};
+            uint32_t width = std::max(texWidth >> i, 1), height = std::max(texHeight >> i, 1);
+            regions[i].imageExtent = {width, height, 1};
+            offset += (VkDeviceSize) width * height * 4 * layerCount;
+        }
+        vkCmdCopyBufferToImage(commandBuffer, chainBuffer, image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                               static_cast<uint32_t>(regions.size()), regions.data());
+
+        VkImageMemoryBarrier barrier{};
+        barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+        barrier.image = image;
+        barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+        barrier.subresourceRange.baseMipLevel = 0;
+        barrier.subresourceRange.levelCount = mipLevels;
+        barrier.subresourceRange.baseArrayLayer = 0;
+        barrier.subresourceRange.layerCount = layerCount;
+        barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+        barrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+        barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+        vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0,
+                             0, nullptr, 0, nullptr, 1, &barrier);
+
+        endSingleTimeCommands(commandBuffer);
+
+        vkDestroyBuffer(device, chainBuffer, nullptr);
+        vkFreeMemory(device, chainBufferMemory, nullptr);
+    }
+
     void transitionImageLayout(VkImage image, VkFormat format,
                                VkImageLayout oldLayout, VkImageLayout newLayout,
                                uint32_t mipLevels, int layersCount) {
@@ -1580,13 +2578,21 @@ protected:
     }
 
     void createDescriptorPool() {
-        std::array<VkDescriptorPoolSize, 2> poolSizes{};
+        std::vector<VkDescriptorPoolSize> poolSizes(2);
         poolSizes[0].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
         poolSizes[0].descriptorCount = static_cast<uint32_t>(DPSZs.uniformBlocksInPool *
                                                              swapChainImages.size());
         poolSizes[1].type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
         poolSizes[1].descriptorCount = static_cast<uint32_t>(DPSZs.texturesInPool *
                                                              swapChainImages.size());
+        // Storage buffers are only used by some scenes, and a pool size cannot have a zero count.
+        if (DPSZs.storageBlocksInPool > 0) {
+            VkDescriptorPoolSize storageSize{};
+            storageSize.type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+            storageSize.descriptorCount = static_cast<uint32_t>(DPSZs.storageBlocksInPool *
+                                                                swapChainImages.size());
+            poolSizes.push_back(storageSize);
+        }
 
         VkDescriptorPoolCreateInfo poolInfo{};
         poolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
@@ -1604,7 +2610,15 @@ protected:
 
     virtual void populateCommandBuffer(VkCommandBuffer commandBuffer, int i) = 0;
 
+    // One-time work of the current frame (e.g. shadow maps), recorded every frame after updateUniformBuffer and
+    // submitted before the command buffer of the swap chain image
+    virtual void populateFrameCommandBuffer(VkCommandBuffer commandBuffer, int i) {}
+
+    // Geometry drawn into the G-buffer when the deferred path is enabled
+    virtual void populateGBufferCommandBuffer(VkCommandBuffer commandBuffer, int i) {}
+
     void createCommandBuffers() {
+        commandBuffersDirty = false;
         commandBuffers.resize(swapChainFramebuffers.size());
 
         VkCommandBufferAllocateInfo allocInfo{};
@@ -1619,6 +2633,7 @@ protected:
             PrintVkError(result);
             throw std::runtime_error("failed to allocate command buffers!");
         }
+        createTimestampQueryPool();
 
         for (size_t i = 0; i < commandBuffers.size(); i++) {
             VkCommandBufferBeginInfo beginInfo{};
@@ -1631,6 +2646,30 @@ protected:
                 throw std::runtime_error("failed to begin recording command buffer!");
             }
 
+            uint32_t firstQuery = static_cast<uint32_t>(i) * GPU_TIMESTAMPS;
+            if (timestampQueryPool != VK_NULL_HANDLE)
+                vkCmdResetQueryPool(commandBuffers[i], timestampQueryPool, firstQuery, GPU_TIMESTAMPS);
+            writeTimestamp(commandBuffers[i], VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, firstQuery);
+
+            if (deferred) {
+                VkRenderPassBeginInfo gBufferPassInfo{};
+                gBufferPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
+                gBufferPassInfo.renderPass = gBufferPass;
+                gBufferPassInfo.framebuffer = gBufferFramebuffer;
+                gBufferPassInfo.renderArea.offset = {0, 0};
+                gBufferPassInfo.renderArea.extent = swapChainExtent;
+
+                std::array<VkClearValue, GBUFFER_ATTACHMENTS> gBufferClearValues{};
+                gBufferClearValues[GBUFFER_COLOR_ATTACHMENTS].depthStencil = {1.0f, 0};
+
+                gBufferPassInfo.clearValueCount = static_cast<uint32_t>(gBufferClearValues.size());
+                gBufferPassInfo.pClearValues = gBufferClearValues.data();
+
+                vkCmdBeginRenderPass(commandBuffers[i], &gBufferPassInfo, VK_SUBPASS_CONTENTS_INLINE);
+                populateGBufferCommandBuffer(commandBuffers[i], i);
+                vkCmdEndRenderPass(commandBuffers[i]);
+            }
+
             VkRenderPassBeginInfo renderPassInfo{};
             renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
             renderPassInfo.renderPass = renderPass;
@@ -1654,6 +2693,24 @@ protected:
 
 
             vkCmdEndRenderPass(commandBuffers[i]);
+            writeTimestamp(commandBuffers[i], VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, firstQuery + 1);
+
+            if (antiAliasing == AA_FXAA) {
+                VkRenderPassBeginInfo postPassInfo{};
+                postPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
+                postPassInfo.renderPass = postRenderPass;
+                postPassInfo.framebuffer = postFramebuffers[i];
+                postPassInfo.renderArea.offset = {0, 0};
+                postPassInfo.renderArea.extent = swapChainExtent;
+
+                vkCmdBeginRenderPass(commandBuffers[i], &postPassInfo, VK_SUBPASS_CONTENTS_INLINE);
+                vkCmdBindPipeline(commandBuffers[i], VK_PIPELINE_BIND_POINT_GRAPHICS, postPipeline);
+                vkCmdBindDescriptorSets(commandBuffers[i], VK_PIPELINE_BIND_POINT_GRAPHICS, postPipelineLayout,
+                                        0, 1, &postDescriptorSet, 0, nullptr);
+                vkCmdDraw(commandBuffers[i], 3, 1, 0, 0);
+                vkCmdEndRenderPass(commandBuffers[i]);
+            }
+            writeTimestamp(commandBuffers[i], VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, firstQuery + 2);
 
             if (vkEndCommandBuffer(commandBuffers[i]) != VK_SUCCESS) {
                 throw std::runtime_error("failed to record command buffer!");
@@ -1667,38 +2724,345 @@ protected:
         inFlightFences.resize(MAX_FRAMES_IN_FLIGHT);
         imagesInFlight.resize(swapChainImages.size(), VK_NULL_HANDLE);
 
-        VkSemaphoreCreateInfo semaphoreInfo{};
-        semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+        VkSemaphoreCreateInfo semaphoreInfo{};
+        semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+
+        VkFenceCreateInfo fenceInfo{};
+        fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+        fenceInfo.flags = VK_FENCE_CREATE_SIGNALED_BIT;
+
+        for (size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
+            VkResult result1 = vkCreateSemaphore(device, &semaphoreInfo, nullptr,
+                                                 &imageAvailableSemaphores[i]);
+            VkResult result2 = vkCreateSemaphore(device, &semaphoreInfo, nullptr,
+                                                 &renderFinishedSemaphores[i]);
+            VkResult result3 = vkCreateFence(device, &fenceInfo, nullptr,
+                                             &inFlightFences[i]);
+            if (result1 != VK_SUCCESS ||
+                result2 != VK_SUCCESS ||
+                result3 != VK_SUCCESS) {
+                PrintVkError(result1);
+                PrintVkError(result2);
+                PrintVkError(result3);
+                throw std::runtime_error("failed to create synchronization objects for a frame!!");
+            }
+        }
+    }
+
+    void mainLoop() {
+        frameStatsStart = std::chrono::high_resolution_clock::now();
+        frameStatsCount = 0;
+        while (!glfwWindowShouldClose(window)) {
+            glfwPollEvents();
+            drawFrame();
+            reportFrameTime();
+        }
+
+        vkDeviceWaitIdle(device);
+    }
+
+    // Average frame time of the active anti-aliasing tier, reset whenever the swap chain is rebuilt, with the GPU
+    // time of its scene and post passes
+    void reportFrameTime() {
+        frameStatsCount++;
+        auto now = std::chrono::high_resolution_clock::now();
+        float elapsed = std::chrono::duration<float, std::chrono::seconds::period>(now - frameStatsStart).count();
+        if (elapsed < FRAME_STATS_PERIOD)
+            return;
+
+        std::cout << "AA " << antiAliasingNames[antiAliasing] << ": " << 1000.0f * elapsed / frameStatsCount
+                  << " ms/frame (" << frameStatsCount / elapsed << " fps)";
+        if (gpuStatsCount > 0) {
+            std::cout << ", GPU scene " << gpuSceneTime / gpuStatsCount << " ms, post " << gpuPostTime / gpuStatsCount
+                      << " ms";
+        }
+        std::cout << "\n";
+        frameStatsStart = now;
+        frameStatsCount = 0;
+        gpuSceneTime = 0.0;
+        gpuPostTime = 0.0;
+        gpuStatsCount = 0;
+    }
+
+    void initTimestamps() {
+        VkPhysicalDeviceProperties properties;
+        vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+        uint32_t queueFamilyCount = 0;
+        vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &queueFamilyCount, nullptr);
+        std::vector<VkQueueFamilyProperties> queueFamilies(queueFamilyCount);
+        vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &queueFamilyCount, queueFamilies.data());
+        uint32_t validBits = queueFamilies[findQueueFamilies(physicalDevice).graphicsFamily.value()].timestampValidBits;
+
+        timestampPeriod = validBits > 0 ? properties.limits.timestampPeriod : 0.0f;
+        timestampMask = validBits >= 64 ? ~0ull : (1ull << validBits) - 1;
+    }
+
+    // Grown with the swap chain, by createCommandBuffers while the device is idle
+    void createTimestampQueryPool() {
+        timestampsWritten.assign(commandBuffers.size(), false);
+        uint32_t queryCount = static_cast<uint32_t>(commandBuffers.size()) * GPU_TIMESTAMPS;
+        if (timestampPeriod == 0.0f || queryCount <= timestampQueryCount)
+            return;
+        if (timestampQueryPool != VK_NULL_HANDLE)
+            vkDestroyQueryPool(device, timestampQueryPool, nullptr);
+
+        VkQueryPoolCreateInfo queryPoolInfo{};
+        queryPoolInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+        queryPoolInfo.queryType = VK_QUERY_TYPE_TIMESTAMP;
+        queryPoolInfo.queryCount = queryCount;
+
+        VkResult result = vkCreateQueryPool(device, &queryPoolInfo, nullptr, &timestampQueryPool);
+        if (result != VK_SUCCESS) {
+            PrintVkError(result);
+            throw std::runtime_error("failed to create timestamp query pool!");
+        }
+        timestampQueryCount = queryCount;
+    }
+
+    void writeTimestamp(VkCommandBuffer commandBuffer, VkPipelineStageFlagBits stage, uint32_t query) const {
+        if (timestampQueryPool != VK_NULL_HANDLE)
+            vkCmdWriteTimestamp(commandBuffer, stage, timestampQueryPool, query);
+    }
+
+    // The previous submission of the command buffer of the image has completed: its timestamps are available
+    void readTimestamps(uint32_t imageIndex) {
+        if (timestampQueryPool == VK_NULL_HANDLE || !timestampsWritten[imageIndex])
+            return;
+        uint64_t t[GPU_TIMESTAMPS];
+        if (vkGetQueryPoolResults(device, timestampQueryPool, imageIndex * GPU_TIMESTAMPS, GPU_TIMESTAMPS, sizeof(t), t,
+                                  sizeof(uint64_t), VK_QUERY_RESULT_64_BIT) != VK_SUCCESS)
+            return;
+        gpuSceneTime += (double) ((t[1] - t[0]) & timestampMask) * timestampPeriod * 1e-6;
+        gpuPostTime += (double) ((t[2] - t[1]) & timestampMask) * timestampPeriod * 1e-6;
+        gpuStatsCount++;
+    }
+
+    void createTextureStreamResources() {
+        frameCommandBuffers.resize(MAX_FRAMES_IN_FLIGHT);
+        streamStagingBuffers.resize(MAX_FRAMES_IN_FLIGHT);
+        streamStagingMemory.resize(MAX_FRAMES_IN_FLIGHT);
+        streamStagingData.resize(MAX_FRAMES_IN_FLIGHT);
+
+        VkCommandBufferAllocateInfo allocInfo{};
+        allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+        allocInfo.commandPool = commandPool;
+        allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+        allocInfo.commandBufferCount = static_cast<uint32_t>(frameCommandBuffers.size());
+
+        VkResult result = vkAllocateCommandBuffers(device, &allocInfo, frameCommandBuffers.data());
+        if (result != VK_SUCCESS) {
+            PrintVkError(result);
+            throw std::runtime_error("failed to allocate frame command buffers!");
+        }
+
+        // One persistently mapped staging buffer per frame in flight: it is free again once the frame fence signals
+        for (int i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
+            createBuffer(TEXTURE_STREAM_BUDGET, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+                         VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                         streamStagingBuffers[i], streamStagingMemory[i]);
+            vkMapMemory(device, streamStagingMemory[i], 0, TEXTURE_STREAM_BUDGET, 0, &streamStagingData[i]);
+        }
+    }
+
+    void cleanupTextureStreamResources() {
+        textureStreams.clear();
+        for (int i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
+            vkUnmapMemory(device, streamStagingMemory[i]);
+            vkDestroyBuffer(device, streamStagingBuffers[i], nullptr);
+            vkFreeMemory(device, streamStagingMemory[i], nullptr);
+        }
+        vkFreeCommandBuffers(device, commandPool, static_cast<uint32_t>(frameCommandBuffers.size()),
+                             frameCommandBuffers.data());
+    }
+
+    void queueTextureStream(TextureStream stream) {
+        textureStreams.push_back(std::move(stream));
+    }
+
+    // The texture is destroyed only when the device is idle, so no upload of it can still be in flight
+    void cancelTextureStream(const Texture *T) {
+        textureStreams.erase(std::remove_if(textureStreams.begin(), textureStreams.end(),
+                                            [T](const TextureStream &S) { return S.T == T; }),
+                             textureStreams.end());
+    }
+
+    // Until they arrive, the levels above the tail show it magnified: linearly if the format can be filtered
+    void recordTextureTailBlit(VkCommandBuffer commandBuffer, const TextureStream &S) {
+        std::array<VkImageMemoryBarrier, 2> barriers{};
+        for (auto &b: barriers) {
+            b.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+            b.image = S.T->textureImage;
+            b.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+            b.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+            b.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+            b.subresourceRange.baseArrayLayer = 0;
+            b.subresourceRange.layerCount = 1;
+            b.oldLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+            b.srcAccessMask = VK_ACCESS_SHADER_READ_BIT;
+        }
+        barriers[0].subresourceRange.baseMipLevel = S.tail;
+        barriers[0].subresourceRange.levelCount = 1;
+        barriers[0].newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+        barriers[0].dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+        barriers[1].subresourceRange.baseMipLevel = 0;
+        barriers[1].subresourceRange.levelCount = S.tail;
+        barriers[1].newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+        barriers[1].dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0,
+                             0, nullptr, 0, nullptr, static_cast<uint32_t>(barriers.size()), barriers.data());
+
+        int32_t tailWidth = std::max(S.width >> S.tail, 1), tailHeight = std::max(S.height >> S.tail, 1);
+        for (uint32_t i = 0; i < S.tail; i++) {
+            VkImageBlit blit{};
+            blit.srcOffsets[0] = {0, 0, 0};
+            blit.srcOffsets[1] = {tailWidth, tailHeight, 1};
+            blit.srcSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+            blit.srcSubresource.mipLevel = S.tail;
+            blit.srcSubresource.baseArrayLayer = 0;
+            blit.srcSubresource.layerCount = 1;
+            blit.dstOffsets[0] = {0, 0, 0};
+            blit.dstOffsets[1] = {std::max(S.width >> i, 1), std::max(S.height >> i, 1), 1};
+            blit.dstSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+            blit.dstSubresource.mipLevel = i;
+            blit.dstSubresource.baseArrayLayer = 0;
+            blit.dstSubresource.layerCount = 1;
+            vkCmdBlitImage(commandBuffer, S.T->textureImage, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+                           S.T->textureImage, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &blit,
+                           S.linearBlit ? VK_FILTER_LINEAR : VK_FILTER_NEAREST);
+        }
+
+        for (auto &b: barriers) {
+            b.oldLayout = b.newLayout;
+            b.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+            b.srcAccessMask = b.dstAccessMask;
+            b.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+        }
+        vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0,
+                             0, nullptr, 0, nullptr, static_cast<uint32_t>(barriers.size()), barriers.data());
+    }
+
+    // New textures are cleared first, so that nothing undefined is sampled before their mips arrive. Then rows of
+    // the pending mips are uploaded, oldest ready texture first, until the frame budget is used. Every copied level
+    // goes back to SHADER_READ_ONLY before the frame samples it.
+    void recordTextureStreams(VkCommandBuffer commandBuffer) {
+        VkImageMemoryBarrier barrier{};
+        barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+        barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+        barrier.subresourceRange.baseArrayLayer = 0;
+        barrier.subresourceRange.layerCount = 1;
+
+        for (auto &S: textureStreams) {
+            if (S.cleared)
+                continue;
+            barrier.image = S.T->textureImage;
+            barrier.subresourceRange.baseMipLevel = 0;
+            barrier.subresourceRange.levelCount = S.T->mipLevels;
+            barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+            barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+            barrier.srcAccessMask = 0;
+            barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+            vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0,
+                                 0, nullptr, 0, nullptr, 1, &barrier);
+
+            VkClearColorValue clearColor = {{0.5f, 0.5f, 0.5f, 1.0f}};
+            vkCmdClearColorImage(commandBuffer, S.T->textureImage, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, &clearColor,
+                                 1, &barrier.subresourceRange);
+
+            barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+            barrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+            barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+            barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+            vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                                 VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0, 0, nullptr, 0, nullptr, 1, &barrier);
+            S.cleared = true;
+        }
+        barrier.subresourceRange.levelCount = 1;
+
+        VkDeviceSize used = 0;
+        size_t s = 0;
+        while (s < textureStreams.size()) {
+            TextureStream &S = textureStreams[s];
+            if (S.levels.empty()) {
+                if (S.chain.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+                    s++;
+                    continue;
+                }
+                S.levels = S.chain.get();
+            }
+            uint32_t width = std::max(S.width >> S.level, 1);
+            uint32_t height = std::max(S.height >> S.level, 1);
+            VkDeviceSize rowSize = width * 4;
+            uint32_t rows = std::min<VkDeviceSize>(height - S.row, (TEXTURE_STREAM_BUDGET - used) / rowSize);
+            if (rows == 0)
+                break;
+
+            memcpy(static_cast<char *>(streamStagingData[currentFrame]) + used,
+                   S.levels[S.level].data() + S.row * rowSize, rows * rowSize);
 
-        VkFenceCreateInfo fenceInfo{};
-        fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
-        fenceInfo.flags = VK_FENCE_CREATE_SIGNALED_BIT;
+            barrier.image = S.T->textureImage;
+            barrier.subresourceRange.baseMipLevel = S.level;
+            barrier.oldLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+            barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+            barrier.srcAccessMask = VK_ACCESS_SHADER_READ_BIT;
+            barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+            vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+                                 VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0, nullptr, 1, &barrier);
+
+            VkBufferImageCopy region{};
+            region.bufferOffset = used;
+            region.bufferRowLength = 0;
+            region.bufferImageHeight = 0;
+            region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+            region.imageSubresource.mipLevel = S.level;
+            region.imageSubresource.baseArrayLayer = 0;
+            region.imageSubresource.layerCount = 1;
+            region.imageOffset = {0, static_cast<int32_t>(S.row), 0};
+            region.imageExtent = {width, rows, 1};
+            vkCmdCopyBufferToImage(commandBuffer, streamStagingBuffers[currentFrame], S.T->textureImage,
+                                   VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &region);
 
-        for (size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
-            VkResult result1 = vkCreateSemaphore(device, &semaphoreInfo, nullptr,
-                                                 &imageAvailableSemaphores[i]);
-            VkResult result2 = vkCreateSemaphore(device, &semaphoreInfo, nullptr,
-                                                 &renderFinishedSemaphores[i]);
-            VkResult result3 = vkCreateFence(device, &fenceInfo, nullptr,
-                                             &inFlightFences[i]);
-            if (result1 != VK_SUCCESS ||
-                result2 != VK_SUCCESS ||
-                result3 != VK_SUCCESS) {
-                PrintVkError(result1);
-                PrintVkError(result2);
-                PrintVkError(result3);
-                throw std::runtime_error("failed to create synchronization objects for a frame!!");
+            barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+            barrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+            barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+            barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+            vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                                 VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0, 0, nullptr, 0, nullptr, 1, &barrier);
+
+            used += rows * rowSize;
+            S.row += rows;
+            if (S.row == height) {
+                std::vector<stbi_uc>().swap(S.levels[S.level]);
+                if (S.level == S.tail)
+                    recordTextureTailBlit(commandBuffer, S);
+                if (S.level == 0) {
+                    textureStreams.erase(textureStreams.begin() + static_cast<std::ptrdiff_t>(s));
+                } else {
+                    S.level--;
+                    S.row = 0;
+                }
             }
         }
     }
 
-    void mainLoop() {
-        while (!glfwWindowShouldClose(window)) {
-            glfwPollEvents();
-            drawFrame();
+    // The texture uploads and the one-time work of this frame go in the same submission, before the frame itself
+    void recordFrameCommandBuffer(uint32_t imageIndex) {
+        VkCommandBuffer commandBuffer = frameCommandBuffers[currentFrame];
+        vkResetCommandBuffer(commandBuffer, 0);
+        VkCommandBufferBeginInfo beginInfo{};
+        beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+        beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+        if (vkBeginCommandBuffer(commandBuffer, &beginInfo) != VK_SUCCESS) {
+            throw std::runtime_error("failed to begin recording frame command buffer!");
         }
 
-        vkDeviceWaitIdle(device);
+        recordTextureStreams(commandBuffer);
+        populateFrameCommandBuffer(commandBuffer, static_cast<int>(imageIndex));
+
+        if (vkEndCommandBuffer(commandBuffer) != VK_SUCCESS) {
+            throw std::runtime_error("failed to record frame command buffer!");
+        }
     }
 
     void drawFrame() {
@@ -1722,9 +3086,13 @@ protected:
                             VK_TRUE, UINT64_MAX);
         }
         imagesInFlight[imageIndex] = inFlightFences[currentFrame];
+        readTimestamps(imageIndex);
 
         updateUniformBuffer(imageIndex);
 
+        recordFrameCommandBuffer(imageIndex);
+        VkCommandBuffer submitCommandBuffers[] = {frameCommandBuffers[currentFrame], commandBuffers[imageIndex]};
+
         VkSubmitInfo submitInfo{};
         submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
         VkSemaphore waitSemaphores[] = {imageAvailableSemaphores[currentFrame]};
@@ -1733,8 +3101,8 @@ protected:
         submitInfo.waitSemaphoreCount = 1;
         submitInfo.pWaitSemaphores = waitSemaphores;
         submitInfo.pWaitDstStageMask = waitStages;
-        submitInfo.commandBufferCount = 1;
-        submitInfo.pCommandBuffers = &commandBuffers[imageIndex];
+        submitInfo.commandBufferCount = 2;
+        submitInfo.pCommandBuffers = submitCommandBuffers;
         VkSemaphore signalSemaphores[] = {renderFinishedSemaphores[currentFrame]};
         submitInfo.signalSemaphoreCount = 1;
         submitInfo.pSignalSemaphores = signalSemaphores;
@@ -1745,6 +3113,7 @@ protected:
                           inFlightFences[currentFrame]) != VK_SUCCESS) {
             throw std::runtime_error("failed to submit draw command buffer!");
         }
+        timestampsWritten[imageIndex] = true;
 
         VkPresentInfoKHR presentInfo{};
         presentInfo.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
@@ -1765,6 +3134,11 @@ protected:
             recreateSwapChain();
         } else if (result != VK_SUCCESS) {
             throw std::runtime_error("failed to present swap chain image!");
+        } else if (commandBuffersDirty) {
+            vkDeviceWaitIdle(device);
+            vkFreeCommandBuffers(device, commandPool,
+                                 static_cast<uint32_t>(commandBuffers.size()), commandBuffers.data());
+            createCommandBuffers();
         }
 
         currentFrame = (currentFrame + 1) % MAX_FRAMES_IN_FLIGHT;
@@ -1791,10 +3165,13 @@ protected:
 
         createSwapChain();
         createImageViews();
+        applyAntiAliasing();
         createRenderPass();
         createColorResources();
         createDepthResources();
         createFramebuffers();
+        createGBufferResources();
+        createPostResources();
         createDescriptorPool();
 
         pipelinesAndDescriptorSetsInit();
@@ -1803,9 +3180,11 @@ protected:
     }
 
     virtual void cleanupSwapChain() {
-        vkDestroyImageView(device, colorImageView, nullptr);
-        vkDestroyImage(device, colorImage, nullptr);
-        vkFreeMemory(device, colorImageMemory, nullptr);
+        if (msaaSamples != VK_SAMPLE_COUNT_1_BIT) {
+            vkDestroyImageView(device, colorImageView, nullptr);
+            vkDestroyImage(device, colorImage, nullptr);
+            vkFreeMemory(device, colorImageMemory, nullptr);
+        }
 
         vkDestroyImageView(device, depthImageView, nullptr);
         vkDestroyImage(device, depthImage, nullptr);
@@ -1815,6 +3194,9 @@ protected:
             vkDestroyFramebuffer(device, swapChainFramebuffers[i], nullptr);
         }
 
+        cleanupGBufferResources();
+        cleanupPostResources();
+
         vkFreeCommandBuffers(device, commandPool,
                              static_cast<uint32_t>(commandBuffers.size()), commandBuffers.data());
 
@@ -1842,8 +3224,18 @@ protected:
             vkDestroyFence(device, inFlightFences[i], nullptr);
         }
 
+        cleanupTextureStreamResources();
+        cleanupMipmapResources();
+
+        if (timestampQueryPool != VK_NULL_HANDLE)
+            vkDestroyQueryPool(device, timestampQueryPool, nullptr);
         vkDestroyCommandPool(device, commandPool, nullptr);
 
+        for (auto &sampler: samplerCache) {
+            vkDestroySampler(device, sampler.second, nullptr);
+        }
+        samplerCache.clear();
+
         vkDestroyDevice(device, nullptr);
 
         DestroyDebugUtilsMessengerEXT(instance, debugMessenger, nullptr);
@@ -2434,25 +3826,21 @@ void VertexDescriptor::init(BaseProject *bp, std::vector<VertexBindingDescriptor
     Bindings = B;
     Layout = E;
 
-    Position.hasIt = false;
-    Position.offset = 0;
-    Normal.hasIt = false;
-    Normal.offset = 0;
-    UV.hasIt = false;
-    UV.offset = 0;
-    Color.hasIt = false;
-    Color.offset = 0;
-    Tangent.hasIt = false;
-    Tangent.offset = 0;
+    Position = {false, 0, VK_FORMAT_UNDEFINED};
+    Normal = {false, 0, VK_FORMAT_UNDEFINED};
+    UV = {false, 0, VK_FORMAT_UNDEFINED};
+    Color = {false, 0, VK_FORMAT_UNDEFINED};
+    Tangent = {false, 0, VK_FORMAT_UNDEFINED};
 
     if (B.size() == 1) {    // for now, read models only with every vertex information in a single binding
         for (int i = 0; i < E.size(); i++) {
             switch (E[i].usage) {
                 case VertexDescriptorElementUsage::POSITION:
-                    if (E[i].format == VK_FORMAT_R32G32B32_SFLOAT) {
-                        if (E[i].size == sizeof(glm::vec3)) {
-                            Position.hasIt = true;
-                            Position.offset = E[i].offset;
+                    // Compressed: 16-bit normalized, dequantized by the per-mesh Model::Dq
+                    if (E[i].format == VK_FORMAT_R32G32B32_SFLOAT || E[i].format == VK_FORMAT_R16G16B16A16_SNORM) {
+                        if (E[i].size == (E[i].format == VK_FORMAT_R32G32B32_SFLOAT ? sizeof(glm::vec3)
+                                                                                    : 4 * sizeof(int16_t))) {
+                            Position = {true, E[i].offset, E[i].format};
                         } else {
                             std::cout << "Vertex Position - wrong size\n";
                         }
@@ -2461,10 +3849,11 @@ void VertexDescriptor::init(BaseProject *bp, std::vector<VertexBindingDescriptor
                     }
                     break;
                 case VertexDescriptorElementUsage::NORMAL:
-                    if (E[i].format == VK_FORMAT_R32G32B32_SFLOAT) {
-                        if (E[i].size == sizeof(glm::vec3)) {
-                            Normal.hasIt = true;
-                            Normal.offset = E[i].offset;
+                    // Compressed: octahedral encoding in two 16-bit normalized components
+                    if (E[i].format == VK_FORMAT_R32G32B32_SFLOAT || E[i].format == VK_FORMAT_R16G16_SNORM) {
+                        if (E[i].size == (E[i].format == VK_FORMAT_R32G32B32_SFLOAT ? sizeof(glm::vec3)
+                                                                                    : 2 * sizeof(int16_t))) {
+                            Normal = {true, E[i].offset, E[i].format};
                         } else {
                             std::cout << "Vertex Normal - wrong size\n";
                         }
@@ -2473,10 +3862,10 @@ void VertexDescriptor::init(BaseProject *bp, std::vector<VertexBindingDescriptor
                     }
                     break;
                 case VertexDescriptorElementUsage::UV:
-                    if (E[i].format == VK_FORMAT_R32G32_SFLOAT) {
-                        if (E[i].size == sizeof(glm::vec2)) {
-                            UV.hasIt = true;
-                            UV.offset = E[i].offset;
+                    if (E[i].format == VK_FORMAT_R32G32_SFLOAT || E[i].format == VK_FORMAT_R16G16_SFLOAT) {
+                        if (E[i].size == (E[i].format == VK_FORMAT_R32G32_SFLOAT ? sizeof(glm::vec2)
+                                                                                 : 2 * sizeof(uint16_t))) {
+                            UV = {true, E[i].offset, E[i].format};
                         } else {
                             std::cout << "Vertex UV - wrong size\n";
                         }
@@ -2487,8 +3876,7 @@ void VertexDescriptor::init(BaseProject *bp, std::vector<VertexBindingDescriptor
                 case VertexDescriptorElementUsage::COLOR:
                     if (E[i].format == VK_FORMAT_R32G32B32_SFLOAT) {
                         if (E[i].size == sizeof(glm::vec3)) {
-                            Color.hasIt = true;
-                            Color.offset = E[i].offset;
+                            Color = {true, E[i].offset, E[i].format};
                         } else {
                             std::cout << "Vertex Color - wrong size\n";
                         }
@@ -2499,8 +3887,7 @@ void VertexDescriptor::init(BaseProject *bp, std::vector<VertexBindingDescriptor
                 case VertexDescriptorElementUsage::TANGENT:
                     if (E[i].format == VK_FORMAT_R32G32B32A32_SFLOAT) {
                         if (E[i].size == sizeof(glm::vec4)) {
-                            Tangent.hasIt = true;
-                            Tangent.offset = E[i].offset;
+                            Tangent = {true, E[i].offset, E[i].format};
                         } else {
                             std::cout << "Vertex Tangent - wrong size\n";
                         }
@@ -2545,6 +3932,173 @@ std::vector<VkVertexInputAttributeDescription> VertexDescriptor::getAttributeDes
 }
 
 
+/* MESH OPTIMIZATION */
+// Entries of the FIFO post-transform cache simulated by meshACMR and targeted by optimizeVertexCache
+const uint32_t VERTEX_CACHE_SIZE = 16;
+
+// Average cache miss ratio: transformed vertices per triangle with a FIFO post-transform cache (0.5 to 3)
+float meshACMR(const std::vector<uint32_t> &indices, size_t vertexCount, uint32_t cacheSize = VERTEX_CACHE_SIZE) {
+    if (indices.size() < 3)
+        return 0.0f;
+    std::vector<size_t> timestamps(vertexCount, 0);
+    size_t time = cacheSize + 1;
+    size_t misses = 0;
+    for (uint32_t v: indices) {
+        if (time - timestamps[v] > cacheSize) {
+            timestamps[v] = time++;
+            misses++;
+        }
+    }
+    return (float) misses / (float) (indices.size() / 3);
+}
+
+// Tipsify (Sander et al., "Fast Triangle Reordering for Vertex Locality and Reduced Overdraw"): fans the triangles
+// around the vertex most likely to still be in the cache
+void optimizeVertexCache(std::vector<uint32_t> &indices, size_t vertexCount, uint32_t cacheSize = VERTEX_CACHE_SIZE) {
+    size_t triangleCount = indices.size() / 3;
+    if (triangleCount == 0)
+        return;
+
+    std::vector<uint32_t> live(vertexCount, 0);
+    for (size_t i = 0; i < triangleCount * 3; i++)
+        live[indices[i]]++;
+    std::vector<uint32_t> adjOffset(vertexCount + 1, 0);
+    for (size_t v = 0; v < vertexCount; v++)
+        adjOffset[v + 1] = adjOffset[v] + live[v];
+    std::vector<uint32_t> adjacency(adjOffset[vertexCount]);
+    std::vector<uint32_t> fill(adjOffset.begin(), adjOffset.end() - 1);
+    for (size_t i = 0; i < triangleCount * 3; i++)
+        adjacency[fill[indices[i]]++] = (uint32_t) (i / 3);
+
+    std::vector<size_t> timestamps(vertexCount, 0);
+    std::vector<bool> emitted(triangleCount, false);
+    std::vector<uint32_t> deadEnd;
+    std::vector<uint32_t> candidates;
+    std::vector<uint32_t> result;
+    result.reserve(triangleCount * 3);
+    size_t time = cacheSize + 1;
+    size_t cursor = 0;
+    int64_t fanning = indices[0];
+
+    while (fanning >= 0) {
+        candidates.clear();
+        for (uint32_t a = adjOffset[fanning]; a < adjOffset[fanning + 1]; a++) {
+            uint32_t t = adjacency[a];
+            if (emitted[t])
+                continue;
+            for (int k = 0; k < 3; k++) {
+                uint32_t v = indices[3 * t + k];
+                result.push_back(v);
+                deadEnd.push_back(v);
+                candidates.push_back(v);
+                live[v]--;
+                if (time - timestamps[v] > cacheSize)
+                    timestamps[v] = time++;
+            }
+            emitted[t] = true;
+        }
+
+        // Prefer the candidate that stays in the cache while all its remaining triangles are emitted
+        fanning = -1;
+        int64_t best = -1;
+        for (uint32_t v: candidates) {
+            if (live[v] == 0)
+                continue;
+            int64_t priority = 0;
+            if (time - timestamps[v] + 2 * live[v] <= cacheSize)
+                priority = (int64_t) (time - timestamps[v]);
+            if (priority > best) {
+                best = priority;
+                fanning = v;
+            }
+        }
+        while (fanning < 0 && !deadEnd.empty()) {
+            uint32_t v = deadEnd.back();
+            deadEnd.pop_back();
+            if (live[v] > 0)
+                fanning = v;
+        }
+        while (fanning < 0 && cursor < vertexCount) {
+            if (live[cursor] > 0)
+                fanning = (int64_t) cursor;
+            cursor++;
+        }
+    }
+    result.insert(result.end(), indices.begin() + (long) (triangleCount * 3), indices.end());
+    indices = std::move(result);
+}
+
+// Stores the vertices in the order the indices first reference them, dropping the unreferenced ones
+void optimizeVertexFetch(std::vector<unsigned char> &vertices, std::vector<uint32_t> &indices, int stride) {
+    std::vector<uint32_t> remap(vertices.size() / stride, UINT32_MAX);
+    std::vector<unsigned char> ordered;
+    ordered.reserve(vertices.size());
+    uint32_t next = 0;
+    for (uint32_t &i: indices) {
+        if (remap[i] == UINT32_MAX) {
+            remap[i] = next++;
+            ordered.insert(ordered.end(), vertices.begin() + (long) i * stride, vertices.begin() + (long) (i + 1) * stride);
+        }
+        i = remap[i];
+    }
+    vertices = std::move(ordered);
+}
+
+// Quantized positions cover the bounding box of the mesh, so Dq is enough to bring them back
+void Model::setPositionBounds(glm::vec3 bmin, glm::vec3 bmax) {
+    if (!VD->Position.hasIt || VD->Position.format != VK_FORMAT_R16G16B16A16_SNORM || bmin.x > bmax.x) {
+        Dq = glm::mat4(1);
+        return;
+    }
+    Dq = glm::translate(glm::mat4(1), (bmin + bmax) * 0.5f) *
+         glm::scale(glm::mat4(1), glm::max((bmax - bmin) * 0.5f, glm::vec3(1e-6f)));
+}
+
+void Model::writePosition(unsigned char *vertex, glm::vec3 pos) const {
+    if (VD->Position.format == VK_FORMAT_R16G16B16A16_SNORM) {
+        glm::vec3 q = glm::clamp((pos - glm::vec3(Dq[3])) / glm::vec3(Dq[0][0], Dq[1][1], Dq[2][2]), -1.0f, 1.0f);
+        auto o = (uint32_t *) (vertex + VD->Position.offset);
+        o[0] = glm::packSnorm2x16(glm::vec2(q.x, q.y));
+        o[1] = glm::packSnorm2x16(glm::vec2(q.z, 0.0f));
+    } else {
+        *(glm::vec3 *) (vertex + VD->Position.offset) = pos;
+    }
+}
+
+void Model::writeNormal(unsigned char *vertex, glm::vec3 norm) const {
+    if (VD->Normal.format == VK_FORMAT_R16G16_SNORM) {
+        // Octahedral encoding: project on the octahedron, then fold the lower half over the upper one
+        glm::vec3 n = norm / glm::max(glm::abs(norm.x) + glm::abs(norm.y) + glm::abs(norm.z), 1e-12f);
+        glm::vec2 e(n.x, n.y);
+        if (n.z < 0.0f) {
+            e = (1.0f - glm::abs(glm::vec2(n.y, n.x))) *
+                glm::vec2(n.x >= 0.0f ? 1.0f : -1.0f, n.y >= 0.0f ? 1.0f : -1.0f);
+        }
+        *(uint32_t *) (vertex + VD->Normal.offset) = glm::packSnorm2x16(e);
+    } else {
+        *(glm::vec3 *) (vertex + VD->Normal.offset) = norm;
+    }
+}
+
+void Model::writeUV(unsigned char *vertex, glm::vec2 texCoord) const {
+    if (VD->UV.format == VK_FORMAT_R16G16_SFLOAT) {
+        *(uint32_t *) (vertex + VD->UV.offset) = glm::packHalf2x16(texCoord);
+    } else {
+        *(glm::vec2 *) (vertex + VD->UV.offset) = texCoord;
+    }
+}
+
+glm::vec3 Model::getPosition(size_t i) const {
+    const unsigned char *vertex = &vertices[i * VD->Bindings[0].stride];
+    if (VD->Position.format == VK_FORMAT_R16G16B16A16_SNORM) {
+        auto o = (const uint32_t *) (vertex + VD->Position.offset);
+        glm::vec2 xy = glm::unpackSnorm2x16(o[0]);
+        glm::vec2 z = glm::unpackSnorm2x16(o[1]);
+        return glm::vec3(Dq * glm::vec4(xy.x, xy.y, z.x, 1.0f));
+    }
+    return *(const glm::vec3 *) (vertex + VD->Position.offset);
+}
+
 void Model::loadModelOBJ(const std::string& file) {
     tinyobj::attrib_t attrib;
     std::vector<tinyobj::shape_t> shapes;
@@ -2562,55 +4116,176 @@ void Model::loadModelOBJ(const std::string& file) {
     //	std::cout << "UV " << VD->UV.hasIt << "," << VD->UV.offset << "\n";
     //	std::cout << "Normal " << VD->Normal.hasIt << "," << VD->Normal.offset << "\n";
     int mainStride = VD->Bindings[0].stride;
+    glm::vec3 bmin(std::numeric_limits<float>::max()), bmax(-std::numeric_limits<float>::max());
+    for (size_t v = 0; v + 2 < attrib.vertices.size(); v += 3) {
+        glm::vec3 pos(attrib.vertices[v], attrib.vertices[v + 1], attrib.vertices[v + 2]);
+        bmin = glm::min(bmin, pos);
+        bmax = glm::max(bmax, pos);
+    }
+    setPositionBounds(bmin, bmax);
+
+    // OBJ faces index position, normal and UV separately: corners with the same triple become one shared vertex
+    struct IndexHash {
+        size_t operator()(const std::tuple<int, int, int> &k) const {
+            return ((size_t) std::get<0>(k) * 73856093u) ^ ((size_t) std::get<1>(k) * 19349663u) ^
+                   ((size_t) std::get<2>(k) * 83492791u);
+        }
+    };
+    std::unordered_map<std::tuple<int, int, int>, uint32_t, IndexHash> welded;
+    size_t corners = 0;
+    for (const auto &shape: shapes)
+        corners += shape.mesh.indices.size();
+    welded.reserve(corners);
+    indices.reserve(corners);
+    vertices.reserve(attrib.vertices.size() / 3 * mainStride);
+
     for (const auto &shape: shapes) {
         for (const auto &index: shape.mesh.indices) {
-            std::vector<unsigned char> vertex(mainStride, 0);
+            auto key = std::make_tuple(index.vertex_index, index.normal_index, index.texcoord_index);
+            auto found = welded.find(key);
+            if (found != welded.end()) {
+                indices.push_back(found->second);
+                continue;
+            }
+            uint32_t id = (uint32_t) (vertices.size() / mainStride);
+            welded.emplace(key, id);
+            indices.push_back(id);
+            vertices.resize(vertices.size() + mainStride, 0);
+            unsigned char *vertex = &vertices[vertices.size() - mainStride];
+
             glm::vec3 pos = {
                     attrib.vertices[3 * index.vertex_index + 0],
                     attrib.vertices[3 * index.vertex_index + 1],
                     attrib.vertices[3 * index.vertex_index + 2]
             };
             if (VD->Position.hasIt) {
-                auto o = (glm::vec3 *) ((char *) (&vertex[0]) + VD->Position.offset);
-                *o = pos;
+                writePosition(vertex, pos);
             }
 
-            glm::vec3 color = {
-                    attrib.colors[3 * index.vertex_index + 0],
-                    attrib.colors[3 * index.vertex_index + 1],
-                    attrib.colors[3 * index.vertex_index + 2]
-            };
-            if (VD->Color.hasIt) {
-                auto o = (glm::vec3 *) ((char *) (&vertex[0]) + VD->Color.offset);
+            if (VD->Color.hasIt && !attrib.colors.empty()) {
+                glm::vec3 color = {
+                        attrib.colors[3 * index.vertex_index + 0],
+                        attrib.colors[3 * index.vertex_index + 1],
+                        attrib.colors[3 * index.vertex_index + 2]
+                };
+                auto o = (glm::vec3 *) (vertex + VD->Color.offset);
                 *o = color;
             }
 
-            glm::vec2 texCoord = {
-                    attrib.texcoords[2 * index.texcoord_index + 0],
-                    1 - attrib.texcoords[2 * index.texcoord_index + 1]
-            };
-            if (VD->UV.hasIt) {
-                auto o = (glm::vec2 *) ((char *) (&vertex[0]) + VD->UV.offset);
-                *o = texCoord;
+            if (VD->UV.hasIt && index.texcoord_index >= 0) {
+                glm::vec2 texCoord = {
+                        attrib.texcoords[2 * index.texcoord_index + 0],
+                        1 - attrib.texcoords[2 * index.texcoord_index + 1]
+                };
+                writeUV(vertex, texCoord);
             }
 
-            glm::vec3 norm = {
-                    attrib.normals[3 * index.normal_index + 0],
-                    attrib.normals[3 * index.normal_index + 1],
-                    attrib.normals[3 * index.normal_index + 2]
-            };
-            if (VD->Normal.hasIt) {
-                auto o = (glm::vec3 *) ((char *) (&vertex[0]) + VD->Normal.offset);
-                *o = norm;
+            if (VD->Normal.hasIt && index.normal_index >= 0) {
+                glm::vec3 norm = {
+                        attrib.normals[3 * index.normal_index + 0],
+                        attrib.normals[3 * index.normal_index + 1],
+                        attrib.normals[3 * index.normal_index + 2]
+                };
+                writeNormal(vertex, norm);
             }
-
-            vertices.insert(vertices.end(), vertex.begin(), vertex.end());
-            indices.push_back((vertices.size() / mainStride) - 1);
         }
     }
-    std::cout << "[OBJ] Vertices: " << (vertices.size() / mainStride);
-    std::cout << " Indices: " << indices.size() << "\n";
 
+    // ACMR of the file order of the welded triangles, before and after Tipsify
+    size_t vertexCount = vertices.size() / mainStride;
+    float acmrBefore = meshACMR(indices, vertexCount);
+    optimizeVertexCache(indices, vertexCount);
+    optimizeVertexFetch(vertices, indices, mainStride);
+    std::cout << "[OBJ] Vertices: " << (vertices.size() / mainStride) << " (" << corners << " before welding)";
+    std::cout << " Indices: " << indices.size();
+    std::cout << " ACMR: " << acmrBefore << " -> " << meshACMR(indices, vertices.size() / mainStride) << "\n";
+    subMeshes = {{0, (uint32_t) indices.size(), -1}};
+}
+
+// Float glTF attribute, read with the byteStride of its buffer view (tightly packed when it has none)
+struct GLTFAttribute {
+    const unsigned char *data = nullptr;
+    size_t stride = 0;
+    size_t count = 0;
+
+    template<typename T>
+    T get(size_t i) const {
+        T value;
+        memcpy(&value, data + i * stride, sizeof(T));
+        return value;
+    }
+};
+
+GLTFAttribute gltfAttribute(const tinygltf::Model &model, const tinygltf::Primitive &primitive, const std::string &name,
+                            int components) {
+    GLTFAttribute A{};
+    auto it = primitive.attributes.find(name);
+    if (it == primitive.attributes.end()) {
+        return A;
+    }
+    const tinygltf::Accessor &accessor = model.accessors[it->second];
+    if (accessor.bufferView < 0 || accessor.componentType != TINYGLTF_COMPONENT_TYPE_FLOAT ||
+        tinygltf::GetNumComponentsInType(accessor.type) != components) {
+        std::cout << "Warning: unsupported " << name << " accessor, ignored\n";
+        return A;
+    }
+    const tinygltf::BufferView &view = model.bufferViews[accessor.bufferView];
+    int stride = accessor.ByteStride(view);
+    if (stride <= 0) {
+        throw std::runtime_error("Invalid byteStride for glTF attribute " + name);
+    }
+    A.data = &model.buffers[view.buffer].data[accessor.byteOffset + view.byteOffset];
+    A.stride = stride;
+    A.count = accessor.count;
+    return A;
+}
+
+// Gathers an attribute into the interleaved vertices: the copy size is a constant, so each element is a single
+// (vector) load and store
+template<size_t size>
+void copyStrided(unsigned char *dst, size_t dstStride, const GLTFAttribute &src) {
+    const unsigned char *from = src.data;
+    for (size_t i = 0; i < src.count; i++, dst += dstStride, from += src.stride) {
+        memcpy(dst, from, size);
+    }
+}
+
+glm::mat4 gltfNodeTransform(const tinygltf::Node &node) {
+    if (node.matrix.size() == 16) {
+        glm::mat4 M;
+        for (int i = 0; i < 16; i++) {
+            M[i / 4][i % 4] = (float) node.matrix[i];
+        }
+        return M;
+    }
+    glm::vec3 T;
+    glm::vec3 S;
+    glm::quat Q;
+    if (!node.translation.empty()) {
+        T = glm::vec3(node.translation[0],
+                      node.translation[1],
+                      node.translation[2]);
+    } else {
+        T = glm::vec3(0);
+    }
+    if (!node.rotation.empty()) {
+        Q = glm::quat(node.rotation[3],
+                      node.rotation[0],
+                      node.rotation[1],
+                      node.rotation[2]);
+    } else {
+        Q = glm::quat(1.0f, 0.0f, 0.0f, 0.0f);
+    }
+    if (!node.scale.empty()) {
+        S = glm::vec3(node.scale[0],
+                      node.scale[1],
+                      node.scale[2]);
+    } else {
+        S = glm::vec3(1);
+    }
+    return glm::translate(glm::mat4(1), T) *
+           glm::mat4(Q) *
+           glm::scale(glm::mat4(1), S);
 }
 
 void Model::loadModelGLTF(const std::string& file, bool encoded) {
@@ -2622,252 +4297,220 @@ void Model::loadModelGLTF(const std::string& file, bool encoded) {
 
     std::cout << "Loading : " << file << (encoded ? "[MGCG]" : "[GLTF]") << "\n";
     if (encoded) {
-        auto modelString = readFile(file);
-
-        const std::vector<unsigned char> key = plusaes::key_from_string(&"CG2023SkelKey128"); // 16-char = 128-bit
-        const unsigned char iv[16] = {
-                0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
-                0x08, 0x09, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F,
-        };
+        auto payload = decodeMGCGFile(file);
+        bool binary = isGLB(payload.data(), payload.size());
+        std::cout << "[MGCG] Payload: " << payload.size() << " bytes " << (binary ? "(glb)" : "(gltf)") << "\n";
 
-        // decrypt
-        unsigned long padded_size = 0;
-        std::vector<unsigned char> decrypted(modelString.size());
-
-        plusaes::decrypt_cbc((unsigned char *) modelString.data(), modelString.size(), &key[0], key.size(), &iv,
-                             &decrypted[0], decrypted.size(), &padded_size);
-
-        int size = 0;
-        void *decomp;
-
-        sscanf(reinterpret_cast<char *const>(&decrypted[0]), "%d", &size);
-        //std::cout << decrypted.size() << ", decomp: " << size << "\n";
-        //for(int i=0;i<32;i++) {
-        //	std::cout << (int)decrypted[i] << "\n";
-        //}
-
-        decomp = calloc(size, 1);
-        int n = sinflate(decomp, (int) size, &decrypted[16], decrypted.size() - 16);
-
-        if (!loader.LoadASCIIFromString(&model, &warn, &err,
-                                        reinterpret_cast<const char *>(decomp), size, "/")) {
+        if (binary ? !loader.LoadBinaryFromMemory(&model, &err, &warn, payload.data(), payload.size(), "/")
+                   : !loader.LoadASCIIFromString(&model, &err, &warn,
+                                                 reinterpret_cast<const char *>(payload.data()), payload.size(), "/")) {
+            throw std::runtime_error(warn + err);
+        }
+    } else if (file.size() >= 4 && file.compare(file.size() - 4, 4, ".glb") == 0) {
+        if (!loader.LoadBinaryFromFile(&model, &err, &warn, file)) {
             throw std::runtime_error(warn + err);
         }
     } else {
-        if (!loader.LoadASCIIFromFile(&model, &warn, &err,
+        // External .bin buffers are resolved next to the .gltf
+        if (!loader.LoadASCIIFromFile(&model, &err, &warn,
                                       file)) {
             throw std::runtime_error(warn + err);
         }
     }
 
-    for (const auto &mesh: model.meshes) {
+    // Walk the scene graph: every node with a mesh instantiates all its primitives with its world transform
+    struct GLTFMeshNode {
+        int mesh;
+        glm::mat4 transform;
+    };
+    std::vector<GLTFMeshNode> meshNodes;
+    std::vector<std::pair<int, glm::mat4>> stack;
+    if (!model.scenes.empty()) {
+        const auto &scene = model.scenes[model.defaultScene >= 0 ? model.defaultScene : 0];
+        for (int n: scene.nodes)
+            stack.emplace_back(n, glm::mat4(1));
+    } else {
+        std::vector<bool> isChild(model.nodes.size(), false);
+        for (const auto &node: model.nodes)
+            for (int c: node.children)
+                isChild[c] = true;
+        for (int n = 0; n < model.nodes.size(); n++)
+            if (!isChild[n])
+                stack.emplace_back(n, glm::mat4(1));
+    }
+    std::reverse(stack.begin(), stack.end());
+    while (!stack.empty()) {
+        auto [n, parent] = stack.back();
+        stack.pop_back();
+        glm::mat4 world = parent * gltfNodeTransform(model.nodes[n]);
+        if (model.nodes[n].mesh >= 0)
+            meshNodes.push_back({model.nodes[n].mesh, world});
+        for (auto c = model.nodes[n].children.rbegin(); c != model.nodes[n].children.rend(); ++c)
+            stack.emplace_back(*c, world);
+    }
+    if (model.nodes.empty()) {
+        for (int m = 0; m < model.meshes.size(); m++)
+            meshNodes.push_back({m, glm::mat4(1)});
+    }
+
+    // A single mesh node keeps its transform in Wm, several get theirs baked into the vertices
+    bool bake = meshNodes.size() > 1;
+    Wm = (meshNodes.size() == 1) ? meshNodes[0].transform : glm::mat4(1);
+
+    // Size vertices and indices once for all the primitives, then fill them in place
+    struct GLTFPrimitive {
+        GLTFAttribute pos, norm, tan, uv;
+        const tinygltf::Accessor *indices;
+        size_t firstVertex, vertexCount, firstIndex;
+        int material;
+        bool baked;
+        glm::mat4 transform;
+    };
+    std::vector<GLTFPrimitive> primitives;
+    size_t vertexCount = 0, indexCount = 0;
+    glm::vec3 bmin(std::numeric_limits<float>::max()), bmax(-std::numeric_limits<float>::max());
+    for (const auto &meshNode: meshNodes) {
+        const auto &mesh = model.meshes[meshNode.mesh];
         std::cout << "Primitives: " << mesh.primitives.size() << "\n";
         for (const auto &primitive: mesh.primitives) {
             if (primitive.indices < 0) {
                 continue;
             }
+            if (primitive.mode != TINYGLTF_MODE_TRIANGLES && primitive.mode != -1) {
+                std::cout << "Warning: primitive mode " << primitive.mode << " not supported, skipped\n";
+                continue;
+            }
 
-            const float *bufferPos = nullptr;
-            const float *bufferNormals = nullptr;
-            const float *bufferTangents = nullptr;
-            const float *bufferTexCoords = nullptr;
-
-            bool meshHasPos = false;
-            bool meshHasNorm = false;
-            bool meshHasTan = false;
-            bool meshHasUV = false;
-
-            int cntPos = 0;
-            int cntNorm = 0;
-            int cntTan = 0;
-            int cntUV = 0;
-            int cntTot = 0;
-
-            auto pIt = primitive.attributes.find("POSITION");
-            if (pIt != primitive.attributes.end()) {
-                const tinygltf::Accessor &posAccessor = model.accessors[pIt->second];
-                const tinygltf::BufferView &posView = model.bufferViews[posAccessor.bufferView];
-                bufferPos = reinterpret_cast<const float *>(&(model.buffers[posView.buffer].data[
-                        posAccessor.byteOffset + posView.byteOffset]));
-                meshHasPos = true;
-                cntPos = posAccessor.count;
-                if (cntPos > cntTot) cntTot = cntPos;
-            } else {
-                if (VD->Position.hasIt) {
-                    std::cout << "Warning: vertex layout has position, but file hasn't\n";
-                }
+            GLTFPrimitive P{};
+            P.pos = gltfAttribute(model, primitive, "POSITION", 3);
+            P.norm = gltfAttribute(model, primitive, "NORMAL", 3);
+            P.tan = gltfAttribute(model, primitive, "TANGENT", 4);
+            P.uv = gltfAttribute(model, primitive, "TEXCOORD_0", 2);
+            if (!P.pos.data && VD->Position.hasIt) {
+                std::cout << "Warning: vertex layout has position, but file hasn't\n";
+            }
+            if (!P.norm.data && VD->Normal.hasIt) {
+                std::cout << "Warning: vertex layout has normal, but file hasn't\n";
+            }
+            if (!P.tan.data && VD->Tangent.hasIt) {
+                std::cout << "Warning: vertex layout has tangent, but file hasn't\n";
+            }
+            if (!P.uv.data && VD->UV.hasIt) {
+                std::cout << "Warning: vertex layout has UV, but file hasn't\n";
             }
 
-            auto nIt = primitive.attributes.find("NORMAL");
-            if (nIt != primitive.attributes.end()) {
-                const tinygltf::Accessor &normAccessor = model.accessors[nIt->second];
-                const tinygltf::BufferView &normView = model.bufferViews[normAccessor.bufferView];
-                bufferNormals = reinterpret_cast<const float *>(&(model.buffers[normView.buffer].data[
-                        normAccessor.byteOffset + normView.byteOffset]));
-                meshHasNorm = true;
-                cntNorm = normAccessor.count;
-                if (cntNorm > cntTot) cntTot = cntNorm;
-            } else {
-                if (VD->Normal.hasIt) {
-                    std::cout << "Warning: vertex layout has normal, but file hasn't\n";
-                }
+            P.indices = &model.accessors[primitive.indices];
+            P.firstVertex = vertexCount;
+            P.vertexCount = std::max(std::max(P.pos.count, P.norm.count), std::max(P.tan.count, P.uv.count));
+            P.firstIndex = indexCount;
+            P.material = primitive.material;
+            P.baked = bake;
+            P.transform = bake ? meshNode.transform : glm::mat4(1);
+            vertexCount += P.vertexCount;
+            indexCount += P.indices->count;
+
+            for (size_t i = 0; i < P.pos.count; i++) {
+                glm::vec3 pos = glm::vec3(P.transform * glm::vec4(P.pos.get<glm::vec3>(i), 1.0f));
+                bmin = glm::min(bmin, pos);
+                bmax = glm::max(bmax, pos);
             }
+            primitives.push_back(P);
+        }
+    }
+    setPositionBounds(bmin, bmax);
+
+    vertices.resize(vertexCount * mainStride, 0);
+    indices.resize(indexCount);
+    subMeshes.clear();
 
-            auto tIt = primitive.attributes.find("TANGENT");
-            if (tIt != primitive.attributes.end()) {
-                const tinygltf::Accessor &tanAccessor = model.accessors[tIt->second];
-                const tinygltf::BufferView &tanView = model.bufferViews[tanAccessor.bufferView];
-                bufferTangents = reinterpret_cast<const float *>(&(model.buffers[tanView.buffer].data[
-                        tanAccessor.byteOffset + tanView.byteOffset]));
-                meshHasTan = true;
-                cntTan = tanAccessor.count;
-                if (cntTan > cntTot) cntTot = cntTan;
+    for (const auto &P: primitives) {
+        unsigned char *base = &vertices[P.firstVertex * mainStride];
+        glm::mat3 normalTransform = glm::inverse(glm::transpose(glm::mat3(P.transform)));
+
+        if (P.pos.data && VD->Position.hasIt) {
+            if (!P.baked && VD->Position.format == VK_FORMAT_R32G32B32_SFLOAT) {
+                copyStrided<sizeof(glm::vec3)>(base + VD->Position.offset, mainStride, P.pos);
             } else {
-                if (VD->Tangent.hasIt) {
-                    std::cout << "Warning: vertex layout has tangent, but file hasn't\n";
+                for (size_t i = 0; i < P.pos.count; i++) {
+                    writePosition(base + i * mainStride,
+                                  glm::vec3(P.transform * glm::vec4(P.pos.get<glm::vec3>(i), 1.0f)));
                 }
             }
-
-            auto uIt = primitive.attributes.find("TEXCOORD_0");
-            if (uIt != primitive.attributes.end()) {
-                const tinygltf::Accessor &uvAccessor = model.accessors[uIt->second];
-                const tinygltf::BufferView &uvView = model.bufferViews[uvAccessor.bufferView];
-                bufferTexCoords = reinterpret_cast<const float *>(&(model.buffers[uvView.buffer].data[
-                        uvAccessor.byteOffset + uvView.byteOffset]));
-                meshHasUV = true;
-                cntUV = uvAccessor.count;
-                if (cntUV > cntTot) cntTot = cntUV;
+        }
+        if (P.norm.data && VD->Normal.hasIt) {
+            if (!P.baked && VD->Normal.format == VK_FORMAT_R32G32B32_SFLOAT) {
+                copyStrided<sizeof(glm::vec3)>(base + VD->Normal.offset, mainStride, P.norm);
             } else {
-                if (VD->UV.hasIt) {
-                    std::cout << "Warning: vertex layout has UV, but file hasn't\n";
+                for (size_t i = 0; i < P.norm.count; i++) {
+                    glm::vec3 normal = P.norm.get<glm::vec3>(i);
+                    writeNormal(base + i * mainStride, P.baked ? glm::normalize(normalTransform * normal) : normal);
                 }
             }
-
-            //std::cout << "making vertex array. Stride:" << mainStride << "\n";
-            for (int i = 0; i < cntTot; i++) {
-                std::vector<unsigned char> vertex(mainStride, 0);
-                //std::cout << vertices.size() << "," << vertex.size() << "," << &vertex << " " << &vertex[0] << " ";
-                //std::cout << i << "\n";
-
-                if ((i < cntPos) && meshHasPos && VD->Position.hasIt) {
-                    glm::vec3 pos = {
-                            bufferPos[3 * i + 0],
-                            bufferPos[3 * i + 1],
-                            bufferPos[3 * i + 2]
-                    };
-                    //std::cout << "Pos: " <<	VD->Position.offset << "\n";
-                    auto o = (glm::vec3 *) ((char *) (&vertex[0]) + VD->Position.offset);
-                    //std::cout << "at: " << o << "\n";
-                    *o = pos;
-                    //std::cout << "Copied: " << o->x << "\n";
-                }
-                if ((i < cntNorm) && meshHasNorm && VD->Normal.hasIt) {
-                    glm::vec3 normal = {
-                            bufferNormals[3 * i + 0],
-                            bufferNormals[3 * i + 1],
-                            bufferNormals[3 * i + 2]
-                    };
-                    //std::cout << "Nor: " <<	VD->Normal.offset << "\n";
-                    auto o = (glm::vec3 *) ((char *) (&vertex[0]) + VD->Normal.offset);
-                    *o = normal;
-                }
-
-                if ((i < cntTan) && meshHasTan && VD->Tangent.hasIt) {
-                    glm::vec4 tangent = {
-                            bufferTangents[4 * i + 0],
-                            bufferTangents[4 * i + 1],
-                            bufferTangents[4 * i + 2],
-                            bufferTangents[4 * i + 3]
-                    };
-                    //std::cout << "Tan: " <<	VD->Tangent.offset << "\n";
-                    auto o = (glm::vec4 *) ((char *) (&vertex[0]) + VD->Tangent.offset);
-                    *o = tangent;
+        }
+        if (P.tan.data && VD->Tangent.hasIt) {
+            if (!P.baked) {
+                copyStrided<sizeof(glm::vec4)>(base + VD->Tangent.offset, mainStride, P.tan);
+            } else {
+                for (size_t i = 0; i < P.tan.count; i++) {
+                    glm::vec4 tangent = P.tan.get<glm::vec4>(i);
+                    tangent = glm::vec4(glm::normalize(glm::mat3(P.transform) * glm::vec3(tangent)), tangent.w);
+                    memcpy(base + i * mainStride + VD->Tangent.offset, &tangent, sizeof(glm::vec4));
                 }
-
-                if ((i < cntUV) && meshHasUV && VD->UV.hasIt) {
-                    glm::vec2 texCoord = {
-                            bufferTexCoords[2 * i + 0],
-                            bufferTexCoords[2 * i + 1]
-                    };
-                    //std::cout << "UV : " <<	VD->UV.offset << "\n";
-                    auto o = (glm::vec2 *) ((char *) (&vertex[0]) + VD->UV.offset);
-                    *o = texCoord;
+            }
+        }
+        if (P.uv.data && VD->UV.hasIt) {
+            if (VD->UV.format == VK_FORMAT_R32G32_SFLOAT) {
+                copyStrided<sizeof(glm::vec2)>(base + VD->UV.offset, mainStride, P.uv);
+            } else {
+                for (size_t i = 0; i < P.uv.count; i++) {
+                    writeUV(base + i * mainStride, P.uv.get<glm::vec2>(i));
                 }
-
-                //std::cout << vertices.size() << "," << vertex.size() << " Inserting\n";
-                vertices.insert(vertices.end(), vertex.begin(), vertex.end());
-                //std::cout << vertices.size() << " Inserted\n";
             }
+        }
 
-            const tinygltf::Accessor &accessor = model.accessors[primitive.indices];
-            const tinygltf::BufferView &bufferView = model.bufferViews[accessor.bufferView];
-            const tinygltf::Buffer &buffer = model.buffers[bufferView.buffer];
-
-            switch (accessor.componentType) {
-                case TINYGLTF_PARAMETER_TYPE_UNSIGNED_SHORT: {
-                    const auto bufferIndex = reinterpret_cast<const uint16_t *>(&(buffer.data[accessor.byteOffset +
-                                                                                                   bufferView.byteOffset]));
-                    for (int i = 0; i < accessor.count; i++) {
-                        indices.push_back(bufferIndex[i]);
-                    }
+        // Every primitive indexes its own vertices, which now start at firstVertex
+        const tinygltf::BufferView &bufferView = model.bufferViews[P.indices->bufferView];
+        const unsigned char *bufferIndex = &model.buffers[bufferView.buffer].data[P.indices->byteOffset +
+                                                                                   bufferView.byteOffset];
+        uint32_t *dst = &indices[P.firstIndex];
+        auto firstVertex = (uint32_t) P.firstVertex;
+        switch (P.indices->componentType) {
+            case TINYGLTF_PARAMETER_TYPE_UNSIGNED_BYTE:
+                for (size_t i = 0; i < P.indices->count; i++) {
+                    dst[i] = firstVertex + bufferIndex[i];
                 }
-                    break;
-                case TINYGLTF_PARAMETER_TYPE_UNSIGNED_INT: {
-                    const auto bufferIndex = reinterpret_cast<const uint32_t *>(&(buffer.data[accessor.byteOffset +
-                                                                                                   bufferView.byteOffset]));
-                    for (int i = 0; i < accessor.count; i++) {
-                        indices.push_back(bufferIndex[i]);
-                    }
+                break;
+            case TINYGLTF_PARAMETER_TYPE_UNSIGNED_SHORT:
+                for (size_t i = 0; i < P.indices->count; i++) {
+                    uint16_t index;
+                    memcpy(&index, bufferIndex + i * sizeof(uint16_t), sizeof(uint16_t));
+                    dst[i] = firstVertex + index;
                 }
-                    break;
-                default:
-                    std::cerr << "Index component type " << accessor.componentType << " not supported!" << std::endl;
-                    throw std::runtime_error("Error loading GLTF component");
+                break;
+            case TINYGLTF_PARAMETER_TYPE_UNSIGNED_INT:
+                for (size_t i = 0; i < P.indices->count; i++) {
+                    uint32_t index;
+                    memcpy(&index, bufferIndex + i * sizeof(uint32_t), sizeof(uint32_t));
+                    dst[i] = firstVertex + index;
+                }
+                break;
+            default:
+                std::cerr << "Index component type " << P.indices->componentType << " not supported!" << std::endl;
+                throw std::runtime_error("Error loading GLTF component");
+        }
+        // A mirroring node transform turns the triangles inside out once baked
+        if (P.baked && glm::determinant(glm::mat3(P.transform)) < 0.0f) {
+            for (size_t i = 0; i + 2 < P.indices->count; i += 3) {
+                std::swap(dst[i + 1], dst[i + 2]);
             }
         }
+
+        subMeshes.push_back({(uint32_t) P.firstIndex, (uint32_t) P.indices->count, P.material});
     }
 
     std::cout << (encoded ? "[MGCG]" : "[GLTF]") << " Vertices: " << (vertices.size() / mainStride)
-              << " Indices: " << indices.size() << "\n";
-    /*
-	std::cout << model.nodes[0].translation.size() << "\n";
-	std::cout << model.nodes[0].rotation.size() << "\n";
-	std::cout << model.nodes[0].scale.size() << "\n";
-	*/
-    glm::vec3 T;
-    glm::vec3 S;
-    glm::quat Q;
-    if (!model.nodes[0].translation.empty()) {
-        //std::cout << "node " << i << " has T\n";
-        T = glm::vec3(model.nodes[0].translation[0],
-                      model.nodes[0].translation[1],
-                      model.nodes[0].translation[2]);
-    } else {
-        T = glm::vec3(0);
-    }
-    if (!model.nodes[0].rotation.empty()) {
-        //std::cout << "node " << i << " has Q\n";
-        Q = glm::quat(model.nodes[0].rotation[3],
-                      model.nodes[0].rotation[0],
-                      model.nodes[0].rotation[1],
-                      model.nodes[0].rotation[2]);
-    } else {
-        Q = glm::quat(1.0f, 0.0f, 0.0f, 0.0f);
-    }
-    if (!model.nodes[0].scale.empty()) {
-        //std::cout << "node " << i << " has S\n";
-        S = glm::vec3(model.nodes[0].scale[0],
-                      model.nodes[0].scale[1],
-                      model.nodes[0].scale[2]);
-    } else {
-        S = glm::vec3(1);
-    }
-    //printVec3("T",T);
-    //printQuat("Q",Q);
-    //printVec3("S",S);
-    Wm = glm::translate(glm::mat4(1), T) *
-         glm::mat4(Q) *
-         glm::scale(glm::mat4(1), S);
+              << " Indices: " << indices.size() << " Mesh nodes: " << meshNodes.size()
+              << (bake ? " (baked)" : "") << " Sub-meshes: " << subMeshes.size() << "\n";
 }
 
 void Model::createVertexBuffer() {
@@ -2886,7 +4529,10 @@ void Model::createVertexBuffer() {
 }
 
 void Model::createIndexBuffer() {
-    VkDeviceSize bufferSize = sizeof(indices[0]) * indices.size();
+    // Meshes that fit in 16 bits (all the dungeon ones) get half the index memory and bandwidth
+    int mainStride = VD->Bindings[0].stride;
+    indexType = (vertices.size() / mainStride <= 65536) ? VK_INDEX_TYPE_UINT16 : VK_INDEX_TYPE_UINT32;
+    VkDeviceSize bufferSize = indexBytes();
 
     BP->createBuffer(bufferSize, VK_BUFFER_USAGE_INDEX_BUFFER_BIT,
                      VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
@@ -2895,16 +4541,28 @@ void Model::createIndexBuffer() {
 
     void *data;
     vkMapMemory(BP->device, indexBufferMemory, 0, bufferSize, 0, &data);
-    memcpy(data, indices.data(), (size_t) bufferSize);
+    if (indexType == VK_INDEX_TYPE_UINT16) {
+        auto *data16 = (uint16_t *) data;
+        for (size_t i = 0; i < indices.size(); i++) {
+            data16[i] = (uint16_t) indices[i];
+        }
+    } else {
+        memcpy(data, indices.data(), (size_t) bufferSize);
+    }
     vkUnmapMemory(BP->device, indexBufferMemory);
 }
 
+VkDeviceSize Model::indexBytes() const {
+    return indices.size() * (indexType == VK_INDEX_TYPE_UINT16 ? sizeof(uint16_t) : sizeof(uint32_t));
+}
+
 void Model::initMesh(BaseProject *bp, VertexDescriptor *vd) {
     BP = bp;
     VD = vd;
     int mainStride = VD->Bindings[0].stride;
     std::cout << "[Manual] Vertices: " << (vertices.size() / mainStride)
               << " Indices: " << indices.size() << "\n";
+    subMeshes = {{0, (uint32_t) indices.size(), -1}};
     createVertexBuffer();
     createIndexBuffer();
     Wm = glm::mat4(1);
@@ -2940,12 +4598,16 @@ void Model::bind(VkCommandBuffer commandBuffer) {
     VkDeviceSize offsets[] = {0};
     vkCmdBindVertexBuffers(commandBuffer, 0, 1, vertexBuffers, offsets);
     // property .indexBuffer of models, contains the VkBuffer handle to its index buffer
-    vkCmdBindIndexBuffer(commandBuffer, indexBuffer, 0,
-                         VK_INDEX_TYPE_UINT32);
+    vkCmdBindIndexBuffer(commandBuffer, indexBuffer, 0, indexType);
+}
+
+void Model::drawSubMesh(VkCommandBuffer commandBuffer, size_t subMesh, uint32_t instanceCount) const {
+    vkCmdDrawIndexed(commandBuffer, subMeshes[subMesh].indexCount, instanceCount, subMeshes[subMesh].firstIndex, 0, 0);
 }
 
 
-void Texture::createTextureImage(std::vector<std::string> files, VkFormat Fmt = VK_FORMAT_R8G8B8A8_SRGB) {
+void Texture::createTextureImage(std::vector<std::string> files, VkFormat Fmt = VK_FORMAT_R8G8B8A8_SRGB,
+                                 bool stream = false) {
     int texWidth, texHeight, texChannels;
     int curWidth = -1, curHeight = -1, curChannels = -1;
     stbi_uc *pixels[maxImgs];
@@ -2978,9 +4640,15 @@ void Texture::createTextureImage(std::vector<std::string> files, VkFormat Fmt =
     mipLevels = static_cast<uint32_t>(std::floor(
             std::log2(std::max(texWidth, texHeight)))) + 1;
 
+    if (stream && BP->textureStreaming && imgs == 1 && std::max(texWidth, texHeight) > TEXTURE_STREAM_TAIL) {
+        createStreamedTextureImage(pixels[0], texWidth, texHeight, Fmt);
+        return;
+    }
+
     VkBuffer stagingBuffer;
     VkDeviceMemory stagingBufferMemory;
 
+    bool compute = mipLevels > 1 && BP->useComputeMipmaps(Fmt);
     BP->createBuffer(totalImageSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
                      VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
                      VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
@@ -3003,16 +4671,103 @@ void Texture::createTextureImage(std::vector<std::string> files, VkFormat Fmt =
 
     BP->transitionImageLayout(textureImage, Fmt,
                               VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, mipLevels, imgs);
-    BP->copyBufferToImage(stagingBuffer, textureImage,
-                          static_cast<uint32_t>(texWidth), static_cast<uint32_t>(texHeight), imgs);
 
-    BP->generateMipmaps(textureImage, Fmt,
-                        texWidth, texHeight, mipLevels, imgs);
+    auto mipmapStart = std::chrono::high_resolution_clock::now();
+    if (compute) {
+        BP->generateMipmapsCompute(stagingBuffer, textureImage, Fmt, texWidth, texHeight, mipLevels, imgs);
+    } else {
+        BP->copyBufferToImage(stagingBuffer, textureImage,
+                              static_cast<uint32_t>(texWidth), static_cast<uint32_t>(texHeight), imgs);
+
+        BP->generateMipmaps(textureImage, Fmt,
+                            texWidth, texHeight, mipLevels, imgs);
+    }
+    std::cout << "    upload + " << mipLevels << " mips (" << mipmapGeneratorNames[compute ? MIPMAP_COMPUTE : MIPMAP_BLIT]
+              << "): " << std::chrono::duration<float, std::milli>(
+            std::chrono::high_resolution_clock::now() - mipmapStart).count() << " ms\n";
 
     vkDestroyBuffer(BP->device, stagingBuffer, nullptr);
     vkFreeMemory(BP->device, stagingBufferMemory, nullptr);
 }
 
+// Box filter; the colour of sRGB textures is averaged in linear space, as the blit of generateMipmaps does.
+// Both conversions are table lookups, the linear to sRGB one over 4096 steps (less than one 8-bit step of error).
+void Texture::downsampleMip(const std::vector<stbi_uc> &src, int width, int height, std::vector<stbi_uc> &dst,
+                            bool srgb) {
+    static const std::array<float, 256> toLinear = [] {
+        std::array<float, 256> table{};
+        for (int i = 0; i < 256; i++) {
+            float c = (float) i / 255.0f;
+            table[i] = c <= 0.04045f ? c / 12.92f : std::pow((c + 0.055f) / 1.055f, 2.4f);
+        }
+        return table;
+    }();
+    static const std::array<stbi_uc, 4096> toSrgb = [] {
+        std::array<stbi_uc, 4096> table{};
+        for (int i = 0; i < 4096; i++) {
+            float l = (float) i / 4095.0f;
+            float e = l <= 0.0031308f ? l * 12.92f : 1.055f * std::pow(l, 1.0f / 2.4f) - 0.055f;
+            table[i] = (stbi_uc) std::lround(std::clamp(e, 0.0f, 1.0f) * 255.0f);
+        }
+        return table;
+    }();
+
+    int dstWidth = std::max(width / 2, 1), dstHeight = std::max(height / 2, 1);
+    dst.resize((size_t) dstWidth * dstHeight * 4);
+    for (int y = 0; y < dstHeight; y++) {
+        int y0 = std::min(y * 2, height - 1), y1 = std::min(y * 2 + 1, height - 1);
+        for (int x = 0; x < dstWidth; x++) {
+            int x0 = std::min(x * 2, width - 1), x1 = std::min(x * 2 + 1, width - 1);
+            const stbi_uc *p[4] = {&src[((size_t) y0 * width + x0) * 4], &src[((size_t) y0 * width + x1) * 4],
+                                   &src[((size_t) y1 * width + x0) * 4], &src[((size_t) y1 * width + x1) * 4]};
+            stbi_uc *out = &dst[((size_t) y * dstWidth + x) * 4];
+            for (int c = 0; c < 4; c++) {
+                if (srgb && c < 3) {
+                    float l = 0.25f * (toLinear[p[0][c]] + toLinear[p[1][c]] + toLinear[p[2][c]] + toLinear[p[3][c]]);
+                    out[c] = toSrgb[(size_t) (l * 4095.0f + 0.5f)];
+                } else {
+                    out[c] = (stbi_uc) ((p[0][c] + p[1][c] + p[2][c] + p[3][c] + 2) / 4);
+                }
+            }
+        }
+    }
+}
+
+// Runs on a worker thread, which also takes ownership of the decoded pixels
+std::vector<std::vector<stbi_uc>> Texture::buildMipChain(stbi_uc *pixels, int texWidth, int texHeight,
+                                                         uint32_t mipLevels, bool srgb) {
+    std::vector<std::vector<stbi_uc>> levels(mipLevels);
+    levels[0].assign(pixels, pixels + (size_t) texWidth * texHeight * 4);
+    stbi_image_free(pixels);
+    for (uint32_t i = 1; i < mipLevels; i++) {
+        downsampleMip(levels[i - 1], std::max(texWidth >> (i - 1), 1), std::max(texHeight >> (i - 1), 1),
+                      levels[i], srgb);
+    }
+    return levels;
+}
+
+// Only the image is created here: BaseProject::recordTextureStreams clears it in the next frame and uploads the mips
+// once the worker thread has built them, so the texture is usable right away and loading never waits for filtering.
+void Texture::createStreamedTextureImage(stbi_uc *pixels, int texWidth, int texHeight, VkFormat Fmt) {
+    BP->createImage(texWidth, texHeight, mipLevels, 1, VK_SAMPLE_COUNT_1_BIT, Fmt,
+                    VK_IMAGE_TILING_OPTIMAL, VK_IMAGE_USAGE_TRANSFER_SRC_BIT |
+                                             VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
+                    0, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, textureImage, textureImageMemory);
+
+    uint32_t tail = 1;
+    while (std::max(texWidth >> tail, texHeight >> tail) > TEXTURE_STREAM_TAIL)
+        tail++;
+
+    VkFormatProperties formatProperties;
+    vkGetPhysicalDeviceFormatProperties(BP->physicalDevice, Fmt, &formatProperties);
+    bool linearBlit = formatProperties.optimalTilingFeatures & VK_FORMAT_FEATURE_SAMPLED_IMAGE_FILTER_LINEAR_BIT;
+
+    auto chain = std::async(std::launch::async, buildMipChain, pixels, texWidth, texHeight, mipLevels,
+                            Fmt == VK_FORMAT_R8G8B8A8_SRGB);
+    BP->queueTextureStream({this, texWidth, texHeight, tail, linearBlit, false, mipLevels - 1, 0, std::move(chain),
+                            {}});
+}
+
 void Texture::createTextureImageView(VkFormat Fmt = VK_FORMAT_R8G8B8A8_SRGB) {
     textureImageView = BP->createImageView(textureImage,
                                            Fmt,
@@ -3022,7 +4777,8 @@ void Texture::createTextureImageView(VkFormat Fmt = VK_FORMAT_R8G8B8A8_SRGB) {
                                            imgs);
 }
 
-void Texture::createTextureSampler(
+// maxLod -1 := no clamp, the image view already limits the sampled levels to the mips of the texture.
+VkSamplerCreateInfo Texture::samplerInfo(
         VkFilter magFilter = VK_FILTER_LINEAR,
         VkFilter minFilter = VK_FILTER_LINEAR,
         VkSamplerAddressMode addressModeU = VK_SAMPLER_ADDRESS_MODE_REPEAT,
@@ -3048,21 +4804,30 @@ void Texture::createTextureSampler(
     samplerInfo.mipmapMode = mipmapMode;
     samplerInfo.mipLodBias = 0.0f;
     samplerInfo.minLod = 0.0f;
-    samplerInfo.maxLod = ((maxLod == -1) ? static_cast<float>(mipLevels) : maxLod);
+    samplerInfo.maxLod = ((maxLod == -1) ? VK_LOD_CLAMP_NONE : maxLod);
+    return samplerInfo;
+}
 
-    VkResult result = vkCreateSampler(BP->device, &samplerInfo, nullptr,
-                                      &textureSampler);
-    if (result != VK_SUCCESS) {
-        PrintVkError(result);
-        throw std::runtime_error("failed to create texture sampler!");
-    }
+void Texture::createTextureSampler(
+        VkFilter magFilter = VK_FILTER_LINEAR,
+        VkFilter minFilter = VK_FILTER_LINEAR,
+        VkSamplerAddressMode addressModeU = VK_SAMPLER_ADDRESS_MODE_REPEAT,
+        VkSamplerAddressMode addressModeV = VK_SAMPLER_ADDRESS_MODE_REPEAT,
+        VkSamplerMipmapMode mipmapMode = VK_SAMPLER_MIPMAP_MODE_LINEAR,
+        VkBool32 anisotropyEnable = VK_TRUE,
+        float maxAnisotropy = 16,
+        float maxLod = -1
+) {
+    textureSampler = BP->getSampler(samplerInfo(magFilter, minFilter, addressModeU, addressModeV, mipmapMode,
+                                                anisotropyEnable, maxAnisotropy, maxLod));
 }
 
 
-void Texture::init(BaseProject *bp, std::string file, VkFormat Fmt = VK_FORMAT_R8G8B8A8_SRGB, bool initSampler = true) {
+void Texture::init(BaseProject *bp, std::string file, VkFormat Fmt = VK_FORMAT_R8G8B8A8_SRGB, bool initSampler = true,
+                   bool stream = false) {
     BP = bp;
     imgs = 1;
-    createTextureImage({std::move(file)}, Fmt);
+    createTextureImage({std::move(file)}, Fmt, stream);
     createTextureImageView(Fmt);
     if (initSampler) {
         createTextureSampler();
@@ -3083,8 +4848,9 @@ void Texture::initCubic(BaseProject *bp, const std::vector<std::string>& files,
 }
 
 
+// The sampler belongs to the sampler cache of BaseProject.
 void Texture::cleanup() const {
-    vkDestroySampler(BP->device, textureSampler, nullptr);
+    BP->cancelTextureStream(this);
     vkDestroyImageView(BP->device, textureImageView, nullptr);
     vkDestroyImage(BP->device, textureImage, nullptr);
     vkFreeMemory(BP->device, textureImageMemory, nullptr);
@@ -3113,6 +4879,11 @@ void Pipeline::init(BaseProject *bp, VertexDescriptor *vd,
     polyModel = VK_POLYGON_MODE_FILL;
     CM = VK_CULL_MODE_BACK_BIT;
     transp = false;
+    gBuffer = false;
+    colorWrite = true;
+    depthWrite = true;
+    pushConstantStages = 0;
+    pushConstantSize = 0;
 
     D = d;
 }
@@ -3127,6 +4898,23 @@ void Pipeline::setAdvancedFeatures(VkCompareOp _compareOp,
     transp = _transp;
 }
 
+// G-buffer pipelines draw into the single-sampled G-buffer pass instead of the main one.
+void Pipeline::setGBuffer(bool _gBuffer) {
+    gBuffer = _gBuffer;
+}
+
+// Depth pre-pass: the depth-only pipeline masks the colour, the shading one tests EQUAL without writing depth.
+void Pipeline::setWriteMask(bool _colorWrite, bool _depthWrite) {
+    colorWrite = _colorWrite;
+    depthWrite = _depthWrite;
+}
+
+// A single push constant range at offset 0, written per draw by the scene (see InstancePushConstant).
+void Pipeline::setPushConstants(VkShaderStageFlags _stages, uint32_t _size) {
+    pushConstantStages = _stages;
+    pushConstantSize = _size;
+}
+
 
 void Pipeline::create() {
     VkPipelineShaderStageCreateInfo vertShaderStageInfo{};
@@ -3202,15 +4990,16 @@ void Pipeline::create() {
     VkPipelineMultisampleStateCreateInfo multisampling{};
     multisampling.sType =
             VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO;
-    multisampling.sampleShadingEnable = VK_TRUE;
-    multisampling.rasterizationSamples = BP->msaaSamples;
+    // Shaded once per pixel: MSAA only adds coverage and depth samples
+    multisampling.sampleShadingEnable = VK_FALSE;
+    multisampling.rasterizationSamples = gBuffer ? VK_SAMPLE_COUNT_1_BIT : BP->msaaSamples;
     multisampling.minSampleShading = 1.0f; // Optional
     multisampling.pSampleMask = nullptr; // Optional
     multisampling.alphaToCoverageEnable = VK_FALSE; // Optional
     multisampling.alphaToOneEnable = VK_FALSE; // Optional
 
     VkPipelineColorBlendAttachmentState colorBlendAttachment{};
-    colorBlendAttachment.colorWriteMask =
+    colorBlendAttachment.colorWriteMask = !colorWrite ? 0 :
             VK_COLOR_COMPONENT_R_BIT |
             VK_COLOR_COMPONENT_G_BIT |
             VK_COLOR_COMPONENT_B_BIT |
@@ -3234,8 +5023,10 @@ void Pipeline::create() {
             VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO;
     colorBlending.logicOpEnable = VK_FALSE;
     colorBlending.logicOp = VK_LOGIC_OP_COPY; // Optional
-    colorBlending.attachmentCount = 1;
-    colorBlending.pAttachments = &colorBlendAttachment;
+    std::vector<VkPipelineColorBlendAttachmentState> colorBlendAttachments(
+            gBuffer ? GBUFFER_COLOR_ATTACHMENTS : 1, colorBlendAttachment);
+    colorBlending.attachmentCount = static_cast<uint32_t>(colorBlendAttachments.size());
+    colorBlending.pAttachments = colorBlendAttachments.data();
     colorBlending.blendConstants[0] = 0.0f; // Optional
     colorBlending.blendConstants[1] = 0.0f; // Optional
     colorBlending.blendConstants[2] = 0.0f; // Optional
@@ -3251,8 +5042,13 @@ void Pipeline::create() {
             VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
     pipelineLayoutInfo.setLayoutCount = DSL.size();
     pipelineLayoutInfo.pSetLayouts = DSL.data();
-    pipelineLayoutInfo.pushConstantRangeCount = 0; // Optional
-    pipelineLayoutInfo.pPushConstantRanges = nullptr; // Optional
+
+    VkPushConstantRange pushConstantRange{};
+    pushConstantRange.stageFlags = pushConstantStages;
+    pushConstantRange.offset = 0;
+    pushConstantRange.size = pushConstantSize;
+    pipelineLayoutInfo.pushConstantRangeCount = pushConstantSize > 0 ? 1 : 0;
+    pipelineLayoutInfo.pPushConstantRanges = pushConstantSize > 0 ? &pushConstantRange : nullptr;
 
     VkResult result = vkCreatePipelineLayout(BP->device, &pipelineLayoutInfo, nullptr,
                                              &pipelineLayout);
@@ -3265,7 +5061,7 @@ void Pipeline::create() {
     depthStencil.sType =
             VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO;
     depthStencil.depthTestEnable = VK_TRUE;
-    depthStencil.depthWriteEnable = VK_TRUE;
+    depthStencil.depthWriteEnable = depthWrite ? VK_TRUE : VK_FALSE;
     depthStencil.depthCompareOp = compareOp;
     depthStencil.depthBoundsTestEnable = VK_FALSE;
     depthStencil.minDepthBounds = 0.0f; // Optional
@@ -3288,7 +5084,7 @@ void Pipeline::create() {
     pipelineInfo.pColorBlendState = &colorBlending;
     pipelineInfo.pDynamicState = nullptr; // Optional
     pipelineInfo.layout = pipelineLayout;
-    pipelineInfo.renderPass = BP->renderPass;
+    pipelineInfo.renderPass = gBuffer ? BP->gBufferPass : BP->renderPass;
     pipelineInfo.subpass = 0;
     pipelineInfo.basePipelineHandle = VK_NULL_HANDLE; // Optional
     pipelineInfo.basePipelineIndex = -1; // Optional
@@ -3337,28 +5133,48 @@ void Pipeline::cleanup() const {
     vkDestroyPipelineLayout(BP->device, pipelineLayout, nullptr);
 }
 
-void DescriptorSetLayout::init(BaseProject *bp, std::vector<DescriptorSetLayoutBinding> B) {
+void DescriptorSetLayout::init(BaseProject *bp, std::vector<DescriptorSetLayoutBinding> B, bool _shared = false) {
     BP = bp;
     Bindings = B;
     imgInfoSize = 0;
+    shared = _shared;
 
     std::vector<VkDescriptorSetLayoutBinding> binds;
+    std::vector<VkDescriptorBindingFlagsEXT> bindFlags;
+    std::vector<std::vector<VkSampler>> immutableSamplers;
     binds.resize(B.size());
+    bindFlags.resize(B.size());
+    immutableSamplers.resize(B.size());
     for (int i = 0; i < B.size(); i++) {
         binds[i].binding = B[i].binding;
         binds[i].descriptorType = B[i].type;
         binds[i].descriptorCount = B[i].count;
         binds[i].stageFlags = B[i].flags;
         binds[i].pImmutableSamplers = nullptr;
+        if (B[i].immutableSampler != VK_NULL_HANDLE) {
+            immutableSamplers[i].assign(B[i].count, B[i].immutableSampler);
+            binds[i].pImmutableSamplers = immutableSamplers[i].data();
+        }
         if ((B[i].type == VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER) && (B[i].linkSize + B[i].count > imgInfoSize)) {
             imgInfoSize = B[i].linkSize + B[i].count;
         }
+        // Texture arrays only get the textures the scene has
+        bindFlags[i] = B[i].type == VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER && B[i].count > 1 ?
+                       VK_DESCRIPTOR_BINDING_PARTIALLY_BOUND_BIT_EXT : 0;
     }
 
+    VkDescriptorSetLayoutBindingFlagsCreateInfoEXT bindFlagsInfo{};
+    bindFlagsInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_BINDING_FLAGS_CREATE_INFO_EXT;
+    bindFlagsInfo.bindingCount = static_cast<uint32_t>(bindFlags.size());
+    bindFlagsInfo.pBindingFlags = bindFlags.data();
+
     VkDescriptorSetLayoutCreateInfo layoutInfo{};
     layoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
     layoutInfo.bindingCount = static_cast<uint32_t>(binds.size());;
     layoutInfo.pBindings = binds.data();
+    if (BP->descriptorIndexing) {
+        layoutInfo.pNext = &bindFlagsInfo;
+    }
 
     VkResult result = vkCreateDescriptorSetLayout(BP->device, &layoutInfo,
                                                   nullptr, &descriptorSetLayout);
@@ -3390,11 +5206,14 @@ void DescriptorSet::init(BaseProject *bp, DescriptorSetLayout *DSL,
         uniformBuffers[j].resize(BP->swapChainImages.size());
         uniformBuffersMemory[j].resize(BP->swapChainImages.size());
         //std::cout << j << " " << E[j].type << "\n";
-        if (DSL->Bindings[j].type == VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER) {
+        if (DSL->Bindings[j].type == VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER ||
+            DSL->Bindings[j].type == VK_DESCRIPTOR_TYPE_STORAGE_BUFFER) {
             //std::cout << "Uniform size: " << E[j].size << "\n";
+            VkBufferUsageFlags usage = DSL->Bindings[j].type == VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER ?
+                                       VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT : VK_BUFFER_USAGE_STORAGE_BUFFER_BIT;
             for (size_t i = 0; i < BP->swapChainImages.size(); i++) {
                 VkDeviceSize bufferSize = DSL->Bindings[j].linkSize;
-                BP->createBuffer(bufferSize, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
+                BP->createBuffer(bufferSize, usage,
                                  VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
                                  VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
                                  uniformBuffers[j][i], uniformBuffersMemory[j][i]);
@@ -3427,7 +5246,8 @@ void DescriptorSet::init(BaseProject *bp, DescriptorSetLayout *DSL,
         std::vector<VkDescriptorBufferInfo> bufferInfo(size);
         std::vector<VkDescriptorImageInfo> imageInfo(imgInfoSize);
         for (int j = 0; j < size; j++) {
-            if (DSL->Bindings[j].type == VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER) {
+            if (DSL->Bindings[j].type == VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER ||
+                DSL->Bindings[j].type == VK_DESCRIPTOR_TYPE_STORAGE_BUFFER) {
                 bufferInfo[j].buffer = uniformBuffers[j][i];
                 bufferInfo[j].offset = 0;
                 bufferInfo[j].range = DSL->Bindings[j].linkSize;
@@ -3436,13 +5256,23 @@ void DescriptorSet::init(BaseProject *bp, DescriptorSetLayout *DSL,
                 descriptorWrites[j].dstSet = descriptorSets[i];
                 descriptorWrites[j].dstBinding = DSL->Bindings[j].binding;
                 descriptorWrites[j].dstArrayElement = 0;
-                descriptorWrites[j].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+                descriptorWrites[j].descriptorType = DSL->Bindings[j].type;
                 descriptorWrites[j].descriptorCount = DSL->Bindings[j].count;
                 descriptorWrites[j].pBufferInfo = &bufferInfo[j];
             } else if (DSL->Bindings[j].type == VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER) {
-                for (int k = 0; k < DSL->Bindings[j].count; k++) {
+                // An array binding can be given fewer textures than its size: the rest of the slots are left
+                // unwritten when partially bound, or else filled with the first texture
+                int count = DSL->Bindings[j].count;
+                int available = std::min(count, (int) Txs.size() - DSL->Bindings[j].linkSize);
+                if (available <= 0) {
+                    throw std::runtime_error("failed to find a texture for the descriptor set!");
+                }
+                if (BP->descriptorIndexing) {
+                    count = available;
+                }
+                for (int k = 0; k < count; k++) {
                     int h = DSL->Bindings[j].linkSize + k;
-                    Texture *Tx = Txs[h];
+                    Texture *Tx = Txs[k < available ? h : DSL->Bindings[j].linkSize];
                     imageInfo[h].imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
                     imageInfo[h].imageView = Tx->textureImageView;
                     imageInfo[h].sampler = Tx->textureSampler;
@@ -3454,7 +5284,7 @@ void DescriptorSet::init(BaseProject *bp, DescriptorSetLayout *DSL,
                 descriptorWrites[j].dstArrayElement = 0;
                 descriptorWrites[j].descriptorType =
                         VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
-                descriptorWrites[j].descriptorCount = DSL->Bindings[j].count;
+                descriptorWrites[j].descriptorCount = count;
                 descriptorWrites[j].pImageInfo = &imageInfo[DSL->Bindings[j].linkSize];
             }
         }
@@ -3484,10 +5314,16 @@ void DescriptorSet::bind(VkCommandBuffer commandBuffer, Pipeline &P, int setId,
                             0, nullptr);
 }
 
-void DescriptorSet::map(int currentImage, void *src, int slot) {
+void DescriptorSet::map(int currentImage, void *src, int slot, int size = -1) {
     void *data;
 
-    int size = Layout->Bindings[slot].linkSize;
+    // Storage buffers are sized for their capacity: copy only the part in use.
+    if (size < 0 || size > Layout->Bindings[slot].linkSize) {
+        size = Layout->Bindings[slot].linkSize;
+    }
+    if (size == 0) {
+        return;
+    }
 
     vkMapMemory(BP->device, uniformBuffersMemory[slot][currentImage], 0,
                 size, 0, &data);
@@ -0,0 +1,242 @@
+#version 450
+#extension GL_ARB_separate_shader_objects : enable
+
+
+// Keep in sync with modules/LightGrid.hpp, modules/ShadowAtlas.hpp and GBuffer*.frag.
+const uint CLUSTER_X = 16;
+const uint CLUSTER_Y = 12;
+const uint CLUSTER_Z = 8;
+const float LIGHT_CUTOFF = 0.002;
+
+const uint LIGHT_DIRECT = 0;
+const uint LIGHT_POINT = 1;
+const uint LIGHT_SPOT = 2;
+const uint LIGHT_SHADOW_SHIFT = 8;
+
+const uint MATERIAL_PHONG = 0;
+const uint MATERIAL_TOON = 1;
+const uint MATERIAL_SPECULAR = 2;
+
+const uint SHADOW_TILES_PER_ROW = 8;
+const uint SHADOW_TILES = SHADOW_TILES_PER_ROW * SHADOW_TILES_PER_ROW;
+const float SHADOW_TILE_SIZE = 512.0;
+
+struct Light {
+	vec3 lightPos;
+	uint TYPE;
+	uint lightDir; // Octahedral, 2 x snorm16.
+	float lightPow;
+	uvec2 lightCol; // 4 x half: rgb + decay distance.
+};
+
+layout(set = 0, binding = 0) uniform LightUBO {
+	vec3 eyeDir;
+	vec4 clusterScale;
+	float cosIn;
+	float cosOut;
+	uint NUMBER;
+	uint GLOBAL;
+	mat4 invViewPrj;
+} lubo;
+
+layout(std430, set = 0, binding = 1) readonly buffer LightSSBO {
+	Light lights[];
+} lssbo;
+
+layout(std430, set = 0, binding = 2) readonly buffer ClusterSSBO {
+	uvec2 clusters[CLUSTER_X * CLUSTER_Y * CLUSTER_Z];
+	uint indices[];
+} cssbo;
+
+layout(set = 0, binding = 3) uniform ShadowUBO {
+	mat4 tileVP[SHADOW_TILES];
+} subo;
+
+layout(set = 0, binding = 4) uniform sampler2DShadow shadowMap;
+
+layout(set = 1, binding = 0) uniform sampler2D gAlbedo;
+layout(set = 1, binding = 1) uniform sampler2D gNormal;
+layout(set = 1, binding = 2) uniform sampler2D gDepth;
+
+
+layout(location = 0) out vec4 outColor;
+
+
+vec3 lightDir(uint idx) {
+	vec2 e = unpackSnorm2x16(lssbo.lights[idx].lightDir);
+	vec3 v = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+	float t = max(-v.z, 0.0);
+	v.xy += vec2(v.x >= 0.0 ? -t : t, v.y >= 0.0 ? -t : t);
+	return normalize(v);
+}
+
+vec4 lightCol(uint idx) {
+	return vec4(unpackHalf2x16(lssbo.lights[idx].lightCol.x), unpackHalf2x16(lssbo.lights[idx].lightCol.y));
+}
+
+vec3 directDir(uint idx) {
+	return -lightDir(idx);
+}
+
+vec3 directCol(uint idx) {
+	return lightCol(idx).rgb;
+}
+
+vec3 pointDir(uint idx, vec3 fragmentPos) {
+	return normalize(lssbo.lights[idx].lightPos - fragmentPos);
+}
+
+// Fades point and spot lights to zero at the radius used to bin them into the clusters.
+float rangeWindow(uint idx, vec3 fragmentPos) {
+	vec3 d = lssbo.lights[idx].lightPos - fragmentPos;
+	float g = lightCol(idx).a;
+	float r2 = max(g * g * lssbo.lights[idx].lightPow / LIGHT_CUTOFF, 1e-4);
+	float f = clamp(1.0 - (dot(d, d) / r2) * (dot(d, d) / r2), 0.0, 1.0);
+	return f * f;
+}
+
+vec3 pointCol(uint idx, vec3 fragmentPos) {
+	vec4 col = lightCol(idx);
+	return rangeWindow(idx, fragmentPos) * pow(col.a / length(lssbo.lights[idx].lightPos - fragmentPos), 2.0) * col.rgb;
+}
+
+vec3 spotDir(uint idx, vec3 fragmentPos) {
+	return pointDir(idx, fragmentPos);
+}
+
+vec3 spotCol(uint idx, vec3 fragmentPos) {
+	float ext = clamp((dot(-normalize(lssbo.lights[idx].lightPos - fragmentPos), lightDir(idx)) - lubo.cosOut) / (lubo.cosIn - lubo.cosOut), 0.0, 1.0); // Extended light model factor.
+	return ext * pointCol(idx, fragmentPos);
+}
+
+// Fraction of the light reaching the fragment, from the tiles of the light in the shadow atlas.
+float shadow(uint idx, vec3 fragmentPos) {
+	uint first = lssbo.lights[idx].TYPE >> LIGHT_SHADOW_SHIFT;
+	if (first == 0u) {
+		return 1.0;
+	}
+	uint tile = first - 1u;
+	if ((lssbo.lights[idx].TYPE & 0xFFu) == LIGHT_POINT) {
+		// Cube faces +X, -X, +Y, -Y, +Z, -Z: the one of the major axis.
+		vec3 v = fragmentPos - lssbo.lights[idx].lightPos;
+		vec3 a = abs(v);
+		tile += a.x >= a.y && a.x >= a.z ? (v.x > 0.0 ? 0u : 1u) : (a.y >= a.z ? (v.y > 0.0 ? 2u : 3u) : (v.z > 0.0 ? 4u : 5u));
+	}
+	vec4 p = subo.tileVP[tile] * vec4(fragmentPos, 1.0);
+	if (p.w <= 0.0) {
+		return 1.0;
+	}
+	p.xyz /= p.w;
+	// Half a texel inside the tile, so that the filtering never reads the neighbouring ones.
+	vec2 uv = clamp(p.xy * 0.5 + 0.5, vec2(0.5 / SHADOW_TILE_SIZE), vec2(1.0 - 0.5 / SHADOW_TILE_SIZE));
+	uv = (vec2(tile % SHADOW_TILES_PER_ROW, tile / SHADOW_TILES_PER_ROW) + uv) / float(SHADOW_TILES_PER_ROW);
+	return texture(shadowMap, vec3(uv, p.z));
+}
+
+
+vec3 PhongBRDF(vec3 V, vec3 N, vec3 L, vec3 mDiffuse, vec3 mSpecular, bool specular) {
+	vec3 Diffuse = mDiffuse * max(dot(N, L), 0.0f);
+	//vec3 Diffuse = mDiffuse;
+	vec3 Specular = mSpecular * vec3(pow(max(dot(V, -reflect(L, N)), 0.0f), 150.0f));
+	//vec3 Specular = vec3(pow(max(dot(V, -reflect(L, N)), 0.0f), 150.0f));
+	
+	return (Diffuse + (specular ? Specular : vec3(0)));
+}
+
+
+vec3 ToonBRDF(vec3 V, vec3 N, vec3 L, vec3 mDiffuse, vec3 mSpecular, bool specular) {
+	// Diffuse.
+	float dDot = dot(N, L), dShading;
+
+	float rMin, rMax, range;
+	float iLow, iHigh;
+	if (dDot <= 0.7) {
+		rMin = 0.0; rMax = 0.15; range = rMax - rMin;
+		iLow = 0.0; iHigh = 0.1;
+	}
+	if (0.1 < dDot) {
+		rMin = 0.15; rMax = 1.0; range = rMax - rMin;
+		iLow = 0.7; iHigh = 0.8;
+	}
+
+	dShading = clamp(rMin + range * ((dDot - iLow) / (iHigh - iLow)), rMin, rMax);
+
+	vec3 Diffuse = dShading * mDiffuse;
+
+	// Specular.
+	float sDot = dot(V, -reflect(L, N)), sShading;
+
+	if (sDot <= 0.9)
+		sShading = 0.0;
+	else if (0.9 < sDot && sDot <= 0.95) {
+		float min = 0.0, max = 1.0, range = max - min;
+		
+		sShading = min + range * ((sDot - 0.9) / (0.95 - 0.9));
+	}
+	else if (0.95 < sDot)
+		sShading = 1.0;
+
+	vec3 Specular = sShading * mSpecular;
+	
+	// Shader.
+	return (Diffuse + (specular ? Specular : vec3(0)));
+}
+
+
+vec3 shade(uint i, vec3 EyeDir, vec3 Norm, vec3 Albedo, vec3 fragmentPos, uint material) {
+	vec3 L = vec3(0.0f), Col = vec3(0.0f);
+	switch (lssbo.lights[i].TYPE & 0xFFu) {
+		case LIGHT_DIRECT:
+			L = directDir(i);
+			Col = directCol(i);
+			break;
+		case LIGHT_POINT:
+			L = pointDir(i, fragmentPos);
+			Col = pointCol(i, fragmentPos) * shadow(i, fragmentPos);
+			break;
+		case LIGHT_SPOT:
+			L = spotDir(i, fragmentPos);
+			Col = spotCol(i, fragmentPos) * shadow(i, fragmentPos);
+			break;
+	}
+	bool specular = (material & MATERIAL_SPECULAR) != 0u;
+	vec3 BRDF = (material & MATERIAL_TOON) != 0u ? ToonBRDF(EyeDir, Norm, L, Albedo, vec3(1.0f), specular)
+	                                             : PhongBRDF(EyeDir, Norm, L, Albedo, vec3(1.0f), specular);
+	return BRDF * Col * lssbo.lights[i].lightPow;
+}
+
+
+// Lighting pass of the deferred path: the same light loop as Phong.frag and Toon.frag, run once per pixel
+// on the G-buffer. The depth is written back so that the forward pipelines drawn afterwards are occluded.
+void main() {
+	ivec2 texel = ivec2(gl_FragCoord.xy);
+	float depth = texelFetch(gDepth, texel, 0).r;
+	if (depth >= 1.0) {
+		discard;
+	}
+	vec4 gAlb = texelFetch(gAlbedo, texel, 0);
+	uint material = uint(gAlb.a * 255.0 + 0.5);
+	vec2 ndc = (vec2(texel) + 0.5) / vec2(textureSize(gDepth, 0)) * 2.0 - 1.0;
+	vec4 p = lubo.invViewPrj * vec4(ndc, depth, 1.0);
+	vec3 fragPos = p.xyz / p.w;
+
+	vec3 EyeDir = normalize(lubo.eyeDir);
+	vec3 Norm = normalize(texelFetch(gNormal, texel, 0).xyz);
+	vec3 Albedo = gAlb.rgb;
+	vec3 Fun = vec3(0.0f);
+	// Direct lights reach every fragment.
+	for (uint i = 0; i < lubo.GLOBAL; i++) {
+		Fun += shade(i, EyeDir, Norm, Albedo, fragPos, material);
+	}
+	// Point and spot lights: only the ones binned into this fragment's cluster.
+	uvec3 cluster = uvec3(min(gl_FragCoord.xy * lubo.clusterScale.xy, vec2(CLUSTER_X - 1, CLUSTER_Y - 1)),
+	                      clamp(depth * lubo.clusterScale.z + lubo.clusterScale.w, 0.0, float(CLUSTER_Z - 1)));
+	uvec2 range = cssbo.clusters[(cluster.z * CLUSTER_Y + cluster.y) * CLUSTER_X + cluster.x];
+	for (uint k = 0; k < range.y; k++) {
+		Fun += shade(cssbo.indices[range.x + k], EyeDir, Norm, Albedo, fragPos, material);
+	}
+	vec3 Ambient = vec3(0.01f);
+
+	outColor = vec4(Fun + Ambient * Albedo, 1.0f);
+	gl_FragDepth = depth;
+}
@@ -0,0 +1,12 @@
+#version 450
+#extension GL_ARB_separate_shader_objects : enable
+
+
+layout(location = 0) in vec3 inPos;
+layout(location = 1) in vec2 inUV;
+
+
+// Full-screen quad of the deferred lighting pass: the depth is taken from the G-buffer.
+void main() {
+	gl_Position = vec4(inPos.xy, 0.5, 1.0);
+}
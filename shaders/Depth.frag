@@ -0,0 +1,7 @@
+#version 450
+#extension GL_ARB_separate_shader_objects : enable
+
+
+// Depth pre-pass: nothing to shade, the depth is written by the fixed function stages.
+void main() {
+}
@@ -0,0 +1,55 @@
+#version 450
+#extension GL_ARB_separate_shader_objects : enable
+
+
+const float FXAA_EDGE_THRESHOLD = 1.0 / 8.0;
+const float FXAA_EDGE_THRESHOLD_MIN = 1.0 / 32.0;
+const float FXAA_REDUCE_MUL = 1.0 / 8.0;
+const float FXAA_REDUCE_MIN = 1.0 / 128.0;
+const float FXAA_SPAN_MAX = 8.0;
+
+layout(set = 0, binding = 0) uniform sampler2D sceneColor;
+
+
+layout(location = 0) in vec2 fragUV;
+
+layout(location = 0) out vec4 outColor;
+
+
+// The image is sampled linear: the edge detection works on perceptual luma.
+float luma(vec3 c) {
+	return sqrt(dot(c, vec3(0.299, 0.587, 0.114)));
+}
+
+
+void main() {
+	vec2 texel = 1.0 / vec2(textureSize(sceneColor, 0));
+	vec3 rgbM = texture(sceneColor, fragUV).rgb;
+	float lumaM = luma(rgbM);
+	float lumaNW = luma(texture(sceneColor, fragUV + vec2(-1.0, -1.0) * texel).rgb);
+	float lumaNE = luma(texture(sceneColor, fragUV + vec2(1.0, -1.0) * texel).rgb);
+	float lumaSW = luma(texture(sceneColor, fragUV + vec2(-1.0, 1.0) * texel).rgb);
+	float lumaSE = luma(texture(sceneColor, fragUV + vec2(1.0, 1.0) * texel).rgb);
+
+	float lumaMin = min(lumaM, min(min(lumaNW, lumaNE), min(lumaSW, lumaSE)));
+	float lumaMax = max(lumaM, max(max(lumaNW, lumaNE), max(lumaSW, lumaSE)));
+	// Low contrast: not an edge.
+	if (lumaMax - lumaMin < max(FXAA_EDGE_THRESHOLD_MIN, lumaMax * FXAA_EDGE_THRESHOLD)) {
+		outColor = vec4(rgbM, 1.0);
+		return;
+	}
+
+	// Blur along the edge, perpendicular to the luma gradient.
+	vec2 dir = vec2(-((lumaNW + lumaNE) - (lumaSW + lumaSE)), (lumaNW + lumaSW) - (lumaNE + lumaSE));
+	float dirReduce = max((lumaNW + lumaNE + lumaSW + lumaSE) * 0.25 * FXAA_REDUCE_MUL, FXAA_REDUCE_MIN);
+	float rcpDirMin = 1.0 / (min(abs(dir.x), abs(dir.y)) + dirReduce);
+	dir = clamp(dir * rcpDirMin, vec2(-FXAA_SPAN_MAX), vec2(FXAA_SPAN_MAX)) * texel;
+
+	vec3 rgbA = 0.5 * (texture(sceneColor, fragUV + dir * (1.0 / 3.0 - 0.5)).rgb +
+	                   texture(sceneColor, fragUV + dir * (2.0 / 3.0 - 0.5)).rgb);
+	vec3 rgbB = rgbA * 0.5 + 0.25 * (texture(sceneColor, fragUV - dir * 0.5).rgb +
+	                                 texture(sceneColor, fragUV + dir * 0.5).rgb);
+	// The wider tap crossed another edge: keep the narrow one.
+	float lumaB = luma(rgbB);
+	outColor = vec4(lumaB < lumaMin || lumaB > lumaMax ? rgbA : rgbB, 1.0);
+}
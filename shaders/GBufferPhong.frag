@@ -0,0 +1,35 @@
+#version 450
+#extension GL_ARB_separate_shader_objects : enable
+
+
+// Material ids stored in the alpha of the albedo target, keep in sync with Deferred.frag.
+const uint MATERIAL_PHONG = 0;
+const uint MATERIAL_TOON = 1;
+const uint MATERIAL_SPECULAR = 2;
+
+layout(set = 1, binding = 2) uniform ArgsUBO {
+	bool diffuse;
+	bool specular;
+} aubo;
+
+
+layout(location = 0) in vec3 fragPos;
+layout(location = 1) in vec3 fragNorm;
+layout(location = 2) in vec2 fragUV;
+
+layout(location = 0) out vec4 outAlbedo;
+layout(location = 1) out vec4 outNormal;
+
+// Keep in sync with modules/Scene.hpp.
+const uint MAX_SCENE_TEXTURES = 64;
+layout(set = 2, binding = 0) uniform sampler2D textures[MAX_SCENE_TEXTURES];
+layout(push_constant) uniform InstancePushConstant {
+	uint textureId;
+} ipc;
+
+
+void main() {
+	uint material = MATERIAL_PHONG | (aubo.specular ? MATERIAL_SPECULAR : 0u);
+	outAlbedo = vec4(texture(textures[ipc.textureId], fragUV).rgb, float(material) / 255.0);
+	outNormal = vec4(normalize(fragNorm), 0.0);
+}
@@ -9,18 +9,30 @@ layout(set = 1, binding = 0) uniform UBO {
 } ubo;
 
 
+// Compressed ObjectVertex (modules/Scene.hpp): the position is normalized over the mesh bounds and mMat, mvpMat
+// include its dequantization; the normal is octahedral-encoded.
 layout(location = 0) in vec3 inPos;
-layout(location = 1) in vec3 inNorm;
+layout(location = 1) in vec2 inNorm;
 layout(location = 2) in vec2 inUV;
 
 layout(location = 0) out vec3 fragPos;
 layout(location = 1) out vec3 fragNorm;
 layout(location = 2) out vec2 fragUV;
 
+// The depth pre-pass and the shading pass must compute the same depth for the EQUAL test.
+invariant gl_Position;
+
+vec3 octDecode(vec2 e) {
+	vec3 n = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+	float t = max(-n.z, 0.0);
+	n.xy += mix(vec2(t), vec2(-t), greaterThanEqual(n.xy, vec2(0.0)));
+	return normalize(n);
+}
+
 void main() {
 	gl_Position = ubo.mvpMat * vec4(inPos, 1.0);
 
 	fragPos = (ubo.mMat * vec4(inPos, 1.0)).xyz;
-	fragNorm = mat3(ubo.nMat) * inNorm;
+	fragNorm = mat3(ubo.nMat) * octDecode(inNorm);
 	fragUV = inUV;
 }
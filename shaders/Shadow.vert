@@ -0,0 +1,20 @@
+#version 450
+#extension GL_ARB_separate_shader_objects : enable
+
+// Keep in sync with modules/ShadowAtlas.hpp.
+const uint SHADOW_TILES = 64;
+
+layout(set = 0, binding = 3) uniform ShadowUBO {
+	mat4 tileVP[SHADOW_TILES];
+} subo;
+
+layout(push_constant) uniform PushConstants {
+	mat4 mMat;
+	uint tile;
+} pc;
+
+layout(location = 0) in vec3 inPos;
+
+void main() {
+	gl_Position = subo.tileVP[pc.tile] * pc.mMat * vec4(inPos, 1.0);
+}
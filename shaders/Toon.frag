@@ -1 +1 @@
-#version 450#extension GL_ARB_separate_shader_objects : enableconst int MAX_LIGHTS = 32;layout(set = 0, binding = 0) uniform LightUBO {	vec3 TYPE[MAX_LIGHTS];	vec3 lightPos[MAX_LIGHTS];	vec3 lightDir[MAX_LIGHTS];	vec4 lightCol[MAX_LIGHTS];	vec3 lightPow[MAX_LIGHTS];	float cosIn;	float cosOut;	uint NUMBER;	vec3 eyeDir;} lubo;layout(set = 1, binding = 2) uniform ArgsUBO {	bool diffuse;	bool specular;} aubo;layout(location = 0) in vec3 fragPos;layout(location = 1) in vec3 fragNorm;layout(location = 2) in vec2 fragUV;layout(location = 0) out vec4 outColor;layout(set = 1, binding = 1) uniform sampler2D tex;vec3 directDir(int idx) {	return -normalize(lubo.lightDir[idx]);}vec3 directCol(int idx) {	return lubo.lightCol[idx].rgb;}vec3 pointDir(int idx, vec3 fragmentPos) {	return normalize(lubo.lightPos[idx] - fragmentPos);}vec3 pointCol(int idx, vec3 fragmentPos) {	return pow(lubo.lightCol[idx].a / length(lubo.lightPos[idx] - fragmentPos), 2.0) * lubo.lightCol[idx].rgb;}vec3 spotDir(int idx, vec3 fragmentPos) {	return pointDir(idx, fragmentPos);}vec3 spotCol(int idx, vec3 fragmentPos) {	float ext = clamp((dot(-normalize(lubo.lightPos[idx] - fragmentPos), lubo.lightDir[idx]) - lubo.cosOut) / (lubo.cosIn - lubo.cosOut), 0.0, 1.0); // Extended light model factor.	return ext * pointCol(idx, fragmentPos);}vec3 BRDF(vec3 V, vec3 N, vec3 L, vec3 mDiffuse, vec3 mSpecular, bool specular) {	// Diffuse.	float dDot = dot(N, L), dShading;	float rMin, rMax, range;	float iLow, iHigh;	if (dDot <= 0.7) {		rMin = 0.0; rMax = 0.15; range = rMax - rMin;		iLow = 0.0; iHigh = 0.1;	}	if (0.1 < dDot) {		rMin = 0.15; rMax = 1.0; range = rMax - rMin;		iLow = 0.7; iHigh = 0.8;	}	dShading = clamp(rMin + range * ((dDot - iLow) / (iHigh - iLow)), rMin, rMax);	vec3 Diffuse = dShading * mDiffuse;	// Specular.	float sDot = dot(V, -reflect(L, N)), sShading;	if (sDot <= 0.9)		sShading = 0.0;	else if (0.9 < sDot && sDot <= 0.95) {		float min = 0.0, max = 1.0, range = max - min;				sShading = min + range * ((sDot - 0.9) / (0.95 - 0.9));	}	else if (0.95 < sDot)		sShading = 1.0;	vec3 Specular = sShading * mSpecular;		// Shader.	return (Diffuse + (aubo.specular ? Specular : vec3(0)));}void main() {	vec3 EyeDir = normalize(lubo.eyeDir);	vec3 Norm = normalize(fragNorm);	vec3 Albedo = texture(tex, fragUV).rgb;	vec3 L, lightCol, Eq = vec3(0.0f);	uint maskD, maskP, maskS;	for (int i = 0; i < lubo.NUMBER; i++) {		maskD = uint(lubo.TYPE[i].x); maskP = uint(lubo.TYPE[i].y); maskS = uint(lubo.TYPE[i].z);		if (maskD == 1) {			L = directDir(i);			lightCol = directCol(i);		} else if (maskP == 1) {			L = pointDir(i, fragPos);			lightCol = pointCol(i, fragPos);		} else if (maskS == 1) {			L = spotDir(i, fragPos);			lightCol = spotCol(i, fragPos);		}		Eq += BRDF(EyeDir, Norm, L, Albedo, vec3(1.0f), false) * lightCol.rgb * lubo.lightPow[i].rgb;	}	vec3 Ambient = vec3(0.01f);	outColor = vec4(Eq + Ambient * Albedo, 1.0f);}
\ No newline at end of file
+#version 450#extension GL_ARB_separate_shader_objects : enable// Keep in sync with modules/LightGrid.hpp and modules/ShadowAtlas.hpp.const uint CLUSTER_X = 16;const uint CLUSTER_Y = 12;const uint CLUSTER_Z = 8;const float LIGHT_CUTOFF = 0.002;const uint LIGHT_DIRECT = 0;const uint LIGHT_POINT = 1;const uint LIGHT_SPOT = 2;const uint LIGHT_SHADOW_SHIFT = 8;const uint SHADOW_TILES_PER_ROW = 8;const uint SHADOW_TILES = SHADOW_TILES_PER_ROW * SHADOW_TILES_PER_ROW;const float SHADOW_TILE_SIZE = 512.0;struct Light {	vec3 lightPos;	uint TYPE;	uint lightDir; // Octahedral, 2 x snorm16.	float lightPow;	uvec2 lightCol; // 4 x half: rgb + decay distance.};layout(set = 0, binding = 0) uniform LightUBO {	vec3 eyeDir;	vec4 clusterScale;	float cosIn;	float cosOut;	uint NUMBER;	uint GLOBAL;} lubo;layout(std430, set = 0, binding = 1) readonly buffer LightSSBO {	Light lights[];} lssbo;layout(std430, set = 0, binding = 2) readonly buffer ClusterSSBO {	uvec2 clusters[CLUSTER_X * CLUSTER_Y * CLUSTER_Z];	uint indices[];} cssbo;layout(set = 0, binding = 3) uniform ShadowUBO {	mat4 tileVP[SHADOW_TILES];} subo;layout(set = 0, binding = 4) uniform sampler2DShadow shadowMap;layout(set = 1, binding = 2) uniform ArgsUBO {	bool diffuse;	bool specular;} aubo;layout(location = 0) in vec3 fragPos;layout(location = 1) in vec3 fragNorm;layout(location = 2) in vec2 fragUV;layout(location = 0) out vec4 outColor;// Keep in sync with modules/Scene.hpp.const uint MAX_SCENE_TEXTURES = 64;layout(set = 2, binding = 0) uniform sampler2D textures[MAX_SCENE_TEXTURES];layout(push_constant) uniform InstancePushConstant {	uint textureId;} ipc;vec3 lightDir(uint idx) {	vec2 e = unpackSnorm2x16(lssbo.lights[idx].lightDir);	vec3 v = vec3(e, 1.0 - abs(e.x) - abs(e.y));	float t = max(-v.z, 0.0);	v.xy += vec2(v.x >= 0.0 ? -t : t, v.y >= 0.0 ? -t : t);	return normalize(v);}vec4 lightCol(uint idx) {	return vec4(unpackHalf2x16(lssbo.lights[idx].lightCol.x), unpackHalf2x16(lssbo.lights[idx].lightCol.y));}vec3 directDir(uint idx) {	return -lightDir(idx);}vec3 directCol(uint idx) {	return lightCol(idx).rgb;}vec3 pointDir(uint idx, vec3 fragmentPos) {	return normalize(lssbo.lights[idx].lightPos - fragmentPos);}// Fades point and spot lights to zero at the radius used to bin them into the clusters.float rangeWindow(uint idx, vec3 fragmentPos) {	vec3 d = lssbo.lights[idx].lightPos - fragmentPos;	float g = lightCol(idx).a;	float r2 = max(g * g * lssbo.lights[idx].lightPow / LIGHT_CUTOFF, 1e-4);	float f = clamp(1.0 - (dot(d, d) / r2) * (dot(d, d) / r2), 0.0, 1.0);	return f * f;}vec3 pointCol(uint idx, vec3 fragmentPos) {	vec4 col = lightCol(idx);	return rangeWindow(idx, fragmentPos) * pow(col.a / length(lssbo.lights[idx].lightPos - fragmentPos), 2.0) * col.rgb;}vec3 spotDir(uint idx, vec3 fragmentPos) {	return pointDir(idx, fragmentPos);}vec3 spotCol(uint idx, vec3 fragmentPos) {	float ext = clamp((dot(-normalize(lssbo.lights[idx].lightPos - fragmentPos), lightDir(idx)) - lubo.cosOut) / (lubo.cosIn - lubo.cosOut), 0.0, 1.0); // Extended light model factor.	return ext * pointCol(idx, fragmentPos);}// Fraction of the light reaching the fragment, from the tiles of the light in the shadow atlas.float shadow(uint idx, vec3 fragmentPos) {	uint first = lssbo.lights[idx].TYPE >> LIGHT_SHADOW_SHIFT;	if (first == 0u) {		return 1.0;	}	uint tile = first - 1u;	if ((lssbo.lights[idx].TYPE & 0xFFu) == LIGHT_POINT) {		// Cube faces +X, -X, +Y, -Y, +Z, -Z: the one of the major axis.		vec3 v = fragmentPos - lssbo.lights[idx].lightPos;		vec3 a = abs(v);		tile += a.x >= a.y && a.x >= a.z ? (v.x > 0.0 ? 0u : 1u) : (a.y >= a.z ? (v.y > 0.0 ? 2u : 3u) : (v.z > 0.0 ? 4u : 5u));	}	vec4 p = subo.tileVP[tile] * vec4(fragmentPos, 1.0);	if (p.w <= 0.0) {		return 1.0;	}	p.xyz /= p.w;	// Half a texel inside the tile, so that the filtering never reads the neighbouring ones.	vec2 uv = clamp(p.xy * 0.5 + 0.5, vec2(0.5 / SHADOW_TILE_SIZE), vec2(1.0 - 0.5 / SHADOW_TILE_SIZE));	uv = (vec2(tile % SHADOW_TILES_PER_ROW, tile / SHADOW_TILES_PER_ROW) + uv) / float(SHADOW_TILES_PER_ROW);	return texture(shadowMap, vec3(uv, p.z));}vec3 BRDF(vec3 V, vec3 N, vec3 L, vec3 mDiffuse, vec3 mSpecular, bool specular) {	// Diffuse.	float dDot = dot(N, L), dShading;	float rMin, rMax, range;	float iLow, iHigh;	if (dDot <= 0.7) {		rMin = 0.0; rMax = 0.15; range = rMax - rMin;		iLow = 0.0; iHigh = 0.1;	}	if (0.1 < dDot) {		rMin = 0.15; rMax = 1.0; range = rMax - rMin;		iLow = 0.7; iHigh = 0.8;	}	dShading = clamp(rMin + range * ((dDot - iLow) / (iHigh - iLow)), rMin, rMax);	vec3 Diffuse = dShading * mDiffuse;	// Specular.	float sDot = dot(V, -reflect(L, N)), sShading;	if (sDot <= 0.9)		sShading = 0.0;	else if (0.9 < sDot && sDot <= 0.95) {		float min = 0.0, max = 1.0, range = max - min;				sShading = min + range * ((sDot - 0.9) / (0.95 - 0.9));	}	else if (0.95 < sDot)		sShading = 1.0;	vec3 Specular = sShading * mSpecular;		// Shader.	return (Diffuse + (aubo.specular ? Specular : vec3(0)));}vec3 shade(uint i, vec3 EyeDir, vec3 Norm, vec3 Albedo, vec3 fragmentPos) {	vec3 L = vec3(0.0f), Col = vec3(0.0f);	switch (lssbo.lights[i].TYPE & 0xFFu) {		case LIGHT_DIRECT:			L = directDir(i);			Col = directCol(i);			break;		case LIGHT_POINT:			L = pointDir(i, fragmentPos);			Col = pointCol(i, fragmentPos) * shadow(i, fragmentPos);			break;		case LIGHT_SPOT:			L = spotDir(i, fragmentPos);			Col = spotCol(i, fragmentPos) * shadow(i, fragmentPos);			break;	}	return BRDF(EyeDir, Norm, L, Albedo, vec3(1.0f), false) * Col * lssbo.lights[i].lightPow;}void main() {	vec3 EyeDir = normalize(lubo.eyeDir);	vec3 Norm = normalize(fragNorm);	vec3 Albedo = texture(textures[ipc.textureId], fragUV).rgb;	vec3 Eq = vec3(0.0f);	// Direct lights reach every fragment.	for (uint i = 0; i < lubo.GLOBAL; i++) {		Eq += shade(i, EyeDir, Norm, Albedo, fragPos);	}	// Point and spot lights: only the ones binned into this fragment's cluster.	uvec3 cluster = uvec3(min(gl_FragCoord.xy * lubo.clusterScale.xy, vec2(CLUSTER_X - 1, CLUSTER_Y - 1)),	                      clamp(gl_FragCoord.z * lubo.clusterScale.z + lubo.clusterScale.w, 0.0, float(CLUSTER_Z - 1)));	uvec2 range = cssbo.clusters[(cluster.z * CLUSTER_Y + cluster.y) * CLUSTER_X + cluster.x];	for (uint k = 0; k < range.y; k++) {		Eq += shade(cssbo.indices[range.x + k], EyeDir, Norm, Albedo, fragPos);	}	vec3 Ambient = vec3(0.01f);	outColor = vec4(Eq + Ambient * Albedo, 1.0f);}
\ No newline at end of file
@@ -4,3 +4,12 @@ glslc Phong.frag -o Phong.frag.spv
 
 glslc Emission.vert -o Emission.vert.spv
 glslc Emission.frag -o Emission.frag.spv
+glslc Shadow.vert -o Shadow.vert.spv
+glslc GBufferPhong.frag -o GBufferPhong.frag.spv
+glslc GBufferToon.frag -o GBufferToon.frag.spv
+glslc Deferred.vert -o Deferred.vert.spv
+glslc Deferred.frag -o Deferred.frag.spv
+glslc FXAA.vert -o FXAA.vert.spv
+glslc FXAA.frag -o FXAA.frag.spv
+glslc Depth.frag -o Depth.frag.spv
+glslc Mipmap.comp -o Mipmap.comp.spv